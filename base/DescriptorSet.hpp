@@ -73,6 +73,17 @@ public:
 		writeDescriptorSet.descriptorCount = descriptorCount;
 		descriptors.push_back(writeDescriptorSet);
 	}
+	void updateDescriptor(uint32_t binding, VkDescriptorType type, VkDescriptorBufferInfo* bufferInfo, uint32_t descriptorCount = 1) {
+		for (auto &descriptor : descriptors) {
+			if (descriptor.dstBinding == binding) {
+				descriptor.descriptorType = type;
+				descriptor.pBufferInfo = bufferInfo;
+				descriptor.descriptorCount = descriptorCount;
+				vkUpdateDescriptorSets(device, 1, &descriptor, 0, nullptr);
+				break;
+			}
+		}
+	}
 	void updateDescriptor(uint32_t binding, VkDescriptorType type, VkDescriptorImageInfo* imageInfo, uint32_t descriptorCount = 1) {
 		VkWriteDescriptorSet writeDescriptorSet{};
 		for (auto &descriptor : descriptors) {
@@ -1,14 +1,37 @@
 #include "Noise.h"
 
 #include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <glm/gtc/constants.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NOISE_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #pragma once
 
+void NoiseGenerator::noise(const float* x, const float* y, float* values, glm::vec2* derivatives, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        values[i] = noise(x[i], y[i], derivatives[i]);
+    }
+}
+
 float PerlinNoise::fade(float t)
 {
     return t * t * t * (t * (t * 6 - 15) + 10);
 }
 
+float PerlinNoise::fadeDerivative(float t)
+{
+    return 30.0f * t * t * (t * (t - 2.0f) + 1.0f);
+}
+
 float PerlinNoise::lerp(float t, float a, float b)
 {
     return a + t * (b - a);
@@ -19,6 +42,11 @@ float PerlinNoise::grad(int hash, float x, float y)
     return ((hash & 1) == 0 ? x : -x) + ((hash & 2) == 0 ? y : -y);
 }
 
+glm::vec2 PerlinNoise::gradient(int hash)
+{
+    return glm::vec2((hash & 1) == 0 ? 1.0f : -1.0f, (hash & 2) == 0 ? 1.0f : -1.0f);
+}
+
 float PerlinNoise::noise(float x, float y)
 {
     int32_t X = (int32_t)floor(x) & 255;
@@ -31,3 +59,383 @@ float PerlinNoise::noise(float x, float y)
     uint32_t B = (permutations[X + 1] + Y) & 0xff;
     return lerp(v, lerp(u, grad(permutations[A], x, y), grad(permutations[B], x - 1, y)), lerp(u, grad(permutations[A + 1], x, y - 1), grad(permutations[B + 1], x - 1, y - 1)));
 }
+
+float PerlinNoise::noise(float x, float y, glm::vec2& derivative)
+{
+    int32_t X = (int32_t)floor(x) & 255;
+    int32_t Y = (int32_t)floor(y) & 255;
+    x -= floor(x);
+    y -= floor(y);
+    float u = fade(x);
+    float v = fade(y);
+    float du = fadeDerivative(x);
+    float dv = fadeDerivative(y);
+    uint32_t A = (permutations[X] + Y) & 0xff;
+    uint32_t B = (permutations[X + 1] + Y) & 0xff;
+    // Corner contributions and their (constant) gradients
+    float a = grad(permutations[A], x, y);
+    float b = grad(permutations[B], x - 1, y);
+    float c = grad(permutations[A + 1], x, y - 1);
+    float d = grad(permutations[B + 1], x - 1, y - 1);
+    glm::vec2 ga = gradient(permutations[A]);
+    glm::vec2 gb = gradient(permutations[B]);
+    glm::vec2 gc = gradient(permutations[A + 1]);
+    glm::vec2 gd = gradient(permutations[B + 1]);
+    // Expanded form of the bilinear interpolation: a + u(b - a) + v(c - a) + uv(a - b - c + d)
+    float k = a - b - c + d;
+    derivative = ga + u * (gb - ga) + v * (gc - ga) + u * v * (ga - gb - gc + gd);
+    derivative.x += du * (b - a + v * k);
+    derivative.y += dv * (c - a + u * k);
+    return a + u * (b - a) + v * (c - a) + u * v * k;
+}
+
+// Quintic interpolation curve and its derivative shared by the hashed noise types
+static inline float quinticFade(float t)
+{
+    return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+static inline float quinticFadeDerivative(float t)
+{
+    return 30.0f * t * t * (t * (t - 2.0f) + 1.0f);
+}
+
+/*
+    OpenSimplex2S
+*/
+
+// Skew and unskew factors for the triangular lattice
+static constexpr float SKEW_2D = 0.366025403784439f;
+static constexpr float UNSKEW_2D = -0.21132486540518713f;
+static constexpr float RSQUARED_2D = 2.0f / 3.0f;
+// Scales the output to match the distribution of the Perlin noise
+static constexpr float OPENSIMPLEX2S_NORMALIZER = 13.25f;
+
+// 24 evenly spaced unit gradients
+static const std::vector<glm::vec2> simplexGradients = [] {
+    std::vector<glm::vec2> gradients(24);
+    for (size_t i = 0; i < gradients.size(); i++) {
+        const float angle = ((float)i + 0.5f) * glm::two_pi<float>() / (float)gradients.size();
+        gradients[i] = glm::vec2(cos(angle), sin(angle));
+    }
+    return gradients;
+}();
+
+float OpenSimplex2SNoise::contribution(int32_t xsv, int32_t ysv, float dx, float dy, glm::vec2& derivative)
+{
+    const float a = RSQUARED_2D - dx * dx - dy * dy;
+    if (a <= 0.0f) {
+        return 0.0f;
+    }
+    const glm::vec2 g = simplexGradients[hashNoise(xsv, ysv, seed) % 24];
+    const float gd = g.x * dx + g.y * dy;
+    const float a2 = a * a;
+    const float a4 = a2 * a2;
+    // d/dp (a^4 * dot(g, d)) with d = p - vertex and a = r^2 - dot(d, d)
+    derivative += a4 * g - 8.0f * a2 * a * gd * glm::vec2(dx, dy);
+    return a4 * gd;
+}
+
+float OpenSimplex2SNoise::noise(float x, float y, glm::vec2& derivative)
+{
+    // Skew the input onto the lattice
+    const float s = SKEW_2D * (x + y);
+    const float xs = x + s;
+    const float ys = y + s;
+    const int32_t xsb = (int32_t)floor(xs);
+    const int32_t ysb = (int32_t)floor(ys);
+    const float xi = xs - (float)xsb;
+    const float yi = ys - (float)ysb;
+    // Unskewed offset to the base vertex
+    const float t = (xi + yi) * UNSKEW_2D;
+    const float dx0 = xi + t;
+    const float dy0 = yi + t;
+
+    derivative = glm::vec2(0.0f);
+    float value = contribution(xsb, ysb, dx0, dy0, derivative);
+    value += contribution(xsb + 1, ysb + 1, dx0 - (1.0f + 2.0f * UNSKEW_2D), dy0 - (1.0f + 2.0f * UNSKEW_2D), derivative);
+
+    // Pick the two remaining vertices that can be within range depending on the position inside the lattice cell
+    const float xmyi = xi - yi;
+    if (t < UNSKEW_2D) {
+        if (xi + xmyi > 1.0f) {
+            value += contribution(xsb + 2, ysb + 1, dx0 - (3.0f * UNSKEW_2D + 2.0f), dy0 - (3.0f * UNSKEW_2D + 1.0f), derivative);
+        } else {
+            value += contribution(xsb, ysb + 1, dx0 - UNSKEW_2D, dy0 - (UNSKEW_2D + 1.0f), derivative);
+        }
+        if (yi - xmyi > 1.0f) {
+            value += contribution(xsb + 1, ysb + 2, dx0 - (3.0f * UNSKEW_2D + 1.0f), dy0 - (3.0f * UNSKEW_2D + 2.0f), derivative);
+        } else {
+            value += contribution(xsb + 1, ysb, dx0 - (UNSKEW_2D + 1.0f), dy0 - UNSKEW_2D, derivative);
+        }
+    } else {
+        if (xi + xmyi < 0.0f) {
+            value += contribution(xsb - 1, ysb, dx0 + (1.0f + UNSKEW_2D), dy0 + UNSKEW_2D, derivative);
+        } else {
+            value += contribution(xsb + 1, ysb, dx0 - (UNSKEW_2D + 1.0f), dy0 - UNSKEW_2D, derivative);
+        }
+        if (yi < xmyi) {
+            value += contribution(xsb, ysb - 1, dx0 + UNSKEW_2D, dy0 + (UNSKEW_2D + 1.0f), derivative);
+        } else {
+            value += contribution(xsb, ysb + 1, dx0 - UNSKEW_2D, dy0 - (UNSKEW_2D + 1.0f), derivative);
+        }
+    }
+
+    derivative *= OPENSIMPLEX2S_NORMALIZER;
+    return value * OPENSIMPLEX2S_NORMALIZER;
+}
+
+/*
+    Value noise
+*/
+
+// Scales the [-0.5..0.5) lattice values to match the distribution of the Perlin noise
+static constexpr float VALUE_NOISE_NORMALIZER = 1.34f;
+
+float ValueNoise::noise(float x, float y, glm::vec2& derivative)
+{
+    const float fx = floor(x);
+    const float fy = floor(y);
+    const int32_t X = (int32_t)fx;
+    const int32_t Y = (int32_t)fy;
+    x -= fx;
+    y -= fy;
+    const float u = quinticFade(x);
+    const float v = quinticFade(y);
+    const float du = quinticFadeDerivative(x);
+    const float dv = quinticFadeDerivative(y);
+    const float a = hashNoiseFloat(X, Y, seed) - 0.5f;
+    const float b = hashNoiseFloat(X + 1, Y, seed) - 0.5f;
+    const float c = hashNoiseFloat(X, Y + 1, seed) - 0.5f;
+    const float d = hashNoiseFloat(X + 1, Y + 1, seed) - 0.5f;
+    const float k = a - b - c + d;
+    derivative.x = du * (b - a + v * k) * VALUE_NOISE_NORMALIZER;
+    derivative.y = dv * (c - a + u * k) * VALUE_NOISE_NORMALIZER;
+    return (a + u * (b - a) + v * (c - a) + u * v * k) * VALUE_NOISE_NORMALIZER;
+}
+
+#if defined(NOISE_USE_SSE2)
+// SSE2 has no 32 bit integer multiply, so it's emulated with two 32x32->64 bit multiplies
+static inline __m128i mullo32(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Four wide version of hashNoiseFloat (minus 0.5)
+static inline __m128 hashNoiseValue4(__m128i x, __m128i y, __m128i seed)
+{
+    __m128i mangled = _mm_add_epi32(x, mullo32(y, _mm_set1_epi32(198491317)));
+    mangled = mullo32(mangled, _mm_set1_epi32(0x68E31DA4));
+    mangled = _mm_add_epi32(mangled, seed);
+    mangled = _mm_xor_si128(mangled, _mm_srli_epi32(mangled, 8));
+    mangled = _mm_add_epi32(mangled, _mm_set1_epi32((int32_t)0xB5297A4D));
+    mangled = _mm_xor_si128(mangled, _mm_slli_epi32(mangled, 8));
+    mangled = mullo32(mangled, _mm_set1_epi32(0x1B56C4E9));
+    mangled = _mm_xor_si128(mangled, _mm_srli_epi32(mangled, 8));
+    const __m128 value = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(mangled, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+    return _mm_sub_ps(value, _mm_set1_ps(0.5f));
+}
+
+static inline __m128 quinticFade4(__m128 t)
+{
+    __m128 r = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f));
+    r = _mm_add_ps(_mm_mul_ps(t, r), _mm_set1_ps(10.0f));
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), r);
+}
+
+static inline __m128 quinticFadeDerivative4(__m128 t)
+{
+    __m128 r = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(t, _mm_set1_ps(2.0f))), _mm_set1_ps(1.0f));
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), _mm_set1_ps(30.0f)), r);
+}
+
+static inline __m128i floor4(__m128 x, __m128& fractional)
+{
+    __m128i i = _mm_cvttps_epi32(x);
+    __m128 f = _mm_cvtepi32_ps(i);
+    // Truncation rounds towards zero, correct negative values (comparison mask is -1 for those lanes)
+    const __m128 mask = _mm_cmplt_ps(x, f);
+    i = _mm_add_epi32(i, _mm_castps_si128(mask));
+    f = _mm_sub_ps(f, _mm_and_ps(mask, _mm_set1_ps(1.0f)));
+    fractional = _mm_sub_ps(x, f);
+    return i;
+}
+#endif
+
+void ValueNoiseSIMD::noise(const float* x, const float* y, float* values, glm::vec2* derivatives, size_t count)
+{
+    size_t i = 0;
+#if defined(NOISE_USE_SSE2)
+    const __m128i seed4 = _mm_set1_epi32((int32_t)seed);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128 normalizer = _mm_set1_ps(VALUE_NOISE_NORMALIZER);
+    for (; i + 4 <= count; i += 4) {
+        __m128 fx, fy;
+        const __m128i X = floor4(_mm_loadu_ps(&x[i]), fx);
+        const __m128i Y = floor4(_mm_loadu_ps(&y[i]), fy);
+        const __m128i X1 = _mm_add_epi32(X, one);
+        const __m128i Y1 = _mm_add_epi32(Y, one);
+        const __m128 u = quinticFade4(fx);
+        const __m128 v = quinticFade4(fy);
+        const __m128 du = quinticFadeDerivative4(fx);
+        const __m128 dv = quinticFadeDerivative4(fy);
+        const __m128 a = hashNoiseValue4(X, Y, seed4);
+        const __m128 b = hashNoiseValue4(X1, Y, seed4);
+        const __m128 c = hashNoiseValue4(X, Y1, seed4);
+        const __m128 d = hashNoiseValue4(X1, Y1, seed4);
+        const __m128 ba = _mm_sub_ps(b, a);
+        const __m128 ca = _mm_sub_ps(c, a);
+        const __m128 k = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(a, b), c), d);
+        __m128 value = _mm_add_ps(_mm_add_ps(a, _mm_mul_ps(u, ba)), _mm_mul_ps(v, ca));
+        value = _mm_add_ps(value, _mm_mul_ps(_mm_mul_ps(u, v), k));
+        const __m128 derivativeX = _mm_mul_ps(_mm_mul_ps(du, _mm_add_ps(ba, _mm_mul_ps(v, k))), normalizer);
+        const __m128 derivativeY = _mm_mul_ps(_mm_mul_ps(dv, _mm_add_ps(ca, _mm_mul_ps(u, k))), normalizer);
+        _mm_storeu_ps(&values[i], _mm_mul_ps(value, normalizer));
+        // Interleave into glm::vec2
+        _mm_storeu_ps(&derivatives[i].x, _mm_unpacklo_ps(derivativeX, derivativeY));
+        _mm_storeu_ps(&derivatives[i + 2].x, _mm_unpackhi_ps(derivativeX, derivativeY));
+    }
+#endif
+    for (; i < count; i++) {
+        values[i] = ValueNoise::noise(x[i], y[i], derivatives[i]);
+    }
+}
+
+NoiseType getNoiseType(const std::string& name)
+{
+    for (size_t i = 0; i < noiseTypeNames.size(); i++) {
+        if (noiseTypeNames[i] == name) {
+            return (NoiseType)i;
+        }
+    }
+    std::cerr << "Unknown noise type \"" << name << "\", using perlin noise" << std::endl;
+    return NoiseType::Perlin;
+}
+
+namespace
+{
+    // Side length of the Poisson disk pattern in units of the minimum distance, large enough that repetitions aren't noticeable inside a chunk
+    constexpr int32_t poissonTileSize = 32;
+
+    // Bridson's algorithm on a torus, distances wrap around at the tile edges so the pattern can be repeated seamlessly
+    std::vector<glm::vec2> generatePoissonDiskTile(uint32_t seed)
+    {
+        constexpr uint32_t maxAttempts = 30;
+        const float size = (float)poissonTileSize;
+        // A cell can hold at most one point, the cell size is adjusted so a whole number of cells covers the tile
+        const int32_t gridSize = (int32_t)ceilf(size * sqrtf(2.0f));
+        const float cellSize = size / (float)gridSize;
+        const int32_t searchRadius = (int32_t)ceilf(1.0f / cellSize);
+        std::vector<int32_t> grid(gridSize * gridSize, -1);
+        std::vector<glm::vec2> points;
+        std::vector<uint32_t> active;
+
+        int32_t randomIndex = 0;
+        auto random = [&randomIndex, seed]() {
+            return hashNoiseFloat(randomIndex++, 0, seed);
+        };
+        auto getCell = [&](const glm::vec2& point) {
+            return glm::ivec2(std::min((int32_t)(point.x / cellSize), gridSize - 1), std::min((int32_t)(point.y / cellSize), gridSize - 1));
+        };
+        auto insert = [&](const glm::vec2& point) {
+            const glm::ivec2 cell = getCell(point);
+            grid[cell.y * gridSize + cell.x] = (int32_t)points.size();
+            active.push_back((uint32_t)points.size());
+            points.push_back(point);
+        };
+
+        insert(glm::vec2(random() * size, random() * size));
+        while (!active.empty()) {
+            const uint32_t activeIndex = std::min((uint32_t)(random() * (float)active.size()), (uint32_t)active.size() - 1);
+            const glm::vec2 origin = points[active[activeIndex]];
+            bool inserted = false;
+            for (uint32_t attempt = 0; (attempt < maxAttempts) && !inserted; attempt++) {
+                // Uniformly distributed in the annulus between the minimum distance and twice that distance around the origin
+                const float angle = random() * glm::two_pi<float>();
+                const float distance = sqrtf(1.0f + 3.0f * random());
+                glm::vec2 candidate = origin + glm::vec2(cosf(angle), sinf(angle)) * distance;
+                candidate -= glm::floor(candidate / size) * size;
+                const glm::ivec2 cell = getCell(candidate);
+                bool valid = true;
+                for (int32_t y = cell.y - searchRadius; valid && (y <= cell.y + searchRadius); y++) {
+                    for (int32_t x = cell.x - searchRadius; valid && (x <= cell.x + searchRadius); x++) {
+                        const int32_t neighbour = grid[((y + gridSize) % gridSize) * gridSize + ((x + gridSize) % gridSize)];
+                        if (neighbour >= 0) {
+                            glm::vec2 delta = points[neighbour] - candidate;
+                            delta -= glm::round(delta / size) * size;
+                            valid = glm::dot(delta, delta) >= 1.0f;
+                        }
+                    }
+                }
+                if (valid) {
+                    insert(candidate);
+                    inserted = true;
+                }
+            }
+            // Points without room for another neighbour are retired
+            if (!inserted) {
+                active[activeIndex] = active.back();
+                active.pop_back();
+            }
+        }
+        return points;
+    }
+
+    // Tiles are generated once per seed and shared by all chunks, generation threads may request them concurrently
+    const std::vector<glm::vec2>& getPoissonDiskTile(uint32_t seed)
+    {
+        static std::mutex mutex;
+        static std::map<uint32_t, std::vector<glm::vec2>> tiles;
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = tiles.find(seed);
+        if (it == tiles.end()) {
+            it = tiles.emplace(seed, generatePoissonDiskTile(seed)).first;
+        }
+        return it->second;
+    }
+}
+
+void poissonDiskSample(float width, float height, float minDistance, uint32_t seed, const glm::vec2& offset, std::vector<glm::vec2>& points)
+{
+    points.clear();
+    // Also rejects an infinite or NaN distance, which would result in an empty grid
+    if ((width <= 0.0f) || (height <= 0.0f) || !(minDistance > 0.0f) || !std::isfinite(minDistance)) {
+        return;
+    }
+    const std::vector<glm::vec2>& tile = getPoissonDiskTile(seed);
+    const float size = (float)poissonTileSize;
+    const glm::vec2 shift = glm::fract(offset) * size;
+    const float tileExtent = size * minDistance;
+    const int32_t tilesX = (int32_t)ceilf(width / tileExtent);
+    const int32_t tilesY = (int32_t)ceilf(height / tileExtent);
+    for (int32_t tileY = 0; tileY < tilesY; tileY++) {
+        for (int32_t tileX = 0; tileX < tilesX; tileX++) {
+            const glm::vec2 tileOrigin = glm::vec2((float)tileX, (float)tileY) * size;
+            for (const glm::vec2& tilePoint : tile) {
+                glm::vec2 point = tilePoint + shift;
+                point.x -= (point.x >= size) ? size : 0.0f;
+                point.y -= (point.y >= size) ? size : 0.0f;
+                point = (point + tileOrigin) * minDistance;
+                if ((point.x < width) && (point.y < height)) {
+                    points.push_back(point);
+                }
+            }
+        }
+    }
+}
+
+std::unique_ptr<NoiseGenerator> createNoiseGenerator(NoiseType type, uint32_t seed)
+{
+    switch (type) {
+    case NoiseType::OpenSimplex2S:
+        return std::make_unique<OpenSimplex2SNoise>(seed);
+    case NoiseType::Value:
+        return std::make_unique<ValueNoise>(seed);
+    case NoiseType::ValueSIMD:
+        return std::make_unique<ValueNoiseSIMD>(seed);
+    default:
+        return std::make_unique<PerlinNoise>();
+    }
+}
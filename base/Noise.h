@@ -2,19 +2,79 @@
 #include <vector>
 #include <numeric>
 #include <random>
+#include <memory>
+#include <string>
 #include <glm/glm.hpp>
 
 #pragma once
 
+// Stateless integer hash based random numbers (based on Squirrel Eiserloh's "Squirrel3" noise function)
+// Values only depend on the integer coordinates and the seed, so they can be calculated on demand and are identical across chunk borders
+inline uint32_t hashNoise(int32_t position, uint32_t seed)
+{
+	constexpr uint32_t BIT_NOISE1 = 0x68E31DA4;
+	constexpr uint32_t BIT_NOISE2 = 0xB5297A4D;
+	constexpr uint32_t BIT_NOISE3 = 0x1B56C4E9;
+	uint32_t mangled = (uint32_t)position;
+	mangled *= BIT_NOISE1;
+	mangled += seed;
+	mangled ^= (mangled >> 8);
+	mangled += BIT_NOISE2;
+	mangled ^= (mangled << 8);
+	mangled *= BIT_NOISE3;
+	mangled ^= (mangled >> 8);
+	return mangled;
+}
+
+inline uint32_t hashNoise(int32_t x, int32_t y, uint32_t seed)
+{
+	constexpr uint32_t PRIME = 198491317;
+	return hashNoise((int32_t)((uint32_t)x + PRIME * (uint32_t)y), seed);
+}
+
+// Returns a random value in the [0..1) range
+inline float hashNoiseFloat(int32_t x, int32_t y, uint32_t seed)
+{
+	return (float)(hashNoise(x, y, seed) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Poisson disk distributed points in the [0..width) x [0..height) rectangle, no two points are closer than minDistance
+// The points repeat a tileable pattern that is generated once per seed (Bridson's algorithm on a torus), so sampling a rectangle only scales and copies the pattern
+// The fractional part of offset shifts the pattern (in units of the pattern size), so rectangles sharing a seed can use different parts of it
+void poissonDiskSample(float width, float height, float minDistance, uint32_t seed, const glm::vec2& offset, std::vector<glm::vec2>& points);
+
+enum class NoiseType { Perlin, OpenSimplex2S, Value, ValueSIMD };
+
+// Names as used by the noiseType key of the preset files (same order as NoiseType)
+inline const std::vector<std::string> noiseTypeNames = { "perlin", "opensimplex2s", "value", "value_simd" };
+
+// Common interface for the noise functions that can be used to generate the terrain
+// All implementations return values with roughly the same distribution as the Perlin noise, so presets can switch between them
+class NoiseGenerator
+{
+public:
+	virtual ~NoiseGenerator() {};
+	// Returns the noise value and its analytic partial derivatives with respect to x and y
+	virtual float noise(float x, float y, glm::vec2& derivative) = 0;
+	// Evaluates count samples at once, implementations can override this to process multiple samples in parallel
+	virtual void noise(const float* x, const float* y, float* values, glm::vec2* derivatives, size_t count);
+};
+
 // Translation of Ken Perlin's noise generation JAVA implementation (http://mrl.nyu.edu/~perlin/noise/)
-class PerlinNoise
+// Note: Uses a 256 entry permutation table, so the noise repeats every 256 units
+class PerlinNoise : public NoiseGenerator
 {
 public:
+	using NoiseGenerator::noise;
 	float noise(float x, float y);
+	// Also returns the analytic partial derivatives of the noise value with respect to x and y
+	float noise(float x, float y, glm::vec2& derivative) override;
 private:
 	float fade(float t);
+	float fadeDerivative(float t);
 	float lerp(float t, float a, float b);
 	float grad(int hash, float x, float y);
+	glm::vec2 gradient(int hash);
 	static constexpr int permutations[257] = {
 		151,160,137,91,90,15,131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,
 		8,99,37,240,21,10,23,190,6,148,247,120,234,75,0,26,197,62,94,252,219,203,117,
@@ -29,4 +89,42 @@ private:
 		49,192,214,31,181,199,106,157,184,84,204,176,115,121,50,45,127,4,150,254,
 		138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180, 151
 	};
-};
\ No newline at end of file
+};
+
+// OpenSimplex2S (smooth variant of Kurt Spencer's OpenSimplex2, https://github.com/KdotJPG/OpenSimplex2)
+// Lattice gradients are picked with the integer hash, so unlike the Perlin noise this does not repeat
+class OpenSimplex2SNoise : public NoiseGenerator
+{
+public:
+	using NoiseGenerator::noise;
+	OpenSimplex2SNoise(uint32_t seed) : seed(seed) {};
+	float noise(float x, float y, glm::vec2& derivative) override;
+private:
+	uint32_t seed;
+	float contribution(int32_t xsv, int32_t ysv, float dx, float dy, glm::vec2& derivative);
+};
+
+// Hashed value noise with quintic interpolation, cheapest of the noise types but also shows the most grid artifacts
+class ValueNoise : public NoiseGenerator
+{
+public:
+	using NoiseGenerator::noise;
+	ValueNoise(uint32_t seed) : seed(seed) {};
+	float noise(float x, float y, glm::vec2& derivative) override;
+protected:
+	uint32_t seed;
+};
+
+// Value noise that evaluates four samples at once using SSE2 (falls back to the scalar implementation on other architectures)
+// Results are identical to ValueNoise
+class ValueNoiseSIMD : public ValueNoise
+{
+public:
+	using ValueNoise::noise;
+	ValueNoiseSIMD(uint32_t seed) : ValueNoise(seed) {};
+	void noise(const float* x, const float* y, float* values, glm::vec2* derivatives, size_t count) override;
+};
+
+NoiseType getNoiseType(const std::string& name);
+std::unique_ptr<NoiseGenerator> createNoiseGenerator(NoiseType type, uint32_t seed);
+
@@ -34,6 +34,13 @@ public:
 	}
 	void create() {
 		assert(layout);
+		if (bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE) {
+			assert(shaderStages.size() == 1);
+			VkComputePipelineCreateInfo computePipelineCI = vks::initializers::computePipelineCreateInfo(layout->handle);
+			computePipelineCI.stage = shaderStages[0];
+			VK_CHECK_RESULT(vkCreateComputePipelines(device, cache, 1, &computePipelineCI, nullptr, &pso));
+			return;
+		}
 		pipelineCI.stageCount = static_cast<uint32_t>(shaderStages.size());
 		pipelineCI.pStages = shaderStages.data();
 		pipelineCI.layout = layout->handle;
@@ -47,6 +54,7 @@ public:
 		VkShaderStageFlagBits shaderStage = VK_SHADER_STAGE_FLAG_BITS_MAX_ENUM;
 		if (ext == "vert") { shaderStage = VK_SHADER_STAGE_VERTEX_BIT; }
 		if (ext == "frag") { shaderStage = VK_SHADER_STAGE_FRAGMENT_BIT; }
+		if (ext == "comp") { shaderStage = VK_SHADER_STAGE_COMPUTE_BIT; }
 		assert(shaderStage != VK_SHADER_STAGE_FLAG_BITS_MAX_ENUM);
 
 		VkPipelineShaderStageCreateInfo shaderStageCI{};
@@ -69,6 +77,10 @@ public:
 		this->pipelineCI = pipelineCI;
 		this->bindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	}
+	// Compute pipelines only need a layout and a single compute shader
+	void setCompute() {
+		this->bindPoint = VK_PIPELINE_BIND_POINT_COMPUTE;
+	}
 	void setVertexInputState(VkPipelineVertexInputStateCreateInfo* vertexInputStateCI) {
 		this->pipelineCI.pVertexInputState = vertexInputStateCI;
 	}
@@ -15,6 +15,7 @@
 #include "VulkanBuffer.hpp"
 #include "VulkanTexture.hpp"
 #include "Noise.h"
+#include "threadpool.hpp"
 #include <random>
 #include <ktx.h>
 #include <ktxvulkan.h>
@@ -39,11 +40,27 @@ namespace vks
 
 	public:
 		static constexpr const int chunkSize = 241;
-		// Height data also contains info on neighbouring borders to properly calculate normals
-		float heights[chunkSize + 2][chunkSize + 2];
-		// Store random values for each heightmap position that can be used at runtime for dynamic randomization (like grass rendering)
-		float randomValues[chunkSize + 2][chunkSize + 2];
-		// @todo: store random values per coordinate for doing random stuff, e.g. grass rendering
+		// Octaves with a wavelength of at least this many samples are considered smooth enough to be bilinearly upsampled
+		static constexpr const int lowOctaveWaveLength = 8;
+		// Number of lines per parallel tile when generating heights and meshes
+		static constexpr const uint32_t generateTileSize = 8;
+		// Distance (in full resolution samples) between two generated height samples, depends on the level of detail
+		int sampleStep = 1;
+		// Number of height samples per line
+		int samplesPerLine = 0;
+		std::vector<float> heights;
+		// Analytic height derivatives (per full resolution sample) used for calculating normals
+		std::vector<glm::vec2> gradients;
+
+		// Sum of the low frequency octaves (before normalization), used when refining a chunk to a higher level of detail
+		struct LowOctaves {
+			int count = 0;
+			int sampleStep = 1;
+			int samplesPerLine = 0;
+			std::vector<float> heights;
+			std::vector<glm::vec2> gradients;
+		} lowOctaves;
+
 		enum Topology { topologyTriangles, topologyQuads };
 
 		float minHeight = std::numeric_limits<float>::max();
@@ -68,6 +85,10 @@ namespace vks
 		size_t indexBufferSize = 0;
 		uint32_t indexCount = 0;
 
+		// CPU side mesh data, filled by buildMesh and consumed by uploadMesh
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+
 		std::vector<TerrainType> regions;
 
 		glm::vec3 rgb(int r, int g, int b) {
@@ -98,41 +119,78 @@ namespace vks
 		}
 
 
-		float getHeight(uint32_t x, uint32_t y)
+		static int getSampleStep(int levelOfDetail)
+		{
+			return std::max(levelOfDetail, 1) * 2;
+		}
+
+		// Bilinear lookup into a sample grid, x and y are full resolution sample coordinates (starting at 1)
+		template<typename T>
+		static T sampleGrid(const std::vector<T>& data, int samplesPerLine, int sampleStep, float x, float y)
+		{
+			const float gx = glm::clamp((x - 1.0f) / (float)sampleStep, 0.0f, (float)(samplesPerLine - 1));
+			const float gy = glm::clamp((y - 1.0f) / (float)sampleStep, 0.0f, (float)(samplesPerLine - 1));
+			const int x0 = std::min((int)gx, samplesPerLine - 2);
+			const int y0 = std::min((int)gy, samplesPerLine - 2);
+			const float fx = gx - (float)x0;
+			const float fy = gy - (float)y0;
+			const T h00 = data[y0 * samplesPerLine + x0];
+			const T h10 = data[y0 * samplesPerLine + x0 + 1];
+			const T h01 = data[(y0 + 1) * samplesPerLine + x0];
+			const T h11 = data[(y0 + 1) * samplesPerLine + x0 + 1];
+			return glm::mix(glm::mix(h00, h10, fx), glm::mix(h01, h11, fx), fy);
+		}
+
+		// x and y are full resolution sample coordinates, values in between generated samples are interpolated
+		float getHeight(int x, int y)
 		{
 			if (x < 0) { x = 0; }
 			if (y < 0) { y = 0; }
 			if (x > chunkSize + 1) { x = chunkSize + 1; }
 			if (y > chunkSize + 1) { y = chunkSize + 1; }
-			float height = heights[x][y] * abs(heightScale);
+			float height = sampleGrid(heights, samplesPerLine, sampleStep, (float)x, (float)y) * abs(heightScale);
 			if (height < 0.0f) {
 				height = 0.0f;
 			}
 			return height;
 		}
 
-		float getRandomValue(uint32_t x, uint32_t y)
+		// Bilinearly interpolated height at full resolution sample coordinates, for positions in between samples
+		float sampleHeight(float x, float y) const
 		{
-			if (x < 0) { x = 0; }
-			if (y < 0) { y = 0; }
-			if (x > chunkSize + 1) { x = chunkSize + 1; }
-			if (y > chunkSize + 1) { y = chunkSize + 1; }
-			return randomValues[x][y];
+			return std::max(sampleGrid(heights, samplesPerLine, sampleStep, x, y) * abs(heightScale), 0.0f);
 		}
 
-		float inverseLerp(float xx, float yy, float value)
+		// Bilinearly interpolated height gradient at full resolution sample coordinates, in height units per sample
+		glm::vec2 sampleGradient(float x, float y) const
 		{
-			return (value - xx) / (yy - xx);
+			return sampleGrid(gradients, samplesPerLine, sampleStep, x, y) * abs(heightScale);
 		}
 
-		float gold_noise(glm::vec2 xy, float seed) {
-			const float PHI = 1.61803398874989484820459;
-			float ip;
-			return modf(tan(glm::distance(xy * PHI, xy) * seed) * xy.x, &ip);
+		// Takes over the generated heights of another height map, e.g. to build a mesh with a different height scale
+		void copyHeights(const HeightMap& source)
+		{
+			sampleStep = source.sampleStep;
+			samplesPerLine = source.samplesPerLine;
+			heights = source.heights;
+			gradients = source.gradients;
+			lowOctaves = source.lowOctaves;
 		}
 
-		void generate(int seed, float noiseScale, int octaves, float persistence, float lacunarity, glm::vec2 offset)
+		float inverseLerp(float xx, float yy, float value)
 		{
+			return (value - xx) / (yy - xx);
+		}
+
+		// Generates height samples at the resolution required by the level of detail
+		// If a lower resolution source is passed, its low frequency octaves are upsampled instead of being evaluated again
+		void generate(int seed, float noiseScale, int octaves, float persistence, float lacunarity, glm::vec2 offset, int levelOfDetail, NoiseType noiseType, const LowOctaves* source = nullptr)
+		{
+			sampleStep = getSampleStep(levelOfDetail);
+			samplesPerLine = (chunkSize - 1) / sampleStep + 1;
+			heights.resize(samplesPerLine * samplesPerLine);
+			gradients.resize(samplesPerLine * samplesPerLine);
+
 			float maxPossibleNoiseHeight = 0;
 			float amplitude = 1;
 			float frequency = 1;
@@ -140,74 +198,103 @@ namespace vks
 			std::default_random_engine prng(seed);
 			std::uniform_real_distribution<float> distribution(-100000, +100000);
 			std::vector<glm::vec2> octaveOffsets(octaves);
+			std::vector<float> octaveAmplitudes(octaves);
+			std::vector<float> octaveFrequencies(octaves);
 			for (int32_t i = 0; i < octaves; i++) {
 				float offsetX = distribution(prng) + offset.x;
 				float offsetY = distribution(prng) - offset.y;
 				octaveOffsets[i] = glm::vec2(offsetX, offsetY);
+				octaveAmplitudes[i] = amplitude;
+				octaveFrequencies[i] = frequency;
 				maxPossibleNoiseHeight += amplitude;
 				amplitude *= persistence;
+				frequency *= lacunarity;
 			}
 
-			PerlinNoise perlinNoise;
+			lowOctaves.count = 0;
+			lowOctaves.sampleStep = sampleStep;
+			lowOctaves.samplesPerLine = samplesPerLine;
+			lowOctaves.heights.resize(samplesPerLine * samplesPerLine);
+			lowOctaves.gradients.resize(samplesPerLine * samplesPerLine);
+			while ((lowOctaves.count < octaves) && (noiseScale / octaveFrequencies[lowOctaves.count] >= (float)(sampleStep * lowOctaveWaveLength))) {
+				lowOctaves.count++;
+			}
+			const int upsampledOctaveCount = source ? std::min(source->count, lowOctaves.count) : 0;
 
-			float maxNoiseHeight = std::numeric_limits<float>::min();
-			float minNoiseHeight = std::numeric_limits<float>::max();
+			std::unique_ptr<NoiseGenerator> noiseGenerator = createNoiseGenerator(noiseType, (uint32_t)seed);
 
 			float halfWidth = (chunkSize + 2) / 2.0f;
 			float halfHeight = (chunkSize + 2) / 2.0f;
 
-			std::normal_distribution<float> rndDist(0.0f, 1.0f);
-
-			for (int32_t y = 0; y < chunkSize + 2; y++) {
-				for (int32_t x = 0; x < chunkSize + 2; x++) {
-
-					amplitude = 1;
-					frequency = 1;
-
-					float noiseHeight = 0;
-
-					for (int i = 0; i < octaves; i++) {
-						float sampleX = ((float)x - halfWidth + octaveOffsets[i].x) / noiseScale * frequency;
-						float sampleY = ((float)y - halfHeight + octaveOffsets[i].y) / noiseScale * frequency;
-
-						float perlinValue = perlinNoise.noise(sampleX, sampleY) * 2.0f - 1.0f;
-						noiseHeight += perlinValue * amplitude;
-
-						amplitude *= persistence;
-						frequency *= lacunarity;
+			// Lines are generated in parallel tiles, noise is evaluated for a whole line of samples at once, so noise generators can process multiple samples in parallel
+			vks::parallelFor(samplesPerLine, generateTileSize, [&](uint32_t firstLine, uint32_t lastLine) {
+				std::vector<float> sampleX(samplesPerLine);
+				std::vector<float> sampleY(samplesPerLine);
+				std::vector<float> noiseValues(samplesPerLine);
+				std::vector<glm::vec2> noiseDerivatives(samplesPerLine);
+
+				for (int32_t y = firstLine; y < (int32_t)lastLine; y++) {
+					// Position of this line in the full resolution grid
+					const float py = (float)(y * sampleStep + 1);
+					float* lineHeights = &heights[y * samplesPerLine];
+					glm::vec2* lineGradients = &gradients[y * samplesPerLine];
+
+					for (int32_t x = 0; x < samplesPerLine; x++) {
+						const float px = (float)(x * sampleStep + 1);
+						if (upsampledOctaveCount > 0) {
+							lineHeights[x] = sampleGrid(source->heights, source->samplesPerLine, source->sampleStep, px, py);
+							lineGradients[x] = sampleGrid(source->gradients, source->samplesPerLine, source->sampleStep, px, py);
+						} else {
+							lineHeights[x] = 0.0f;
+							lineGradients[x] = glm::vec2(0.0f);
+						}
 					}
 
-					if (noiseHeight > maxNoiseHeight) {
-						maxNoiseHeight = noiseHeight;
+					for (int i = upsampledOctaveCount; i < octaves; i++) {
+						if (i == lowOctaves.count) {
+							std::copy(lineHeights, lineHeights + samplesPerLine, &lowOctaves.heights[y * samplesPerLine]);
+							std::copy(lineGradients, lineGradients + samplesPerLine, &lowOctaves.gradients[y * samplesPerLine]);
+						}
+
+						for (int32_t x = 0; x < samplesPerLine; x++) {
+							const float px = (float)(x * sampleStep + 1);
+							sampleX[x] = (px - halfWidth + octaveOffsets[i].x) / noiseScale * octaveFrequencies[i];
+							sampleY[x] = (py - halfHeight + octaveOffsets[i].y) / noiseScale * octaveFrequencies[i];
+						}
+						noiseGenerator->noise(sampleX.data(), sampleY.data(), noiseValues.data(), noiseDerivatives.data(), samplesPerLine);
+
+						for (int32_t x = 0; x < samplesPerLine; x++) {
+							lineHeights[x] += (noiseValues[x] * 2.0f - 1.0f) * octaveAmplitudes[i];
+							// Chain rule for the sample position scaling and the value remapping above
+							lineGradients[x] += noiseDerivatives[x] * (2.0f * octaveAmplitudes[i] * octaveFrequencies[i] / noiseScale);
+						}
 					}
-					else if (noiseHeight < minNoiseHeight) {
-						minNoiseHeight = noiseHeight;
+					if (lowOctaves.count >= octaves) {
+						std::copy(lineHeights, lineHeights + samplesPerLine, &lowOctaves.heights[y * samplesPerLine]);
+						std::copy(lineGradients, lineGradients + samplesPerLine, &lowOctaves.gradients[y * samplesPerLine]);
 					}
 
-					heights[x][y] = noiseHeight;
-					//randomValues[x][y] = gold_noise(glm::vec2((float)x, (float)y) + offset, (float)(x + offset.x) + (float)(y + offset.y) * (float)chunkSize);
-					randomValues[x][y] = gold_noise(glm::vec2((float)x + 0.5f, (float)y + 0.5f), (float)(x) + (float)(y) * (float)chunkSize * (float)seed);
-				}
-			}
-
-			// Normalize
-			for (size_t y = 0; y < chunkSize + 2; y++) {
-				for (size_t x = 0; x < chunkSize + 2; x++) {
-					// Local
-					//data[x + y * texture.width] = inverseLerp(minNoiseHeight, maxNoiseHeight, data[x + y * texture.width]);
-//					data[x + y * texture.width] = (data[x + y * texture.width] + 1.0f) / (2.0f * maxPossibleNoiseHeight / 1.5f);
-					//data[x + y * texture.width] = data[x + y * texture.width] / 0.6;
-					//data[x + y * texture.width] = glm::clamp(data[x + y * texture.width], 0.0f, std::numeric_limits<float>::max());
-					heights[x][y] = inverseLerp(-3.0f, 0.6f, heights[x][y]);
-
-					if (heights[x][y] < 0.0f) {
-						heights[x][y] = 0.0f;
+					// Normalize
+					for (int32_t x = 0; x < samplesPerLine; x++) {
+						lineHeights[x] = inverseLerp(-3.0f, 0.6f, lineHeights[x]);
+						lineGradients[x] /= (0.6f - -3.0f);
+						if (lineHeights[x] < 0.0f) {
+							lineHeights[x] = 0.0f;
+							lineGradients[x] = glm::vec2(0.0f);
+						}
 					}
 				}
-			}
+			});
+		}
+
+		void generateMesh(glm::vec3 scale, Topology topology)
+		{
+			buildMesh(scale, topology);
+			uploadMesh();
 		}
 
-		void generateMesh(glm::vec3 scale, Topology topology, int levelOfDetail)
+		// Builds the vertices and indices for the current heights without touching the GPU
+		void buildMesh(glm::vec3 scale, Topology topology)
 		{
 			int meshDim = chunkSize;
 			this->meshDim = meshDim;
@@ -218,83 +305,119 @@ namespace vks
 			float topLeftX = (float)(meshDim - 1) / -2.0f;
 			float topLeftZ = (float)(meshDim - 1) / 2.0f;
 
-			int meshSimplificationIncrement = std::max(levelOfDetail, 1) * 2;
+			// Mesh resolution follows the resolution the heights were generated at
+			int meshSimplificationIncrement = sampleStep;
 			int verticesPerLine = (meshDim - 1) / meshSimplificationIncrement + 1;
 
-			Vertex* vertices = new Vertex[verticesPerLine * verticesPerLine];
-			uint32_t* triangles = new uint32_t[(verticesPerLine - 1) * (verticesPerLine - 1) * 6];
-			uint32_t triangleIndex = 0;
-			uint32_t vertexIndex = 0;
-			indexCount = (verticesPerLine - 1) * (verticesPerLine - 1) * 6;
-
-			auto addTriangle = [&triangleIndex, triangles](int a, int b, int c) {
-				triangles[triangleIndex] = a;
-				triangles[triangleIndex+1] = b;
-				triangles[triangleIndex+2] = c;
-				triangleIndex += 3;
-			};
-
-			auto getHeight = [this, scale](int x, int y) {
-				if (x < 0) { x = 0; }
-				if (y < 0) { y = 0; }
-				if (x > chunkSize + 1) { x = chunkSize + 1; }
-				if (y > chunkSize + 1) { y = chunkSize + 1; }
-				float height = heights[x][y] * abs(scale.y);
-				if (height < 0.0f) {
-					height = 0.0f;
-				}
-				return height;
-			};
-
-			for (int32_t y = 0; y < meshDim; y += meshSimplificationIncrement) {
-				for (int32_t x = 0; x < meshDim; x += meshSimplificationIncrement) {
-					int xOff = x + 1;
-					int yOff = y + 1;
-					float currentHeight = heights[xOff][yOff];
-					if (currentHeight < 0.0f) {
-						currentHeight = 0.0f;
-					}
-					vertices[vertexIndex].pos.x = topLeftX + (float)x;
-					vertices[vertexIndex].pos.y = currentHeight;
-					vertices[vertexIndex].pos.z = topLeftZ - (float)y;
-					vertices[vertexIndex].pos *= scale;
-					vertices[vertexIndex].uv = glm::vec2((float)x / (float)meshDim, (float)y / (float)meshDim);
-					vertices[vertexIndex].terrainHeight = currentHeight;
-
-					if (abs(vertices[vertexIndex].pos.y) > maxHeight) {
-						maxHeight = abs(vertices[vertexIndex].pos.y);
+			// Chunks with different levels of detail don't share all border vertices, so a skirt is added to hide the resulting cracks
+			const int skirtVertexCount = (verticesPerLine - 1) * 4;
+			const int skirtIndexCount = skirtVertexCount * 12;
+
+			indexCount = (verticesPerLine - 1) * (verticesPerLine - 1) * 6 + skirtIndexCount;
+			vertices.resize(verticesPerLine * verticesPerLine + skirtVertexCount);
+			indices.resize(indexCount);
+
+			// Lines only write their own vertices and triangles, so they are built in parallel tiles
+			// Height ranges are gathered per tile and reduced in tile order afterwards to keep the result deterministic
+			const uint32_t tileCount = (verticesPerLine + generateTileSize - 1) / generateTileSize;
+			std::vector<float> tileMinHeights(tileCount, std::numeric_limits<float>::max());
+			std::vector<float> tileMaxHeights(tileCount, std::numeric_limits<float>::min());
+
+			vks::parallelFor(verticesPerLine, generateTileSize, [&](uint32_t firstLine, uint32_t lastLine) {
+				const uint32_t tile = firstLine / generateTileSize;
+				for (int32_t vy = firstLine; vy < (int32_t)lastLine; vy++) {
+					const int32_t y = vy * meshSimplificationIncrement;
+					for (int32_t vx = 0; vx < verticesPerLine; vx++) {
+						const int32_t x = vx * meshSimplificationIncrement;
+						const uint32_t vertexIndex = vy * verticesPerLine + vx;
+						const int index = vy * samplesPerLine + vx;
+						float currentHeight = heights[index];
+						if (currentHeight < 0.0f) {
+							currentHeight = 0.0f;
+						}
+						vertices[vertexIndex].pos.x = topLeftX + (float)x;
+						vertices[vertexIndex].pos.y = currentHeight;
+						vertices[vertexIndex].pos.z = topLeftZ - (float)y;
+						vertices[vertexIndex].pos *= scale;
+						vertices[vertexIndex].uv = glm::vec2((float)x / (float)meshDim, (float)y / (float)meshDim);
+						vertices[vertexIndex].terrainHeight = currentHeight;
+
+						tileMaxHeights[tile] = std::max(tileMaxHeights[tile], abs(vertices[vertexIndex].pos.y));
+						tileMinHeights[tile] = std::min(tileMinHeights[tile], abs(vertices[vertexIndex].pos.y));
+
+						// Normals come straight from the analytic height gradient, no neighbouring samples required
+						const glm::vec2 gradient = gradients[index] * abs(scale.y);
+						glm::vec3 normalVector = glm::normalize(glm::vec3(-gradient.x, -1.0f, gradient.y));
+						vertices[vertexIndex].normal = normalVector;
+
+						if ((vx < verticesPerLine - 1) && (vy < verticesPerLine - 1)) {
+							uint32_t* quad = &indices[(vy * (verticesPerLine - 1) + vx) * 6];
+							quad[0] = vertexIndex;
+							quad[1] = vertexIndex + verticesPerLine + 1;
+							quad[2] = vertexIndex + verticesPerLine;
+							quad[3] = vertexIndex + verticesPerLine + 1;
+							quad[4] = vertexIndex;
+							quad[5] = vertexIndex + 1;
+						}
 					}
+				}
+			});
 
-					if (abs(vertices[vertexIndex].pos.y) < minHeight) {
-						minHeight = abs(vertices[vertexIndex].pos.y);
-					}
+			for (uint32_t i = 0; i < tileCount; i++) {
+				minHeight = std::min(minHeight, tileMinHeights[i]);
+				maxHeight = std::max(maxHeight, tileMaxHeights[i]);
+			}
 
-					float hL = getHeight(xOff - 1, yOff);
-					float hR = getHeight(xOff + 1, yOff);
-					float hD = getHeight(xOff, yOff + 1);
-					float hU = getHeight(xOff, yOff - 1);
-					glm::vec3 normalVector = glm::normalize(glm::vec3(hL - hR, -2.0f, hD - hU));
-					vertices[vertexIndex].normal = normalVector;
+			uint32_t vertexIndex = verticesPerLine * verticesPerLine;
+			uint32_t triangleIndex = (verticesPerLine - 1) * (verticesPerLine - 1) * 6;
+			auto addTriangle = [&triangleIndex, this](int a, int b, int c) {
+				indices[triangleIndex] = a;
+				indices[triangleIndex+1] = b;
+				indices[triangleIndex+2] = c;
+				triangleIndex += 3;
+			};
 
-					if ((x < meshDim - 1) && (y < meshDim - 1)) {
-						addTriangle(vertexIndex, vertexIndex + verticesPerLine + 1, vertexIndex + verticesPerLine);
-						addTriangle(vertexIndex + verticesPerLine + 1, vertexIndex, vertexIndex + 1);
-					}
-					vertexIndex++;
-				}
+			// Skirt along the border, walked as a closed loop around the chunk
+			// Cull mode is set dynamically per pass, so skirt quads are added with both windings
+			const float skirtDepth = abs(scale.y);
+			const uint32_t skirtStart = vertexIndex;
+			const int n = verticesPerLine - 1;
+			std::vector<uint32_t> borderIndices(skirtVertexCount);
+			for (int i = 0; i < skirtVertexCount; i++) {
+				int x, y;
+				if (i < n) { x = i; y = 0; }
+				else if (i < 2 * n) { x = n; y = i - n; }
+				else if (i < 3 * n) { x = 3 * n - i; y = n; }
+				else { x = 0; y = 4 * n - i; }
+				borderIndices[i] = y * verticesPerLine + x;
+				vertices[vertexIndex] = vertices[borderIndices[i]];
+				vertices[vertexIndex].pos.y += skirtDepth;
+				vertexIndex++;
+			}
+			for (int i = 0; i < skirtVertexCount; i++) {
+				const int next = (i + 1) % skirtVertexCount;
+				addTriangle(borderIndices[i], borderIndices[next], skirtStart + i);
+				addTriangle(borderIndices[next], skirtStart + next, skirtStart + i);
+				addTriangle(borderIndices[i], skirtStart + i, borderIndices[next]);
+				addTriangle(borderIndices[next], skirtStart + i, skirtStart + next);
 			}
 
 			// @todo: slighlty alter to take e.g. added trees into account
 			maxHeight += 20.0f;
 			minHeight -= 20.0f;
+		}
 
-			VkDeviceSize vertexBufferSize = verticesPerLine * verticesPerLine * sizeof(Vertex);
-			VkDeviceSize indexBufferSize = (verticesPerLine - 1) * (verticesPerLine - 1) * 6 * sizeof(uint32_t);
+		// Uploads the mesh data to device local buffers, the CPU side data is released afterwards
+		void uploadMesh()
+		{
+			VkDeviceSize vertexBufferSize = vertices.size() * sizeof(Vertex);
+			VkDeviceSize indexBufferSize = indices.size() * sizeof(uint32_t);
+			indexCount = (uint32_t)indices.size();
 
 			// Create staging buffers
 			vks::Buffer vertexStaging, indexStaging;
-			device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertexStaging, vertexBufferSize, vertices);
-			device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &indexStaging, indexBufferSize, triangles);
+			device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertexStaging, vertexBufferSize, vertices.data());
+			device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &indexStaging, indexBufferSize, indices.data());
 			// Device local (target) buffer
 			device->createBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertexBuffer, vertexBufferSize);
 			device->createBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indexBuffer, indexBufferSize);
@@ -311,6 +434,11 @@ namespace vks
 			vkFreeMemory(device->logicalDevice, vertexStaging.memory, nullptr);
 			vkDestroyBuffer(device->logicalDevice, indexStaging.buffer, nullptr);
 			vkFreeMemory(device->logicalDevice, indexStaging.memory, nullptr);
+
+			vertices.clear();
+			vertices.shrink_to_fit();
+			indices.clear();
+			indices.shrink_to_fit();
 		}
 
 		void draw(VkCommandBuffer cb) {
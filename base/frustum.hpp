@@ -72,7 +72,7 @@ namespace vks
 
 		}
 		
-		bool checkSphere(glm::vec3 pos, float radius)
+		bool checkSphere(glm::vec3 pos, float radius) const
 		{
 			for (auto i = 0; i < 6; i++)
 			{
@@ -84,7 +84,7 @@ namespace vks
 			return true;
 		}
 
-		bool checkBox(glm::vec3 pos, glm::vec3 min, glm::vec3 max)
+		bool checkBox(glm::vec3 pos, glm::vec3 min, glm::vec3 max) const
 		{
 			// https://iquilezles.org/articles/frustumcorrect/
 			
@@ -6,20 +6,17 @@
 * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
 */
 
+#pragma once
+
 #include <vector>
 #include <thread>
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
-
-// make_unique is not available in C++11
-// Taken from Herb Sutter's blog (https://herbsutter.com/gotw/_102/)
-template<typename T, typename ...Args>
-std::unique_ptr<T> make_unique(Args&& ...args)
-{
-	return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
-}
+#include <memory>
+#include <atomic>
+#include <algorithm>
 
 namespace vks
 {
@@ -91,6 +88,13 @@ namespace vks
 			std::unique_lock<std::mutex> lock(queueMutex);
 			condition.wait(lock, [this]() { return jobQueue.empty(); });
 		}
+
+		// Returns true if the thread has no pending work items
+		bool idle()
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			return jobQueue.empty();
+		}
 	};
 	
 	class ThreadPool
@@ -102,9 +106,9 @@ namespace vks
 		void setThreadCount(uint32_t count)
 		{
 			threads.clear();
-			for (auto i = 0; i < count; i++)
+			for (uint32_t i = 0; i < count; i++)
 			{
-				threads.push_back(make_unique<Thread>());
+				threads.push_back(std::make_unique<Thread>());
 			}
 		}
 
@@ -116,6 +120,71 @@ namespace vks
 				thread->wait();
 			}
 		}
+
+		// Splits [0, count) into tiles of tileSize elements and calls function(begin, end) for each of them
+		// The calling thread works on tiles too and only threads without pending work items are used as helpers,
+		// so if the pool is already busy with other loops this degrades to a serial loop instead of waiting for them
+		// Helpers only get a pointer to the loop state, so running a loop doesn't allocate
+		// Note: Must not be nested, a helper thread would wait for its own queue
+		template<typename Function>
+		void parallelFor(uint32_t count, uint32_t tileSize, const Function& function)
+		{
+			struct Loop {
+				const Function& function;
+				uint32_t count;
+				uint32_t tileSize;
+				uint32_t tileCount;
+				std::atomic<uint32_t> nextTile{ 0 };
+				std::atomic<uint32_t> activeHelpers{ 0 };
+
+				void work()
+				{
+					uint32_t tile;
+					while ((tile = nextTile++) < tileCount) {
+						function(tile * tileSize, std::min((tile + 1) * tileSize, count));
+					}
+				}
+			} loop{ function, count, tileSize, (count + tileSize - 1) / tileSize };
+
+			Loop* state = &loop;
+			uint32_t helperCount = 0;
+			for (auto& thread : threads) {
+				if (helperCount + 1 >= loop.tileCount) {
+					break;
+				}
+				if (thread->idle()) {
+					loop.activeHelpers++;
+					// The helper must not touch the loop state after signalling that it's done
+					thread->addJob([state]() {
+						state->work();
+						state->activeHelpers--;
+					});
+					helperCount++;
+				}
+			}
+			loop.work();
+			// All tiles have been taken at this point, helpers are only finishing their last one
+			while (loop.activeHelpers > 0) {
+				std::this_thread::yield();
+			}
+		}
 	};
 
+	// Thread pool shared by all parallel loops, threads are created on first use
+	inline ThreadPool& getSharedThreadPool()
+	{
+		static ThreadPool threadPool = [] {
+			ThreadPool pool;
+			pool.setThreadCount(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+			return pool;
+		}();
+		return threadPool;
+	}
+
+	template<typename Function>
+	inline void parallelFor(uint32_t count, uint32_t tileSize, const Function& function)
+	{
+		getSharedThreadPool().parallelFor(count, tileSize, function);
+	}
+
 }
@@ -7,6 +7,7 @@
 #extension GL_GOOGLE_include_directive : require
 
 #include "includes/constants.glsl"
+#include "includes/instance.glsl"
 #include "includes/types.glsl"
 
 layout (location = 0) in vec3 inPos;
@@ -15,10 +16,11 @@ layout (location = 2) in vec2 inUV;
 
 // Instanced attributes
 layout (location = 3) in vec3 instancePos;
-layout (location = 4) in vec3 instanceScale;
-layout (location = 5) in vec3 instanceRotation;
-layout (location = 6) in vec2 instanceUV;
-layout (location = 7) in vec4 instanceColor;
+// x = horizontal scale, y = vertical scale
+layout (location = 4) in vec2 instanceScale;
+// Packed rotation quaternion and uv index
+layout (location = 5) in uint instanceRotation;
+layout (location = 6) in vec4 instanceColor;
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec2 outUV;
@@ -49,41 +51,15 @@ void main(void)
 //		return;
 //	}
 
-	outUV = inUV + instanceUV;
+	outUV = inUV + vec2(float(unpackInstanceUVIndex(instanceRotation)) * 0.25, 0.0);
 	outNormal = inNormal;
 	outColor = instanceColor;
 
-	mat3 mx, my, mz;
-	
-	// rotate around x
-	float s = sin(instanceRotation.x);
-	float c = cos(instanceRotation.x);
-
-	mx[0] = vec3(c, s, 0.0);
-	mx[1] = vec3(-s, c, 0.0);
-	mx[2] = vec3(0.0, 0.0, 1.0);
-	
-	// rotate around y
-	s = sin(instanceRotation.y);
-	c = cos(instanceRotation.y);
-
-	my[0] = vec3(c, 0.0, s);
-	my[1] = vec3(0.0, 1.0, 0.0);
-	my[2] = vec3(-s, 0.0, c);
-	
-	// rot around z
-	s = sin(instanceRotation.z);
-	c = cos(instanceRotation.z);	
-	
-	mz[0] = vec3(1.0, 0.0, 0.0);
-	mz[1] = vec3(0.0, c, s);
-	mz[2] = vec3(0.0, -s, c);
-	
-	mat3 rotMat = mz * my * mx;
+	vec4 rotation = unpackInstanceRotation(instanceRotation);
 
 	vec4 pos = vec4(inPos, 1.0);
-	pos.xyz *= instanceScale;
-	pos.xyz *= rotMat;
+	pos.xyz *= instanceScale.xyx;
+	pos.xyz = rotateByQuaternion(pos.xyz, rotation);
 	pos.xyz += instancePos + pushConsts.pos;
 	if (pushConsts.scale[1][1] < 0) {
 		pos.y *= -1.0f;
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+// Grass layer generated from the instance index, without any per instance data from the CPU
+// Matches the grass generated by the CPU side grass field (see GrassField.cpp)
+
+#version 450 core
+#extension GL_GOOGLE_include_directive : require
+
+#include "includes/constants.glsl"
+#include "includes/types.glsl"
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inNormal;
+layout (location = 2) in vec2 inUV;
+
+layout (location = 0) out vec3 outNormal;
+layout (location = 1) out vec2 outUV;
+layout (location = 2) out vec3 outViewVec;
+layout (location = 3) out vec3 outLightVec;
+layout (location = 4) out vec3 outViewPos;
+layout (location = 5) out vec3 outPos;
+layout (location = 6) out vec4 outColor;
+
+// The grass field and the chunk heights are bound with the scene uniforms, so grass doesn't need more descriptor sets than the tree pipelines
+layout (set = 0, binding = 0) uniform SharedBlock { UBOShared ubo; };
+
+#define GRASS_HEIGHT_SLOTS_PER_SIDE 4
+#define PI 3.14159265359
+
+struct GrassHeightSlot {
+	// xy = chunk world position, z = height scale, w = 1.0 if the slot holds a chunk
+	vec4 chunk;
+	// x = samples per line, y = sample step, z = offset of the chunk's heights
+	ivec4 sampling;
+};
+
+layout (set = 0, binding = 1) uniform GrassBlock {
+	// xy = first grass cell, z = cells per side, w = seed
+	ivec4 field;
+	// x = cell size, y = water position, z = density at the far end, w = chunk size
+	vec4 fieldParams;
+	// xy = chunk coordinate of the first height slot
+	ivec4 slotOrigin;
+	GrassHeightSlot slots[GRASS_HEIGHT_SLOTS_PER_SIDE * GRASS_HEIGHT_SLOTS_PER_SIDE];
+} grass;
+
+layout (set = 0, binding = 2) readonly buffer GrassHeights { float heights[]; };
+
+layout(push_constant) uniform PushConsts {
+	mat4 scale;
+	vec4 clipPlane;
+	int _dummy;
+	layout(offset = 96) vec3 pos;
+} pushConsts;
+
+// Same as hashNoise and hashNoiseFloat in Noise.h
+uint hashNoise(int position, uint seed)
+{
+	uint mangled = uint(position);
+	mangled *= 0x68E31DA4u;
+	mangled += seed;
+	mangled ^= (mangled >> 8);
+	mangled += 0xB5297A4Du;
+	mangled ^= (mangled << 8);
+	mangled *= 0x1B56C4E9u;
+	mangled ^= (mangled >> 8);
+	return mangled;
+}
+
+float hashNoiseFloat(ivec2 cell, uint seed)
+{
+	return float(hashNoise(int(uint(cell.x) + 198491317u * uint(cell.y)), seed) >> 8) * (1.0 / 16777216.0);
+}
+
+// Rounds halfway cases away from zero like the C runtime's round
+float roundAway(float value)
+{
+	return sign(value) * floor(abs(value) + 0.5);
+}
+
+// Same lookup as TerrainChunk::getHeight, returns false if the chunk isn't available
+bool getHeight(vec3 worldPos, out float height)
+{
+	float chunkSize = grass.fieldParams.w;
+	ivec2 slotCoord = ivec2(roundAway(worldPos.x / chunkSize), roundAway(worldPos.z / chunkSize)) - grass.slotOrigin.xy;
+	if (any(lessThan(slotCoord, ivec2(0))) || any(greaterThanEqual(slotCoord, ivec2(GRASS_HEIGHT_SLOTS_PER_SIDE)))) {
+		return false;
+	}
+	GrassHeightSlot slot = grass.slots[slotCoord.y * GRASS_HEIGHT_SLOTS_PER_SIDE + slotCoord.x];
+	if (slot.chunk.w == 0.0) {
+		return false;
+	}
+	float x = clamp(roundAway(worldPos.x - slot.chunk.x) + 1.0, 0.0, chunkSize + 2.0);
+	float y = clamp(-roundAway(worldPos.z - slot.chunk.y) + 1.0, 0.0, chunkSize + 2.0);
+	int samplesPerLine = slot.sampling.x;
+	float gx = clamp((x - 1.0) / float(slot.sampling.y), 0.0, float(samplesPerLine - 1));
+	float gy = clamp((y - 1.0) / float(slot.sampling.y), 0.0, float(samplesPerLine - 1));
+	int x0 = min(int(gx), samplesPerLine - 2);
+	int y0 = min(int(gy), samplesPerLine - 2);
+	int i = slot.sampling.z + y0 * samplesPerLine + x0;
+	float h = mix(mix(heights[i], heights[i + 1], gx - float(x0)), mix(heights[i + samplesPerLine], heights[i + samplesPerLine + 1], gx - float(x0)), gy - float(y0));
+	height = -max(h * abs(slot.chunk.z), 0.0);
+	return true;
+}
+
+void cullInstance()
+{
+	// All vertices end up at the same point outside of the clip volume, so nothing gets rasterized
+	gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+	gl_ClipDistance[0] = -1.0;
+}
+
+void main(void)
+{
+	int dim = grass.field.z;
+	float scale = grass.fieldParams.x;
+	ivec2 cell = grass.field.xy + ivec2(gl_InstanceIndex % dim, gl_InstanceIndex / dim);
+
+	// Random value is keyed by the world space grass cell, so it stays stable while the field moves with the camera
+	float rndVal = hashNoiseFloat(cell, uint(grass.field.w));
+	vec3 worldPos = vec3(float(cell.x) * scale + rndVal, 0.0, float(cell.y) * scale - rndVal);
+	float h;
+	if (!getHeight(worldPos, h) || (abs(h) <= grass.fieldParams.y) || (abs(h) > 12.0)) {
+		cullInstance();
+		return;
+	}
+	worldPos.y = h;
+
+	// Grass fades out over the last quarter of the field and gets thinned out over its outer half
+	float adim = float(dim) * scale;
+	float fdim = adim * 0.75;
+	float thinningStart = adim * 0.5;
+	float d = distance(worldPos, ubo.cameraPos.xyz);
+	if (d >= adim) {
+		cullInstance();
+		return;
+	}
+	if (d > thinningStart) {
+		float density = mix(1.0, grass.fieldParams.z, (d - thinningStart) / (adim - thinningStart));
+		if (hashNoiseFloat(cell, uint(grass.field.w) + 1u) >= density) {
+			cullInstance();
+			return;
+		}
+	}
+
+	vec3 instanceScale = vec3(1.0 + rndVal * 0.15, 0.5 + rndVal * 0.25, 1.0 + rndVal * 0.15);
+	vec3 instanceRotation = vec3(PI * rndVal * 0.035, PI * rndVal * 360.0, PI * rndVal * -0.035);
+	vec2 instanceUV = vec2(float(int(rndVal * 4.0) % 4) * 0.25, 0.0);
+
+	outUV = inUV + instanceUV;
+	outNormal = inNormal;
+	outColor = vec4(vec3(0.6 + rndVal * 0.4), 1.0);
+	if (d > fdim) {
+		outColor.a = (adim - d) / (adim - fdim);
+	}
+
+	mat3 mx, my, mz;
+
+	// rotate around x
+	float s = sin(instanceRotation.x);
+	float c = cos(instanceRotation.x);
+
+	mx[0] = vec3(c, s, 0.0);
+	mx[1] = vec3(-s, c, 0.0);
+	mx[2] = vec3(0.0, 0.0, 1.0);
+
+	// rotate around y
+	s = sin(instanceRotation.y);
+	c = cos(instanceRotation.y);
+
+	my[0] = vec3(c, 0.0, s);
+	my[1] = vec3(0.0, 1.0, 0.0);
+	my[2] = vec3(-s, 0.0, c);
+
+	// rot around z
+	s = sin(instanceRotation.z);
+	c = cos(instanceRotation.z);
+
+	mz[0] = vec3(1.0, 0.0, 0.0);
+	mz[1] = vec3(0.0, c, s);
+	mz[2] = vec3(0.0, -s, c);
+
+	mat3 rotMat = mz * my * mx;
+
+	vec4 pos = vec4(inPos, 1.0);
+	pos.xyz *= instanceScale;
+	pos.xyz *= rotMat;
+	pos.xyz += worldPos + pushConsts.pos;
+	if (pushConsts.scale[1][1] < 0) {
+		pos.y *= -1.0f;
+	}
+
+	gl_Position = ubo.projection * ubo.modelview * pos;
+
+	outPos = pos.xyz;
+	outViewVec = -pos.xyz;
+	outLightVec = normalize(ubo.lightDir.xyz + outViewVec);
+	outViewPos = (ubo.modelview * vec4(pos.xyz, 1.0)).xyz;
+
+	// Clip against reflection plane
+	if (length(pushConsts.clipPlane) != 0.0)  {
+		gl_ClipDistance[0] = dot(pos, pushConsts.clipPlane);
+	} else {
+		gl_ClipDistance[0] = 0.0f;
+	}
+
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+// Unpacks the instance rotation written by packInstanceRotation (see InstanceData.cpp)
+// The three smallest components of the quaternion are stored as 9 bit signed normalized values, scaled by sqrt(2)
+// The largest component is always positive and reconstructed from the others
+vec4 unpackInstanceRotation(uint packed)
+{
+	ivec3 smallest = ivec3(bitfieldExtract(int(packed), 0, 9), bitfieldExtract(int(packed), 9, 9), bitfieldExtract(int(packed), 18, 9));
+	vec3 abc = max(vec3(smallest) / 255.0, vec3(-1.0)) * 0.70710678;
+	float l = sqrt(max(1.0 - dot(abc, abc), 0.0));
+	switch ((packed >> 27) & 3u) {
+		case 0u: return vec4(l, abc);
+		case 1u: return vec4(abc.x, l, abc.yz);
+		case 2u: return vec4(abc.xy, l, abc.z);
+	}
+	return vec4(abc, l);
+}
+
+// Index of the instance's texture column, the upper two bits of the packed rotation
+uint unpackInstanceUVIndex(uint packed)
+{
+	return packed >> 30;
+}
+
+vec3 rotateByQuaternion(vec3 v, vec4 q)
+{
+	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
@@ -8,6 +8,7 @@
 #extension GL_EXT_multiview : enable
 
 #include "includes/constants.glsl"
+#include "includes/instance.glsl"
 
 layout (location = 0) in vec3 inPos;
 layout (location = 1) in vec3 inNormal;
@@ -15,8 +16,9 @@ layout (location = 2) in vec2 inUV;
 
 // Instanced attributes
 layout (location = 3) in vec3 instancePos;
-layout (location = 4) in vec3 instanceScale;
-layout (location = 5) in vec3 instanceRotation;
+// x = horizontal scale, y = vertical scale
+layout (location = 4) in vec2 instanceScale;
+layout (location = 5) in uint instanceRotation;
 
 layout (location = 0) out vec2 outUV;
 
@@ -33,36 +35,9 @@ void main(void)
 {
 	outUV = inUV;
 
-	mat3 mx, my, mz;
-	
-	// rotate around x
-	float s = sin(instanceRotation.x);
-	float c = cos(instanceRotation.x);
+	vec4 rotation = unpackInstanceRotation(instanceRotation);
 
-	mx[0] = vec3(c, s, 0.0);
-	mx[1] = vec3(-s, c, 0.0);
-	mx[2] = vec3(0.0, 0.0, 1.0);
-	
-	// rotate around y
-	s = sin(instanceRotation.y);
-	c = cos(instanceRotation.y);
-
-	my[0] = vec3(c, 0.0, s);
-	my[1] = vec3(0.0, 1.0, 0.0);
-	my[2] = vec3(-s, 0.0, c);
-	
-	// rot around z
-	s = sin(instanceRotation.z);
-	c = cos(instanceRotation.z);	
-	
-	mz[0] = vec3(1.0, 0.0, 0.0);
-	mz[1] = vec3(0.0, c, s);
-	mz[2] = vec3(0.0, -s, c);
-	
-	mat3 rotMat = mz * my * mx;
-
-	vec4 pos = vec4(inPos * rotMat, 1.0);
-	pos.xyz *= instanceScale;
+	vec4 pos = vec4(rotateByQuaternion(inPos * instanceScale.xyx, rotation), 1.0);
 	pos.xyz += instancePos + pushConsts.position.xyz;
 
 	gl_Position = ubo.cascadeViewProjMat[gl_ViewIndex] * pos;
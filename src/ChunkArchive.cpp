@@ -0,0 +1,402 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "ChunkArchive.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstddef>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ChunkArchive chunkArchive{};
+
+// Read only memory mapping of an archive file
+class ChunkArchive::MappedFile {
+public:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+
+	MappedFile(const std::string& filename)
+	{
+#if defined(_WIN32)
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr) {
+			return;
+		}
+		data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = data ? (size_t)fileSize.QuadPart : 0;
+#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat fileStat;
+		if ((fstat(fd, &fileStat) == 0) && (fileStat.st_size > 0)) {
+			void* ptr = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (ptr != MAP_FAILED) {
+				data = (const uint8_t*)ptr;
+				size = fileStat.st_size;
+			}
+		}
+		// The mapping stays valid after closing the descriptor
+		close(fd);
+#endif
+	}
+
+	~MappedFile()
+	{
+#if defined(_WIN32)
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+#else
+		if (data) {
+			munmap((void*)data, size);
+		}
+#endif
+	}
+private:
+#if defined(_WIN32)
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+ChunkArchive::ChunkArchive() = default;
+
+ChunkArchive::~ChunkArchive()
+{
+	// Finish pending writes before the archives are closed
+	writerThread.reset();
+}
+
+void ChunkArchive::enable(const std::string& directory)
+{
+	std::lock_guard<std::shared_mutex> guard(mutex);
+	std::filesystem::create_directories(directory);
+	this->directory = directory;
+	enabled = true;
+	if (!writerThread) {
+		writerThread = std::make_unique<vks::Thread>();
+	}
+	std::cout << "Chunk archive enabled, using \"" << directory << "\"\n";
+}
+
+bool ChunkArchive::isEnabled()
+{
+	std::shared_lock<std::shared_mutex> guard(mutex);
+	return enabled;
+}
+
+// FNV-1a
+uint32_t ChunkArchive::checksum(const uint8_t* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+namespace
+{
+	struct BlobHeader {
+		int32_t sampleStep;
+		int32_t samplesPerLine;
+		float heightMin;
+		float heightRange;
+		uint32_t sampleCount;
+		uint32_t treeCount;
+		int32_t treeInstanceCount;
+	};
+
+	// Tree streams are stored one after another in the order of TreeInstances
+	size_t getTreesSize(size_t count)
+	{
+		return count * (3 * sizeof(float) + 3 * sizeof(uint32_t));
+	}
+
+	template<typename T>
+	void writeStream(uint8_t*& dst, const std::vector<T>& stream)
+	{
+		memcpy(dst, stream.data(), stream.size() * sizeof(T));
+		dst += stream.size() * sizeof(T);
+	}
+
+	template<typename T>
+	void readStream(const uint8_t*& src, std::vector<T>& stream)
+	{
+		memcpy(stream.data(), src, stream.size() * sizeof(T));
+		src += stream.size() * sizeof(T);
+	}
+}
+
+std::vector<uint8_t> ChunkArchive::serialize(const CompressedChunkData& data)
+{
+	const BlobHeader header = { data.sampleStep, data.samplesPerLine, data.heightMin, data.heightRange, (uint32_t)data.heights.size(), (uint32_t)data.trees.size(), data.treeInstanceCount };
+	const size_t heightsSize = data.heights.size() * sizeof(uint16_t);
+	const size_t gradientsSize = data.gradients.size() * sizeof(uint32_t);
+	const size_t treesSize = getTreesSize(data.trees.size());
+	std::vector<uint8_t> blob(sizeof(BlobHeader) + heightsSize + gradientsSize + treesSize);
+	uint8_t* dst = blob.data();
+	memcpy(dst, &header, sizeof(BlobHeader));
+	dst += sizeof(BlobHeader);
+	memcpy(dst, data.heights.data(), heightsSize);
+	dst += heightsSize;
+	memcpy(dst, data.gradients.data(), gradientsSize);
+	dst += gradientsSize;
+	writeStream(dst, data.trees.positionX);
+	writeStream(dst, data.trees.positionY);
+	writeStream(dst, data.trees.positionZ);
+	writeStream(dst, data.trees.scale);
+	writeStream(dst, data.trees.rotation);
+	writeStream(dst, data.trees.color);
+	return blob;
+}
+
+bool ChunkArchive::deserialize(const uint8_t* data, size_t size, CompressedChunkData& compressed)
+{
+	if (size < sizeof(BlobHeader)) {
+		return false;
+	}
+	BlobHeader header;
+	memcpy(&header, data, sizeof(BlobHeader));
+	const size_t heightsSize = header.sampleCount * sizeof(uint16_t);
+	const size_t gradientsSize = header.sampleCount * sizeof(uint32_t);
+	const size_t treesSize = getTreesSize(header.treeCount);
+	if (size != sizeof(BlobHeader) + heightsSize + gradientsSize + treesSize) {
+		return false;
+	}
+	const uint8_t* src = data + sizeof(BlobHeader);
+	compressed.sampleStep = header.sampleStep;
+	compressed.samplesPerLine = header.samplesPerLine;
+	compressed.heightMin = header.heightMin;
+	compressed.heightRange = header.heightRange;
+	compressed.treeInstanceCount = header.treeInstanceCount;
+	compressed.heights.resize(header.sampleCount);
+	compressed.gradients.resize(header.sampleCount);
+	compressed.trees.resize(header.treeCount);
+	memcpy(compressed.heights.data(), src, heightsSize);
+	src += heightsSize;
+	memcpy(compressed.gradients.data(), src, gradientsSize);
+	src += gradientsSize;
+	readStream(src, compressed.trees.positionX);
+	readStream(src, compressed.trees.positionY);
+	readStream(src, compressed.trees.positionZ);
+	readStream(src, compressed.trees.scale);
+	readStream(src, compressed.trees.rotation);
+	readStream(src, compressed.trees.color);
+	compressed.trees.updateBounds();
+	return true;
+}
+
+ChunkArchive::Archive* ChunkArchive::getArchive(uint64_t settingsHash)
+{
+	auto it = archives.find(settingsHash);
+	if (it != archives.end()) {
+		return it->second.get();
+	}
+
+	auto archive = std::make_unique<Archive>();
+	std::stringstream filename;
+	filename << directory << "/chunks_" << std::hex << std::setw(16) << std::setfill('0') << settingsHash << ".bin";
+	archive->filename = filename.str();
+
+	const uint64_t dataStart = sizeof(FileHeader) + indexCapacity * sizeof(IndexEntry);
+	bool valid = false;
+	std::ifstream file(archive->filename, std::ios::binary);
+	if (file.is_open()) {
+		FileHeader header{};
+		file.read((char*)&header, sizeof(FileHeader));
+		valid = file.good() && (memcmp(header.magic, magic, sizeof(magic)) == 0) && (header.version == version) && (header.settingsHash == settingsHash) && (header.entryCount <= indexCapacity);
+		if (valid) {
+			std::vector<IndexEntry> entries(header.entryCount);
+			file.read((char*)entries.data(), entries.size() * sizeof(IndexEntry));
+			valid = file.good();
+			for (auto& entry : entries) {
+				archive->index[{ entry.x, entry.y, entry.levelOfDetail }] = entry;
+			}
+			archive->entryCount = header.entryCount;
+			file.seekg(0, std::ios::end);
+			archive->fileSize = (uint64_t)file.tellg();
+		}
+		file.close();
+	}
+
+	if (!valid) {
+		// Missing or incompatible, start with an empty archive
+		archive->index.clear();
+		archive->entryCount = 0;
+		std::ofstream newFile(archive->filename, std::ios::binary | std::ios::trunc);
+		FileHeader header{};
+		memcpy(header.magic, magic, sizeof(magic));
+		header.version = version;
+		header.entryCount = 0;
+		header.settingsHash = settingsHash;
+		newFile.write((const char*)&header, sizeof(FileHeader));
+		std::vector<IndexEntry> emptyIndex(indexCapacity);
+		newFile.write((const char*)emptyIndex.data(), emptyIndex.size() * sizeof(IndexEntry));
+		archive->fileSize = dataStart;
+	}
+
+	archive->mapping = std::make_unique<MappedFile>(archive->filename);
+	Archive* result = archive.get();
+	archives[settingsHash] = std::move(archive);
+	return result;
+}
+
+ChunkArchive::Lookup ChunkArchive::lookup(uint64_t settingsHash, const IndexKey& key, CompressedChunkData& compressed)
+{
+	std::shared_lock<std::shared_mutex> guard(mutex);
+	auto archive = archives.find(settingsHash);
+	if (archive == archives.end()) {
+		return Lookup::unavailable;
+	}
+	auto it = archive->second->index.find(key);
+	if (it == archive->second->index.end()) {
+		return Lookup::miss;
+	}
+	const IndexEntry& entry = it->second;
+	const MappedFile& mapping = *archive->second->mapping;
+	if (entry.offset + entry.size > mapping.size) {
+		return Lookup::unavailable;
+	}
+	const uint8_t* blob = mapping.data + entry.offset;
+	if ((checksum(blob, entry.size) != entry.checksum) || !deserialize(blob, entry.size, compressed)) {
+		return Lookup::checksumError;
+	}
+	return Lookup::hit;
+}
+
+bool ChunkArchive::get(const ChunkCache::Key& key, ChunkData& data)
+{
+	if (!isEnabled()) {
+		return false;
+	}
+	const IndexKey indexKey = { key.position.x, key.position.y, key.levelOfDetail };
+	CompressedChunkData compressed;
+	Lookup result = lookup(key.settingsHash, indexKey, compressed);
+	if (result == Lookup::unavailable) {
+		// Opening the archive and mapping it again after it has grown change the archive, so these take the exclusive lock
+		{
+			std::lock_guard<std::shared_mutex> guard(mutex);
+			Archive* archive = getArchive(key.settingsHash);
+			auto it = archive->index.find(indexKey);
+			if ((it != archive->index.end()) && (it->second.offset + it->second.size > archive->mapping->size)) {
+				archive->mapping = std::make_unique<MappedFile>(archive->filename);
+			}
+		}
+		result = lookup(key.settingsHash, indexKey, compressed);
+	}
+	if (result != Lookup::hit) {
+		if (result == Lookup::checksumError) {
+			checksumErrorCount++;
+		}
+		missCount++;
+		return false;
+	}
+	// Decompression doesn't touch the archive, so it's done without holding the lock
+	data = compressed.decompress();
+	hitCount++;
+	return true;
+}
+
+void ChunkArchive::put(const ChunkCache::Key& key, const ChunkData& data)
+{
+	if (!isEnabled()) {
+		return;
+	}
+	// Compression is done by the calling thread, only the disk access is deferred
+	std::vector<uint8_t> blob = serialize(CompressedChunkData::compress(data));
+	const uint64_t settingsHash = key.settingsHash;
+	const IndexKey indexKey = { key.position.x, key.position.y, key.levelOfDetail };
+	writerThread->addJob([this, settingsHash, indexKey, blob = std::move(blob)]() mutable {
+		write(settingsHash, indexKey, std::move(blob));
+	});
+}
+
+void ChunkArchive::flush()
+{
+	if (writerThread) {
+		writerThread->wait();
+	}
+}
+
+// Runs on the writer thread, which is the only thread modifying the archive files
+void ChunkArchive::write(uint64_t settingsHash, IndexKey key, std::vector<uint8_t> blob)
+{
+	IndexEntry entry{};
+	uint32_t slot = 0;
+	std::string filename;
+	{
+		std::lock_guard<std::shared_mutex> guard(mutex);
+		Archive* archive = getArchive(settingsHash);
+		if ((archive->index.find(key) != archive->index.end()) || (archive->entryCount >= indexCapacity)) {
+			return;
+		}
+		entry = { key.x, key.y, key.levelOfDetail, checksum(blob.data(), blob.size()), archive->fileSize, blob.size() };
+		slot = archive->entryCount;
+		filename = archive->filename;
+	}
+
+	// The blob is written before the index entry that references it, so an interrupted write never leaves a dangling entry
+	std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+	if (!file.is_open()) {
+		return;
+	}
+	file.seekp(entry.offset);
+	file.write((const char*)blob.data(), blob.size());
+	file.seekp(sizeof(FileHeader) + slot * sizeof(IndexEntry));
+	file.write((const char*)&entry, sizeof(IndexEntry));
+	const uint32_t entryCount = slot + 1;
+	file.seekp(offsetof(FileHeader, entryCount));
+	file.write((const char*)&entryCount, sizeof(uint32_t));
+	file.close();
+
+	std::lock_guard<std::shared_mutex> guard(mutex);
+	Archive* archive = getArchive(settingsHash);
+	archive->index[key] = entry;
+	archive->entryCount = entryCount;
+	archive->fileSize = entry.offset + entry.size;
+	writeCount++;
+}
+
+ChunkArchive::Stats ChunkArchive::getStats()
+{
+	std::shared_lock<std::shared_mutex> guard(mutex);
+	Stats stats;
+	stats.hits = hitCount;
+	stats.misses = missCount;
+	stats.writes = writeCount;
+	stats.checksumErrors = checksumErrorCount;
+	return stats;
+}
@@ -0,0 +1,111 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <tuple>
+#include "ChunkCache.h"
+#include "threadpool.hpp"
+
+// Persistent on-disk chunk cache
+// Chunks are stored in one archive file per settings hash, each file starts with a header and a fixed size index of chunk coordinates, followed by the compressed chunk blobs
+// Archives are memory mapped for reading, new chunks are appended by a separate writer thread so generation never waits for the disk
+class ChunkArchive {
+public:
+	struct Stats {
+		uint32_t hits = 0;
+		uint32_t misses = 0;
+		uint32_t writes = 0;
+		uint32_t checksumErrors = 0;
+	};
+
+	// Maximum number of chunks per archive file, further chunks are not written
+	static constexpr uint32_t indexCapacity = 16384;
+
+	ChunkArchive();
+	~ChunkArchive();
+	// Enables the archive, files are stored in the given directory
+	void enable(const std::string& directory);
+	bool isEnabled();
+	// Returns true and fills data if the chunk is stored in the archive, mesh data needs to be rebuilt from the heights
+	bool get(const ChunkCache::Key& key, ChunkData& data);
+	// Queues the chunk for writing
+	void put(const ChunkCache::Key& key, const ChunkData& data);
+	// Waits until all queued chunks have been written
+	void flush();
+	Stats getStats();
+private:
+	static constexpr char magic[8] = { 'T', 'E', 'R', 'R', 'A', 'R', 'C', 'H' };
+	static constexpr uint32_t version = 5;
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t entryCount;
+		uint64_t settingsHash;
+	};
+
+	struct IndexEntry {
+		int32_t x;
+		int32_t y;
+		int32_t levelOfDetail;
+		uint32_t checksum;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct IndexKey {
+		int32_t x;
+		int32_t y;
+		int32_t levelOfDetail;
+		bool operator<(const IndexKey& other) const {
+			return std::tie(x, y, levelOfDetail) < std::tie(other.x, other.y, other.levelOfDetail);
+		}
+	};
+
+	class MappedFile;
+
+	enum class Lookup { hit, miss, checksumError, unavailable };
+
+	struct Archive {
+		std::string filename;
+		uint32_t entryCount = 0;
+		uint64_t fileSize = 0;
+		std::map<IndexKey, IndexEntry> index;
+		std::unique_ptr<MappedFile> mapping;
+	};
+
+	std::string directory;
+	bool enabled = false;
+	std::map<uint64_t, std::unique_ptr<Archive>> archives;
+	// Reads only take a shared lock, opening an archive, mapping it again and writing new entries take an exclusive one
+	std::shared_mutex mutex;
+	// Updated by readers holding the shared lock
+	std::atomic<uint32_t> hitCount{ 0 };
+	std::atomic<uint32_t> missCount{ 0 };
+	std::atomic<uint32_t> checksumErrorCount{ 0 };
+	uint32_t writeCount = 0;
+	// Created on enable, so runs without the archive don't start a thread
+	std::unique_ptr<vks::Thread> writerThread;
+
+	Archive* getArchive(uint64_t settingsHash);
+	// Looks up and deserializes an entry, returns unavailable if the archive hasn't been opened yet or the entry lies beyond the current mapping
+	Lookup lookup(uint64_t settingsHash, const IndexKey& key, CompressedChunkData& compressed);
+	void write(uint64_t settingsHash, IndexKey key, std::vector<uint8_t> blob);
+	static uint32_t checksum(const uint8_t* data, size_t size);
+	static std::vector<uint8_t> serialize(const CompressedChunkData& data);
+	static bool deserialize(const uint8_t* data, size_t size, CompressedChunkData& compressed);
+};
+
+extern ChunkArchive chunkArchive;
@@ -0,0 +1,175 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "ChunkCache.h"
+#include <glm/gtc/packing.hpp>
+
+ChunkCache chunkCache{};
+
+size_t ChunkData::getSize() const
+{
+	return sizeof(ChunkData) + heights.size() * sizeof(float) + gradients.size() * sizeof(glm::vec2) + lowOctaves.heights.size() * sizeof(float) + lowOctaves.gradients.size() * sizeof(glm::vec2) +
+		vertices.size() * sizeof(vks::HeightMap::Vertex) + indices.size() * sizeof(uint32_t) + trees.getByteSize();
+}
+
+ChunkData ChunkData::fromChunk(const TerrainChunk& chunk)
+{
+	ChunkData data{};
+	data.sampleStep = chunk.heightMap->sampleStep;
+	data.samplesPerLine = chunk.heightMap->samplesPerLine;
+	data.heights = chunk.heightMap->heights;
+	data.gradients = chunk.heightMap->gradients;
+	data.lowOctaves = chunk.heightMap->lowOctaves;
+	data.vertices = chunk.heightMap->vertices;
+	data.indices = chunk.heightMap->indices;
+	data.minHeight = chunk.heightMap->minHeight;
+	data.maxHeight = chunk.heightMap->maxHeight;
+	data.trees = chunk.trees;
+	data.treeInstanceCount = chunk.treeInstanceCount;
+	return data;
+}
+
+size_t CompressedChunkData::getSize() const
+{
+	return sizeof(CompressedChunkData) + heights.size() * sizeof(uint16_t) + gradients.size() * sizeof(uint32_t) + trees.getByteSize();
+}
+
+ChunkCache::Key ChunkCache::getKey(const TerrainChunk& chunk)
+{
+	return { chunk.position, chunk.levelOfDetail, chunk.settings.getGenerationHash() };
+}
+
+size_t ChunkCache::KeyHash::operator()(const Key& key) const
+{
+	size_t hash = (size_t)key.settingsHash;
+	hash ^= std::hash<int>()(key.position.x) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	hash ^= std::hash<int>()(key.position.y) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	hash ^= std::hash<int>()(key.levelOfDetail) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	return hash;
+}
+
+CompressedChunkData CompressedChunkData::compress(const ChunkData& data)
+{
+	CompressedChunkData compressed{};
+	compressed.sampleStep = data.sampleStep;
+	compressed.samplesPerLine = data.samplesPerLine;
+	const auto [heightMin, heightMax] = std::minmax_element(data.heights.begin(), data.heights.end());
+	compressed.heightMin = *heightMin;
+	compressed.heightRange = *heightMax - *heightMin;
+	compressed.heights.resize(data.heights.size());
+	compressed.gradients.resize(data.gradients.size());
+	const float scale = (compressed.heightRange > 0.0f) ? 65535.0f / compressed.heightRange : 0.0f;
+	for (size_t i = 0; i < data.heights.size(); i++) {
+		compressed.heights[i] = (uint16_t)round((data.heights[i] - compressed.heightMin) * scale);
+		compressed.gradients[i] = glm::packHalf2x16(data.gradients[i]);
+	}
+	compressed.trees = data.trees;
+	compressed.treeInstanceCount = data.treeInstanceCount;
+	return compressed;
+}
+
+ChunkData CompressedChunkData::decompress() const
+{
+	ChunkData data{};
+	data.sampleStep = sampleStep;
+	data.samplesPerLine = samplesPerLine;
+	data.heights.resize(heights.size());
+	data.gradients.resize(gradients.size());
+	const float scale = heightRange / 65535.0f;
+	for (size_t i = 0; i < heights.size(); i++) {
+		data.heights[i] = heightMin + (float)heights[i] * scale;
+		data.gradients[i] = glm::unpackHalf2x16(gradients[i]);
+	}
+	data.trees = trees;
+	data.treeInstanceCount = treeInstanceCount;
+	return data;
+}
+
+bool ChunkCache::get(const Key& key, ChunkData& data)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	auto it = tier.lookup.find(key);
+	if (it != tier.lookup.end()) {
+		// Move to the front of the list to mark it as most recently used
+		tier.entries.splice(tier.entries.begin(), tier.entries, it->second);
+		data = it->second->second;
+		stats.hits++;
+		return true;
+	}
+	auto compressedIt = compressedTier.lookup.find(key);
+	if (compressedIt != compressedTier.lookup.end()) {
+		data = compressedIt->second->second.decompress();
+		compressedTier.size -= compressedIt->second->second.getSize();
+		compressedTier.entries.erase(compressedIt->second);
+		compressedTier.lookup.erase(compressedIt);
+		stats.compressedHits++;
+		return true;
+	}
+	stats.misses++;
+	return false;
+}
+
+void ChunkCache::put(const Key& key, const ChunkData& data)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	auto it = tier.lookup.find(key);
+	if (it != tier.lookup.end()) {
+		tier.size -= it->second->second.getSize();
+		tier.entries.erase(it->second);
+		tier.lookup.erase(it);
+	}
+	tier.entries.emplace_front(key, data);
+	tier.lookup[key] = tier.entries.begin();
+	tier.size += data.getSize();
+	evict();
+}
+
+void ChunkCache::evict()
+{
+	// Least recently used entries are moved to the compressed tier
+	while ((tier.size > maxSize) && (!tier.entries.empty())) {
+		auto& [key, data] = tier.entries.back();
+		if (maxCompressedSize > 0) {
+			auto compressedIt = compressedTier.lookup.find(key);
+			if (compressedIt != compressedTier.lookup.end()) {
+				compressedTier.size -= compressedIt->second->second.getSize();
+				compressedTier.entries.erase(compressedIt->second);
+			}
+			compressedTier.entries.emplace_front(key, CompressedChunkData::compress(data));
+			compressedTier.lookup[key] = compressedTier.entries.begin();
+			compressedTier.size += compressedTier.entries.front().second.getSize();
+		}
+		tier.size -= data.getSize();
+		tier.lookup.erase(key);
+		tier.entries.pop_back();
+	}
+	while ((compressedTier.size > maxCompressedSize) && (!compressedTier.entries.empty())) {
+		auto& [key, data] = compressedTier.entries.back();
+		compressedTier.size -= data.getSize();
+		compressedTier.lookup.erase(key);
+		compressedTier.entries.pop_back();
+	}
+}
+
+void ChunkCache::clear()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	tier = {};
+	compressedTier = {};
+}
+
+ChunkCache::Stats ChunkCache::getStats()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	Stats currentStats = stats;
+	currentStats.entryCount = tier.entries.size();
+	currentStats.size = tier.size;
+	currentStats.compressedEntryCount = compressedTier.entries.size();
+	currentStats.compressedSize = compressedTier.size;
+	return currentStats;
+}
@@ -0,0 +1,109 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include "TerrainChunk.h"
+
+// CPU side results of generating a terrain chunk
+struct ChunkData {
+	int sampleStep = 1;
+	int samplesPerLine = 0;
+	std::vector<float> heights;
+	std::vector<glm::vec2> gradients;
+	vks::HeightMap::LowOctaves lowOctaves;
+	// Mesh data is empty for entries restored from the compressed tier and needs to be rebuilt from the heights
+	std::vector<vks::HeightMap::Vertex> vertices;
+	std::vector<uint32_t> indices;
+	float minHeight = 0.0f;
+	float maxHeight = 0.0f;
+	TreeInstances trees;
+	int treeInstanceCount = 0;
+
+	size_t getSize() const;
+	// Captures the CPU side results of a chunk that has been generated
+	static ChunkData fromChunk(const TerrainChunk& chunk);
+};
+
+// Compact version of the chunk data that only keeps the quantized heights and the trees, used for cold cache entries and the chunk archive
+struct CompressedChunkData {
+	int sampleStep = 1;
+	int samplesPerLine = 0;
+	// Heights are stored as 16 bit values relative to the chunk's height range, gradients as half floats
+	float heightMin = 0.0f;
+	float heightRange = 0.0f;
+	std::vector<uint16_t> heights;
+	std::vector<uint32_t> gradients;
+	TreeInstances trees;
+	int treeInstanceCount = 0;
+
+	size_t getSize() const;
+	static CompressedChunkData compress(const ChunkData& data);
+	ChunkData decompress() const;
+};
+
+// Size bounded least recently used cache of generated chunk data
+// Entries that drop out of the cache are moved to a compressed tier that only keeps quantized heights and the trees
+class ChunkCache {
+public:
+	struct Key {
+		glm::ivec2 position;
+		int levelOfDetail;
+		// Hash of the generation relevant settings (see HeightMapSettings::getGenerationHash)
+		uint64_t settingsHash;
+		bool operator==(const Key& other) const {
+			return (position == other.position) && (levelOfDetail == other.levelOfDetail) && (settingsHash == other.settingsHash);
+		}
+	};
+
+	struct Stats {
+		uint32_t hits = 0;
+		uint32_t compressedHits = 0;
+		uint32_t misses = 0;
+		size_t entryCount = 0;
+		size_t size = 0;
+		size_t compressedEntryCount = 0;
+		size_t compressedSize = 0;
+	};
+
+	static Key getKey(const TerrainChunk& chunk);
+
+	// Maximum size in bytes of each tier, setting the compressed tier's size to zero disables it
+	size_t maxSize = 256 * 1024 * 1024;
+	size_t maxCompressedSize = 64 * 1024 * 1024;
+
+	// Returns true and fills data if an entry for the key is present
+	bool get(const Key& key, ChunkData& data);
+	void put(const Key& key, const ChunkData& data);
+	void clear();
+	Stats getStats();
+private:
+	struct KeyHash {
+		size_t operator()(const Key& key) const;
+	};
+
+	template<typename T>
+	struct Tier {
+		std::list<std::pair<Key, T>> entries;
+		std::unordered_map<Key, typename std::list<std::pair<Key, T>>::iterator, KeyHash> lookup;
+		size_t size = 0;
+	};
+
+	Tier<ChunkData> tier;
+	Tier<CompressedChunkData> compressedTier;
+	Stats stats;
+	std::mutex mutex;
+
+	void evict();
+};
+
+extern ChunkCache chunkCache;
@@ -0,0 +1,55 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "FrameScheduler.h"
+#include <chrono>
+
+FrameScheduler frameScheduler{};
+
+void FrameScheduler::enqueue(Priority priority, std::function<void()> task)
+{
+	queues[priority].push_back(std::move(task));
+}
+
+void FrameScheduler::run()
+{
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	auto elapsed = [](std::chrono::high_resolution_clock::time_point since) {
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - since).count();
+	};
+
+	double taskTime = 0.0;
+	uint32_t executedCount = 0;
+	for (auto& queue : queues) {
+		while (!queue.empty()) {
+			if ((executedCount > 0) && (elapsed(tStart) >= frameBudget)) {
+				break;
+			}
+			// Tasks may queue new tasks, so the task is taken off the queue before running it
+			std::function<void()> task = std::move(queue.front());
+			queue.pop_front();
+			const auto tTask = std::chrono::high_resolution_clock::now();
+			task();
+			taskTime += elapsed(tTask);
+			executedCount++;
+		}
+	}
+
+	stats.pendingCount = 0;
+	for (auto& queue : queues) {
+		stats.pendingCount += (uint32_t)queue.size();
+	}
+	stats.taskTime = taskTime;
+	stats.executedCount = executedCount;
+	stats.overhead = elapsed(tStart) - taskTime;
+}
+
+FrameScheduler::Stats FrameScheduler::getStats() const
+{
+	return stats;
+}
@@ -0,0 +1,49 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+// Main thread work scheduler with a per frame time budget
+// Work that doesn't need to be done in the current frame is queued as tasks and spread across frames, so heavy streaming doesn't cause frame time spikes
+// Tasks with the same priority are run in the order they were queued in
+// Not thread safe, tasks must only be queued from the main thread
+class FrameScheduler {
+public:
+	enum Priority : uint32_t {
+		priorityHigh = 0,
+		priorityNormal = 1,
+		priorityLow = 2,
+		priorityCount = 3
+	};
+
+	struct Stats {
+		// Time spent in tasks and in the scheduler itself during the last frame, in milliseconds
+		double taskTime = 0.0;
+		double overhead = 0.0;
+		uint32_t executedCount = 0;
+		uint32_t pendingCount = 0;
+	};
+
+	// Time in milliseconds tasks may take per frame, at least one task is run per frame so long tasks can't stall the queue
+	float frameBudget = 2.0f;
+
+	void enqueue(Priority priority, std::function<void()> task);
+	// Runs queued tasks in priority order until the frame budget is used up
+	void run();
+	Stats getStats() const;
+private:
+	std::array<std::deque<std::function<void()>>, priorityCount> queues;
+	Stats stats;
+};
+
+extern FrameScheduler frameScheduler;
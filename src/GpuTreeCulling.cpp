@@ -0,0 +1,377 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "GpuTreeCulling.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	// Calls fn for each primitive of the model that gets a draw command, in the order of the draw commands
+	template<typename Fn>
+	void forEachPrimitive(vkglTF::Model* model, Fn&& fn)
+	{
+		uint32_t index = 0;
+		for (auto& node : model->linearNodes) {
+			if (!node->mesh) {
+				continue;
+			}
+			for (vkglTF::Primitive* primitive : node->mesh->primitives) {
+				if (index >= GpuTreeCulling::maxCommandsPerLod) {
+					return;
+				}
+				fn(index++, primitive);
+			}
+		}
+	}
+
+	VkBufferMemoryBarrier bufferBarrier(const vks::Buffer& buffer, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask)
+	{
+		VkBufferMemoryBarrier barrier = vks::initializers::bufferMemoryBarrier();
+		barrier.srcAccessMask = srcAccessMask;
+		barrier.dstAccessMask = dstAccessMask;
+		barrier.buffer = buffer.buffer;
+		barrier.offset = 0;
+		barrier.size = VK_WHOLE_SIZE;
+		return barrier;
+	}
+}
+
+GpuTreeCulling::~GpuTreeCulling()
+{
+	for (auto& frame : frames) {
+		frame.params.destroy();
+		frame.staging.destroy();
+		for (auto& output : frame.output) {
+			output.destroy();
+		}
+		frame.commands.destroy();
+		for (auto& buffer : frame.retiredBuffers) {
+			buffer.destroy();
+		}
+		delete frame.descriptorSet;
+	}
+	pool.destroy();
+	delete pipeline;
+	delete pipelineLayout;
+	delete descriptorSetLayout;
+	delete descriptorPool;
+}
+
+void GpuTreeCulling::prepare(vks::VulkanDevice* device, VkPipelineCache pipelineCache, const std::string& shaderPath, uint32_t frameCount)
+{
+	this->device = device;
+	frames.resize(frameCount);
+
+	descriptorPool = new DescriptorPool(device->logicalDevice);
+	descriptorPool->setMaxSets(frameCount);
+	descriptorPool->addPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frameCount);
+	descriptorPool->addPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frameCount * 4);
+	descriptorPool->create();
+
+	descriptorSetLayout = new DescriptorSetLayout(device->logicalDevice);
+	descriptorSetLayout->addBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+	descriptorSetLayout->addBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+	descriptorSetLayout->addBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+	descriptorSetLayout->addBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+	descriptorSetLayout->addBinding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT);
+	descriptorSetLayout->create();
+
+	pipelineLayout = new PipelineLayout(device->logicalDevice);
+	pipelineLayout->addLayout(descriptorSetLayout);
+	pipelineLayout->addPushConstantRange(sizeof(PushConstants), 0, VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineLayout->create();
+
+	pipeline = new Pipeline(device->logicalDevice);
+	pipeline->setCompute();
+	pipeline->setCache(pipelineCache);
+	pipeline->setLayout(pipelineLayout);
+	pipeline->addShader(shaderPath + "tree_cull.comp.spv");
+	pipeline->create();
+
+	poolCapacity = minCapacity;
+	poolBufferCapacity = minCapacity;
+	freeRanges = { { 0, poolCapacity } };
+	VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pool, (VkDeviceSize)poolCapacity * sizeof(InstanceData)));
+
+	for (auto& frame : frames) {
+		VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.params, sizeof(Params)));
+		VK_CHECK_RESULT(frame.params.map());
+		// Instance counts are reset by copying the command templates at the start of each frame
+		VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame.commands, lodCount * maxCommandsPerLod * sizeof(VkDrawIndexedIndirectCommand)));
+		reserve(frame, minCapacity);
+		frame.descriptorSet = new DescriptorSet(device->logicalDevice);
+		frame.descriptorSet->setPool(descriptorPool);
+		frame.descriptorSet->addLayout(descriptorSetLayout);
+		frame.descriptorSet->addDescriptor(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &frame.params.descriptor);
+		frame.descriptorSet->addDescriptor(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &pool.descriptor);
+		frame.descriptorSet->addDescriptor(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.output[lodFull].descriptor);
+		frame.descriptorSet->addDescriptor(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.output[lodImpostor].descriptor);
+		frame.descriptorSet->addDescriptor(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.commands.descriptor);
+		frame.descriptorSet->create();
+		frame.boundPool = pool.buffer;
+	}
+}
+
+void GpuTreeCulling::reserve(FrameResources& frame, uint32_t treeCount)
+{
+	if (treeCount <= frame.capacity) {
+		return;
+	}
+	// Grown geometrically, so slowly rising tree counts don't recreate the buffers every frame
+	// The buffers are only used by this frame, which has finished on the GPU, so they can be destroyed right away
+	frame.capacity = std::max({ treeCount, frame.capacity * 2, minCapacity });
+	const VkDeviceSize size = (VkDeviceSize)frame.capacity * sizeof(InstanceData);
+	for (auto& output : frame.output) {
+		output.destroy();
+		VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &output, size));
+	}
+	if (frame.descriptorSet) {
+		frame.descriptorSet->updateDescriptor(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.output[lodFull].descriptor);
+		frame.descriptorSet->updateDescriptor(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.output[lodImpostor].descriptor);
+	}
+}
+
+GpuTreeCulling::Range GpuTreeCulling::allocate(uint32_t count)
+{
+	if (count == 0) {
+		return {};
+	}
+	for (;;) {
+		for (auto it = freeRanges.begin(); it != freeRanges.end(); it++) {
+			if (it->count < count) {
+				continue;
+			}
+			const Range range = { it->offset, count };
+			it->offset += count;
+			it->count -= count;
+			if (it->count == 0) {
+				freeRanges.erase(it);
+			}
+			return range;
+		}
+		// Grown geometrically like the frame's instance buffers, the new space is appended as a free range
+		const uint32_t capacity = std::max(poolCapacity * 2, poolCapacity + count);
+		release({ poolCapacity, capacity - poolCapacity });
+		poolCapacity = capacity;
+	}
+}
+
+void GpuTreeCulling::release(Range range)
+{
+	if (range.count == 0) {
+		return;
+	}
+	auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), range.offset, [](const Range& freeRange, uint32_t offset) { return freeRange.offset < offset; });
+	if ((next != freeRanges.end()) && (range.offset + range.count == next->offset)) {
+		range.count += next->count;
+		next = freeRanges.erase(next);
+	}
+	if (next != freeRanges.begin()) {
+		auto prev = std::prev(next);
+		if (prev->offset + prev->count == range.offset) {
+			prev->count += range.count;
+			return;
+		}
+	}
+	freeRanges.insert(next, range);
+}
+
+// The previous pool buffer may still be read by the other frames in flight, so it's retired instead of destroyed
+void GpuTreeCulling::growPool(VkCommandBuffer commandBuffer, FrameResources& frame)
+{
+	if (poolCapacity <= poolBufferCapacity) {
+		return;
+	}
+	vks::Buffer previous = pool;
+	pool = {};
+	VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pool, (VkDeviceSize)poolCapacity * sizeof(InstanceData)));
+	// Uploads of earlier frames need to be finished before their trees are copied
+	VkMemoryBarrier barrier = vks::initializers::memoryBarrier();
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	VkBufferCopy copyRegion{};
+	copyRegion.size = (VkDeviceSize)poolBufferCapacity * sizeof(InstanceData);
+	vkCmdCopyBuffer(commandBuffer, previous.buffer, pool.buffer, 1, &copyRegion);
+	// This frame's uploads may write into ranges covered by the copy
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	frame.retiredBuffers.push_back(previous);
+	poolBufferCapacity = poolCapacity;
+}
+
+void GpuTreeCulling::record(VkCommandBuffer commandBuffer, uint32_t frameIndex, const std::vector<Chunk>& chunks, const TreeCullParams& params, const std::array<vkglTF::Model*, lodCount>& models)
+{
+	FrameResources& frame = frames[frameIndex];
+	for (auto& buffer : frame.retiredBuffers) {
+		buffer.destroy();
+	}
+	frame.retiredBuffers.clear();
+	frame.stats = {};
+	frame.models = models;
+	recordCount++;
+
+	// Once all frames have been recorded again, no frame in flight can read the freed ranges anymore
+	for (auto it = pendingFrees.begin(); it != pendingFrees.end(); ) {
+		if (recordCount - it->second >= frames.size()) {
+			release(it->first);
+			it = pendingFrees.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	// Chunks with new or changed trees get a new range, so ranges read by frames in flight are never overwritten
+	std::vector<InstanceData> uploadInstances;
+	std::vector<VkBufferCopy> copyRegions;
+	uint32_t treeCount = 0;
+	for (const Chunk& chunk : chunks) {
+		auto it = allocations.find(chunk.chunk->id);
+		if ((it == allocations.end()) || (it->second.treeVersion != chunk.chunk->treeVersion)) {
+			if (it == allocations.end()) {
+				it = allocations.emplace(chunk.chunk->id, Allocation{}).first;
+			} else {
+				pendingFrees.push_back({ it->second.range, recordCount });
+			}
+			const std::vector<InstanceData> instances = chunk.chunk->getTreeInstances();
+			Allocation& allocation = it->second;
+			allocation.range = allocate((uint32_t)instances.size());
+			allocation.treeVersion = chunk.chunk->treeVersion;
+			if (!instances.empty()) {
+				VkBufferCopy copyRegion{};
+				copyRegion.srcOffset = uploadInstances.size() * sizeof(InstanceData);
+				copyRegion.dstOffset = (VkDeviceSize)allocation.range.offset * sizeof(InstanceData);
+				copyRegion.size = instances.size() * sizeof(InstanceData);
+				copyRegions.push_back(copyRegion);
+				uploadInstances.insert(uploadInstances.end(), instances.begin(), instances.end());
+				frame.stats.uploads++;
+			}
+		}
+		it->second.lastRecord = recordCount;
+		if (chunk.visible && (it->second.range.count > 0)) {
+			treeCount += it->second.range.count;
+			frame.stats.chunks++;
+		}
+	}
+	for (auto it = allocations.begin(); it != allocations.end(); ) {
+		if (it->second.lastRecord != recordCount) {
+			pendingFrees.push_back({ it->second.range, recordCount });
+			it = allocations.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	growPool(commandBuffer, frame);
+	if (frame.boundPool != pool.buffer) {
+		frame.descriptorSet->updateDescriptor(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &pool.descriptor);
+		frame.boundPool = pool.buffer;
+	}
+
+	if (!copyRegions.empty()) {
+		// The staging buffer is only used by this frame, which has finished on the GPU, so it can be reused right away
+		if (uploadInstances.size() > frame.stagingCapacity) {
+			frame.staging.destroy();
+			frame.stagingCapacity = std::max({ (uint32_t)uploadInstances.size(), frame.stagingCapacity * 2, minCapacity });
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.staging, (VkDeviceSize)frame.stagingCapacity * sizeof(InstanceData)));
+			VK_CHECK_RESULT(frame.staging.map());
+		}
+		memcpy(frame.staging.mapped, uploadInstances.data(), uploadInstances.size() * sizeof(InstanceData));
+		vkCmdCopyBuffer(commandBuffer, frame.staging.buffer, pool.buffer, (uint32_t)copyRegions.size(), copyRegions.data());
+	}
+
+	frame.stats.trees = treeCount;
+	if (treeCount == 0) {
+		return;
+	}
+	reserve(frame, treeCount);
+
+	// Draw commands start with no instances, unused commands draw nothing
+	std::array<VkDrawIndexedIndirectCommand, lodCount * maxCommandsPerLod> commands{};
+	for (uint32_t lod = 0; lod < lodCount; lod++) {
+		frame.commandCount[lod] = 0;
+		if (!models[lod]) {
+			continue;
+		}
+		forEachPrimitive(models[lod], [&](uint32_t index, vkglTF::Primitive* primitive) {
+			VkDrawIndexedIndirectCommand& command = commands[lod * maxCommandsPerLod + index];
+			command.indexCount = primitive->indexCount;
+			command.firstIndex = primitive->firstIndex;
+			frame.commandCount[lod] = index + 1;
+		});
+	}
+	vkCmdUpdateBuffer(commandBuffer, frame.commands.buffer, 0, sizeof(commands), commands.data());
+
+	Params* uniformParams = (Params*)frame.params.mapped;
+	memcpy(uniformParams->frustumPlanes, params.frustumPlanes, sizeof(uniformParams->frustumPlanes));
+	uniformParams->cameraPosition = glm::vec4(params.cameraPosition, params.radius);
+	uniformParams->distances = glm::vec4(params.maxDistanceFull, params.maxDistanceImpostor, 0.0f, 0.0f);
+	uniformParams->capacity = glm::uvec4(frame.capacity, 0, 0, 0);
+
+	std::array<VkBufferMemoryBarrier, 2> transferBarriers = {
+		bufferBarrier(pool, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT),
+		bufferBarrier(frame.commands, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, (uint32_t)transferBarriers.size(), transferBarriers.data(), 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->getHandle());
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout->handle, 0, 1, &frame.descriptorSet->handle, 0, nullptr);
+	PushConstants pushConstants{};
+	for (const Chunk& chunk : chunks) {
+		const Range& range = allocations.at(chunk.chunk->id).range;
+		if (!chunk.visible || (range.count == 0)) {
+			continue;
+		}
+		pushConstants.firstInstance = range.offset;
+		pushConstants.instanceCount = range.count;
+		pushConstants.alpha = chunk.alpha;
+		vkCmdPushConstants(commandBuffer, pipelineLayout->handle, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pushConstants);
+		vkCmdDispatch(commandBuffer, (pushConstants.instanceCount + workGroupSize - 1) / workGroupSize, 1, 1);
+	}
+
+	// The culling dispatches only count the instances in the first command of each level of detail
+	VkBufferMemoryBarrier countBarrier = bufferBarrier(frame.commands, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &countBarrier, 0, nullptr);
+	pushConstants = {};
+	pushConstants.finalize = 1;
+	vkCmdPushConstants(commandBuffer, pipelineLayout->handle, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pushConstants);
+	vkCmdDispatch(commandBuffer, 1, 1, 1);
+
+	std::array<VkBufferMemoryBarrier, 3> drawBarriers = {
+		bufferBarrier(frame.output[lodFull], VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT),
+		bufferBarrier(frame.output[lodImpostor], VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT),
+		bufferBarrier(frame.commands, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT),
+	};
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, nullptr, (uint32_t)drawBarriers.size(), drawBarriers.data(), 0, nullptr);
+}
+
+void GpuTreeCulling::draw(VkCommandBuffer commandBuffer, uint32_t frameIndex, Lod lod, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, bool bindImages) const
+{
+	const FrameResources& frame = frames[frameIndex];
+	vkglTF::Model* model = frame.models[lod];
+	if (!model || (frame.stats.trees == 0) || (frame.commandCount[lod] == 0)) {
+		return;
+	}
+	const VkDeviceSize offsets[1] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &model->vertices.buffer, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, model->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdBindVertexBuffers(commandBuffer, 1, 1, &frame.output[lod].buffer, offsets);
+	forEachPrimitive(model, [&](uint32_t index, vkglTF::Primitive* primitive) {
+		if (bindImages) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, bindImageSet, 1, &primitive->material.descriptorSet, 0, nullptr);
+		}
+		const VkDeviceSize commandOffset = (lod * maxCommandsPerLod + index) * sizeof(VkDrawIndexedIndirectCommand);
+		vkCmdDrawIndexedIndirect(commandBuffer, frame.commands.buffer, commandOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+	});
+}
+
+GpuTreeCulling::Stats GpuTreeCulling::getStats(uint32_t frameIndex) const
+{
+	return frames[frameIndex].stats;
+}
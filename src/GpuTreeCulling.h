@@ -0,0 +1,141 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "vulkan/vulkan.h"
+#include "VulkanDevice.hpp"
+#include "VulkanBuffer.hpp"
+#include "VulkanglTFModel.h"
+#include "DescriptorPool.hpp"
+#include "DescriptorSetLayout.hpp"
+#include "DescriptorSet.hpp"
+#include "PipelineLayout.hpp"
+#include "Pipeline.hpp"
+#include "TerrainChunk.h"
+#include "TreeInstances.h"
+
+// Culls the trees of the visible chunks with a compute shader and draws them with indirect draws
+// The trees of all chunks are kept in a persistent pool, each chunk's trees are uploaded into their own range once with the frame's command buffer when the chunk is first culled or its trees change
+// Per frame, each visible chunk's range is culled and classified by distance and compacted into one instance stream per level of detail
+// The number of instances in each stream is written to the indirect draw commands by the GPU
+class GpuTreeCulling {
+public:
+	enum Lod { lodFull = 0, lodImpostor = 1, lodCount = 2 };
+	// Each level of detail has one draw command per primitive of its model
+	static constexpr uint32_t maxCommandsPerLod = 8;
+
+	// Chunks that aren't visible keep their trees in the pool, chunks that aren't passed anymore have their range freed
+	struct Chunk {
+		TerrainChunk* chunk;
+		float alpha;
+		bool visible;
+	};
+
+	struct Stats {
+		uint32_t chunks = 0;
+		uint32_t trees = 0;
+		// Chunks whose trees were uploaded in this frame, as they were culled for the first time or their trees changed in place
+		uint32_t uploads = 0;
+	};
+
+	~GpuTreeCulling();
+	void prepare(vks::VulkanDevice* device, VkPipelineCache pipelineCache, const std::string& shaderPath, uint32_t frameCount);
+	// Records the culling into the command buffer, must be called outside of a render pass and before the first draw
+	// Chunks should contain all generated chunks, the trees of chunks missing from the list are removed from the pool
+	void record(VkCommandBuffer commandBuffer, uint32_t frameIndex, const std::vector<Chunk>& chunks, const TreeCullParams& params, const std::array<vkglTF::Model*, lodCount>& models);
+	// Draws the culled trees of a level of detail with the currently bound pipeline, instances are bound to vertex input binding 1
+	void draw(VkCommandBuffer commandBuffer, uint32_t frameIndex, Lod lod, VkPipelineLayout pipelineLayout, uint32_t bindImageSet, bool bindImages) const;
+	Stats getStats(uint32_t frameIndex) const;
+private:
+	struct Params {
+		glm::vec4 frustumPlanes[6];
+		// w = bounding sphere radius
+		glm::vec4 cameraPosition;
+		// x = max. distance for full detail, y = max. distance for impostors
+		glm::vec4 distances;
+		// x = instance capacity of the streams
+		glm::uvec4 capacity;
+	};
+
+	struct PushConstants {
+		uint32_t firstInstance;
+		uint32_t instanceCount;
+		float alpha;
+		uint32_t finalize;
+	};
+
+	// Range of instances in the tree pool
+	struct Range {
+		uint32_t offset;
+		uint32_t count;
+	};
+
+	// A chunk's trees in the tree pool
+	struct Allocation {
+		Range range{};
+		uint32_t treeVersion = 0;
+		// Record the chunk was last passed in
+		uint64_t lastRecord = 0;
+	};
+
+	struct FrameResources {
+		vks::Buffer params;
+		// Host visible copy of the trees uploaded in this frame
+		vks::Buffer staging;
+		uint32_t stagingCapacity = 0;
+		std::array<vks::Buffer, lodCount> output;
+		vks::Buffer commands;
+		DescriptorSet* descriptorSet = nullptr;
+		// Tree pool the descriptor set points to, as the descriptor set can only be updated while the frame isn't in flight
+		VkBuffer boundPool = VK_NULL_HANDLE;
+		uint32_t capacity = 0;
+		std::array<vkglTF::Model*, lodCount> models{};
+		std::array<uint32_t, lodCount> commandCount{};
+		// Buffers that were replaced while this frame's command buffer was recorded, destroyed once the frame comes around again
+		std::vector<vks::Buffer> retiredBuffers;
+		Stats stats;
+	};
+
+	static constexpr uint32_t minCapacity = 1024;
+	static constexpr uint32_t workGroupSize = 64;
+
+	vks::VulkanDevice* device = nullptr;
+	DescriptorPool* descriptorPool = nullptr;
+	DescriptorSetLayout* descriptorSetLayout = nullptr;
+	PipelineLayout* pipelineLayout = nullptr;
+	Pipeline* pipeline = nullptr;
+	std::vector<FrameResources> frames;
+
+	// Trees of all chunks, shared by all frames
+	vks::Buffer pool;
+	// Instances the pool buffer can hold, and instances the ranges were allocated from
+	uint32_t poolBufferCapacity = 0;
+	uint32_t poolCapacity = 0;
+	// Unused ranges of the pool sorted by offset, adjacent ranges are merged
+	std::vector<Range> freeRanges;
+	// Ranges that were freed by a record, but may still be read by the other frames in flight
+	std::vector<std::pair<Range, uint64_t>> pendingFrees;
+	// Keyed by chunk id
+	std::unordered_map<uint32_t, Allocation> allocations;
+	uint64_t recordCount = 0;
+
+	// Recreates the instance buffers of a frame if they can't hold the given number of trees
+	void reserve(FrameResources& frame, uint32_t treeCount);
+	// Takes a range from the free ranges, grows the pool's capacity if no range is large enough
+	// The pool buffer itself is only recreated after all ranges of a record have been allocated (see growPool)
+	Range allocate(uint32_t count);
+	void release(Range range);
+	// Recreates the pool buffer if its capacity grew, the previous contents are copied over
+	void growPool(VkCommandBuffer commandBuffer, FrameResources& frame);
+};
@@ -0,0 +1,238 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "GrassField.h"
+#include <cstring>
+#include <cfloat>
+#include "Noise.h"
+#include "TerrainQuery.h"
+#include "threadpool.hpp"
+
+namespace {
+	// Rounds towards negative infinity, so cells left of the world origin end up in the right tile
+	int floorDiv(int value, int divisor)
+	{
+		return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+	}
+
+	int positiveMod(int value, int divisor)
+	{
+		const int result = value % divisor;
+		return (result < 0) ? result + divisor : result;
+	}
+
+	uint64_t combineKey(uint64_t key, uint64_t value)
+	{
+		return (key ^ value) * 0x100000001b3ull;
+	}
+
+	TerrainChunk* findChunk(const std::vector<TerrainChunk*>& chunks, int chunkCoordX, int chunkCoordY)
+	{
+		for (TerrainChunk* chunk : chunks) {
+			if ((chunk->position.x == chunkCoordX) && (chunk->position.y == chunkCoordY)) {
+				return chunk;
+			}
+		}
+		return nullptr;
+	}
+}
+
+void GrassField::update(const glm::vec3& center, const Settings& settings, const std::vector<TerrainChunk*>& chunks, int chunkSize)
+{
+	stats.tilesGenerated = 0;
+
+	// Changing any of the grass settings invalidates all cached tiles
+	const int newTilesPerSide = (settings.dim > 0) ? (settings.dim + tileSize - 1) / tileSize + 1 : 0;
+	if (!(settings == this->settings) || (newTilesPerSide != tilesPerSide)) {
+		this->settings = settings;
+		tilesPerSide = newTilesPerSide;
+		tiles.assign(tilesPerSide * tilesPerSide, Tile{});
+		samples.resize(tiles.size() * samplesPerTile);
+		thinning.resize(tiles.size() * samplesPerTile);
+	}
+	stats.tileCount = (uint32_t)tiles.size();
+	if (tiles.empty()) {
+		return;
+	}
+
+	// The grid is aligned to whole tiles, its first cell is the tile containing the first cell of the grass patch
+	const int firstCellX = (int)round(center.x / settings.scale) - settings.dim / 2;
+	const int firstCellY = (int)round(center.z / settings.scale) - settings.dim / 2;
+	origin = glm::ivec2(floorDiv(firstCellX, tileSize), floorDiv(firstCellY, tileSize));
+
+	// Each world space tile maps to a fixed slot of the grid, the slot needs to be generated if it still holds a tile that left the grid
+	// Tiles also depend on the chunks they take their heights from, so refined or regenerated chunks invalidate the tiles on top of them
+	staleTiles.clear();
+	const float tileExtent = (float)tileSize * settings.scale;
+	for (int y = origin.y; y < origin.y + tilesPerSide; y++) {
+		for (int x = origin.x; x < origin.x + tilesPerSide; x++) {
+			const uint32_t index = positiveMod(y, tilesPerSide) * tilesPerSide + positiveMod(x, tilesPerSide);
+			// Samples are jittered by up to one unit, so a tile may reach into the neighbouring chunks
+			const int chunkMinX = (int)round(((float)x * tileExtent) / (float)chunkSize);
+			const int chunkMaxX = (int)round(((float)(x + 1) * tileExtent + 1.0f) / (float)chunkSize);
+			const int chunkMinY = (int)round(((float)y * tileExtent - 1.0f) / (float)chunkSize);
+			const int chunkMaxY = (int)round(((float)(y + 1) * tileExtent) / (float)chunkSize);
+			uint64_t terrainKey = 0xcbf29ce484222325ull;
+			for (int chunkY = chunkMinY; chunkY <= chunkMaxY; chunkY++) {
+				for (int chunkX = chunkMinX; chunkX <= chunkMaxX; chunkX++) {
+					const TerrainChunk* chunk = findChunk(chunks, chunkX, chunkY);
+					if (chunk) {
+						terrainKey = combineKey(terrainKey, ((uint64_t)(uint32_t)chunk->position.x << 32) | (uint32_t)chunk->position.y);
+						terrainKey = combineKey(terrainKey, ((uint64_t)chunk->settingsVersion << 32) | (uint32_t)chunk->levelOfDetail);
+					} else {
+						terrainKey = combineKey(terrainKey, UINT64_MAX);
+					}
+				}
+			}
+			Tile& tile = tiles[index];
+			if ((tile.coord != glm::ivec2(x, y)) || (tile.terrainKey != terrainKey)) {
+				tile.coord = glm::ivec2(x, y);
+				tile.terrainKey = terrainKey;
+				staleTiles.push_back(index);
+			}
+		}
+	}
+
+	vks::parallelFor((uint32_t)staleTiles.size(), 4, [&](uint32_t first, uint32_t last) {
+		for (uint32_t i = first; i < last; i++) {
+			generateTile(staleTiles[i], chunks, chunkSize);
+		}
+	});
+	stats.tilesGenerated = (uint32_t)staleTiles.size();
+}
+
+void GrassField::generateTile(uint32_t index, const std::vector<TerrainChunk*>& chunks, int chunkSize)
+{
+	Tile& tile = tiles[index];
+	InstanceData* dst = &samples[index * samplesPerTile];
+	float* dstThinning = &thinning[index * samplesPerTile];
+	tile.count = 0;
+	tile.boundsMin = glm::vec3(FLT_MAX);
+	tile.boundsMax = glm::vec3(-FLT_MAX);
+
+	// Heights of the whole tile are queried at once, the rows of a tile are on the same chunk most of the time
+	glm::vec3 positions[samplesPerTile];
+	float randomValues[samplesPerTile];
+	float thinningValues[samplesPerTile];
+	float heights[samplesPerTile];
+	uint8_t found[samplesPerTile];
+	for (int y = 0; y < tileSize; y++) {
+		for (int x = 0; x < tileSize; x++) {
+			const int cellX = tile.coord.x * tileSize + x;
+			const int cellY = tile.coord.y * tileSize + y;
+			// Random value is keyed by the world space grass cell, so it stays stable while the patch moves with the camera
+			const float rndVal = hashNoiseFloat(cellX, cellY, (uint32_t)settings.seed);
+			randomValues[y * tileSize + x] = rndVal;
+			thinningValues[y * tileSize + x] = hashNoiseFloat(cellX, cellY, (uint32_t)settings.seed + 1);
+			positions[y * tileSize + x] = glm::vec3((float)cellX * settings.scale + rndVal, 0.0f, (float)cellY * settings.scale - rndVal);
+		}
+	}
+	TerrainSamples terrainSamples{};
+	terrainSamples.heights = heights;
+	terrainSamples.found = found;
+	sampleTerrain(chunks, chunkSize, positions, terrainSamples);
+
+	for (uint32_t i = 0; i < samplesPerTile; i++) {
+		if (!found[i]) {
+			continue;
+		}
+		const float h = heights[i];
+		if ((abs(h) <= settings.waterPosition) || (abs(h) > 12.0f)) {
+			continue;
+		}
+		const float rndVal = randomValues[i];
+		const glm::vec3 worldPos = glm::vec3(positions[i].x, h, positions[i].z);
+		InstanceData& instance = dst[tile.count];
+		instance.pos = worldPos;
+		instance.scale = packInstanceScale(1.0f + rndVal * 0.15f, 0.5f + rndVal * 0.25f);
+		// The uv index selects one of the four grass variants in the texture
+		instance.rotation = packInstanceRotation(glm::vec3(M_PI * rndVal * 0.035f, M_PI * rndVal * 360.0f, M_PI * rndVal * -0.035f), (uint32_t)(rndVal * 4.0f) % 4);
+		//instance.uv.s = 0.75f; // @todo: looks nicer in certain scenarios (e.g. default)
+		instance.color = packInstanceColor(glm::vec4(glm::vec3(0.6f + rndVal * 0.4f), 1.0f));
+		dstThinning[tile.count] = thinningValues[i];
+		tile.boundsMin = glm::min(tile.boundsMin, worldPos);
+		tile.boundsMax = glm::max(tile.boundsMax, worldPos);
+		tile.count++;
+	}
+}
+
+uint32_t GrassField::getTileCount() const
+{
+	return (uint32_t)tiles.size();
+}
+
+uint32_t GrassField::cullTile(uint32_t index, const vks::Frustum& frustum, const glm::vec3& cameraPosition, InstanceData* dst) const
+{
+	const Tile& tile = tiles[index];
+	if (tile.count == 0) {
+		return 0;
+	}
+
+	const float radius = 10.0f;
+	// Grass fades out over the last quarter of the field and gets thinned out over its outer half
+	const float adim = (float)settings.dim * settings.scale;
+	const float fdim = adim * 0.75f;
+	const float thinningStart = adim * 0.5f;
+
+	// Frustum: the range of plane distances over the tile's bounds decides if all of its grass is on the same side of a plane
+	bool inside = true;
+	for (uint32_t i = 0; i < 6; i++) {
+		const glm::vec4& plane = frustum.planes[i];
+		const glm::vec3 normal = glm::vec3(plane);
+		const glm::vec3 positive = glm::mix(tile.boundsMin, tile.boundsMax, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+		const glm::vec3 negative = glm::mix(tile.boundsMax, tile.boundsMin, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+		if (glm::dot(normal, positive) + plane.w <= -radius) {
+			return 0;
+		}
+		if (glm::dot(normal, negative) + plane.w <= -radius) {
+			inside = false;
+		}
+	}
+
+	// Distance: tiles completely beyond the field are dropped, tiles completely in front of the thinned out area are copied as they are
+	const glm::vec3 closest = glm::clamp(cameraPosition, tile.boundsMin, tile.boundsMax) - cameraPosition;
+	const glm::vec3 farthest = glm::max(glm::abs(tile.boundsMin - cameraPosition), glm::abs(tile.boundsMax - cameraPosition));
+	if (glm::dot(closest, closest) >= adim * adim) {
+		return 0;
+	}
+	const InstanceData* src = &samples[index * samplesPerTile];
+	if (inside && (glm::dot(farthest, farthest) < thinningStart * thinningStart)) {
+		memcpy(dst, src, tile.count * sizeof(InstanceData));
+		return tile.count;
+	}
+
+	const float* srcThinning = &thinning[index * samplesPerTile];
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < tile.count; i++) {
+		const InstanceData& instance = src[i];
+		if (!inside && !frustum.checkSphere(instance.pos, radius)) {
+			continue;
+		}
+		const float d = glm::distance(instance.pos, cameraPosition);
+		if (d >= adim) {
+			continue;
+		}
+		if (d > thinningStart) {
+			const float density = glm::mix(1.0f, minDensity, (d - thinningStart) / (adim - thinningStart));
+			if (srcThinning[i] >= density) {
+				continue;
+			}
+		}
+		dst[count] = instance;
+		if (d > fdim) {
+			setInstanceAlpha(dst[count], (adim - d) / (adim - fdim));
+		}
+		count++;
+	}
+	return count;
+}
+
+GrassField::Stats GrassField::getStats() const
+{
+	return stats;
+}
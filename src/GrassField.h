@@ -0,0 +1,78 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "frustum.hpp"
+#include "TerrainChunk.h"
+
+// Grass layer around the viewer, cached in tiles of a toroidally addressed grid of world space grass cells
+// When the viewer moves, only the tiles entering the grid are generated, tiles that stay in the grid are just culled again
+// A tile is also generated again if one of the terrain chunks it lies on has been replaced
+// Not thread safe, must only be used by one draw batch build at a time
+class GrassField {
+public:
+	// Tiles are tileSize x tileSize grass cells, they are generated and culled as a whole
+	static constexpr int tileSize = 8;
+	static constexpr uint32_t samplesPerTile = tileSize * tileSize;
+
+	struct Settings {
+		int dim = 0;
+		float scale = 1.0f;
+		int seed = 0;
+		float waterPosition = 0.0f;
+		bool operator==(const Settings& other) const = default;
+	};
+
+	struct Stats {
+		uint32_t tileCount = 0;
+		// Tiles generated by the last update, all other tiles were taken from the cache
+		uint32_t tilesGenerated = 0;
+	};
+
+	// Density of the grass at the far end of the field, grass gets thinned out linearly starting at half the field's size
+	float minDensity = 0.25f;
+
+	// Moves the grid to center and generates all tiles that aren't cached
+	// Heights are taken from chunks, tiles on chunks that aren't in the list are generated again once their chunks show up
+	void update(const glm::vec3& center, const Settings& settings, const std::vector<TerrainChunk*>& chunks, int chunkSize);
+	uint32_t getTileCount() const;
+	// Culls the grass of a tile and writes the visible instances to dst, which must have room for samplesPerTile instances
+	// Returns the number of instances written
+	uint32_t cullTile(uint32_t tile, const vks::Frustum& frustum, const glm::vec3& cameraPosition, InstanceData* dst) const;
+	Stats getStats() const;
+private:
+	struct Tile {
+		// World space tile coordinate the tile was generated for
+		glm::ivec2 coord = glm::ivec2(INT32_MIN);
+		// Identifies the terrain chunks the grass heights were taken from
+		uint64_t terrainKey = 0;
+		uint32_t count = 0;
+		// Bounds of the grass positions
+		glm::vec3 boundsMin = glm::vec3(0.0f);
+		glm::vec3 boundsMax = glm::vec3(0.0f);
+	};
+
+	Settings settings;
+	int tilesPerSide = 0;
+	// World space tile coordinate of the grid's first tile
+	glm::ivec2 origin = glm::ivec2(0);
+	std::vector<Tile> tiles;
+	// Valid samples of each tile are stored at the start of the tile's range
+	std::vector<InstanceData> samples;
+	// Random value each sample is kept for when the grass is thinned out with distance
+	std::vector<float> thinning;
+	// Tiles that need to be generated by the current update, kept to avoid allocations
+	std::vector<uint32_t> staleTiles;
+	Stats stats;
+
+	void generateTile(uint32_t index, const std::vector<TerrainChunk*>& chunks, int chunkSize);
+};
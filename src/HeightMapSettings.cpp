@@ -7,6 +7,7 @@
  */
 
 #include "HeightMapSettings.h"
+#include <cstring>
 
 HeightMapSettings heightMapSettings{};
 
@@ -41,6 +42,11 @@ void HeightMapSettings::loadFromFile(const std::string filename)
 	if (settings.find("lacunarity") != settings.end()) {
 		lacunarity = std::stof(settings["lacunarity"]);
 	}
+	// Presets without a noise type were designed with perlin noise
+	noiseType = NoiseType::Perlin;
+	if (settings.find("noiseType") != settings.end()) {
+		noiseType = getNoiseType(settings["noiseType"]);
+	}
 	if (settings.find("treeDensity") != settings.end()) {
 		treeDensity = std::stoi(settings["treeDensity"]);
 	}
@@ -59,6 +65,9 @@ void HeightMapSettings::loadFromFile(const std::string filename)
 	if (settings.find("maxTreeSize") != settings.end()) {
 		maxTreeSize = std::stof(settings["maxTreeSize"]);
 	}
+	if (settings.find("maxTreeSlope") != settings.end()) {
+		maxTreeSlope = std::stof(settings["maxTreeSlope"]);
+	}
 	if (settings.find("waterColor.r") != settings.end()) {
 		waterColor[0] = std::stof(settings["waterColor.r"]) / 255.0f;
 	}
@@ -111,4 +120,50 @@ void HeightMapSettings::loadFromFile(const std::string filename)
 			textureLayers[i].y = std::stof(settings[id + ".range"]);
 		}
 	}
-}
\ No newline at end of file
+}
+
+uint32_t HeightMapSettings::getInvalidatedStages(const HeightMapSettings& previous) const
+{
+	if ((noiseScale != previous.noiseScale) || (seed != previous.seed) || (octaves != previous.octaves) || (persistence != previous.persistence) || (lacunarity != previous.lacunarity) ||
+		(noiseType != previous.noiseType) || (mapChunkSize != previous.mapChunkSize) || (levelOfDetail != previous.levelOfDetail)) {
+		return stageNoise | stageMesh | stageTrees;
+	}
+	if (heightScale != previous.heightScale) {
+		return stageMesh | stageTrees;
+	}
+	if ((treeDensity != previous.treeDensity) || (minTreeSize != previous.minTreeSize) || (maxTreeSize != previous.maxTreeSize) || (maxTreeSlope != previous.maxTreeSlope) || (waterPosition != previous.waterPosition)) {
+		return stageTrees;
+	}
+	return stageNone;
+}
+
+uint64_t HeightMapSettings::getGenerationHash() const
+{
+	// FNV-1a over the raw bits of each value in a fixed byte order, unlike std::hash the result is the same with every compiler and platform
+	// This matters as the hash names the files of the chunk archive
+	uint64_t hash = 14695981039346656037ull;
+	auto combine = [&hash](auto value) {
+		static_assert(sizeof(value) == sizeof(uint32_t));
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(uint32_t));
+		for (uint32_t i = 0; i < sizeof(uint32_t); i++) {
+			hash ^= (bits >> (i * 8)) & 0xff;
+			hash *= 1099511628211ull;
+		}
+	};
+	combine(noiseScale);
+	combine(seed);
+	combine(octaves);
+	combine(persistence);
+	combine(lacunarity);
+	combine((int)noiseType);
+	combine(mapChunkSize);
+	combine(levelOfDetail);
+	combine(heightScale);
+	combine(treeDensity);
+	combine(minTreeSize);
+	combine(maxTreeSize);
+	combine(maxTreeSlope);
+	combine(waterPosition);
+	return hash;
+}
@@ -13,26 +13,47 @@
 #include <fstream>
 #include <sstream>
 #include <glm/glm.hpp>
+#include "Noise.h"
 
 #define TERRAIN_LAYER_COUNT 6
 
 class HeightMapSettings {
 public:
+	// Chunk generation stages, each setting is tagged with the earliest stage it affects
+	// Later stages depend on the results of earlier ones, so changing a setting re-runs its stage and all following ones
+	enum Stage : uint32_t {
+		stageNone = 0,
+		stageNoise = 1 << 0,
+		stageMesh = 1 << 1,
+		stageTrees = 1 << 2,
+		stageAll = stageNoise | stageMesh | stageTrees
+	};
+
+	// Stage: noise
 	float noiseScale = 66.0f;
 	int seed = 54;
-	uint32_t width = 100;
-	uint32_t height = 100;
-	float heightScale = 28.5f;
 	uint32_t octaves = 4;
 	float persistence = 0.5f;
 	float lacunarity = 1.87f;
-	glm::vec2 offset = { 0,0 };
+	NoiseType noiseType = NoiseType::Perlin;
 	int mapChunkSize = 241;
 	int levelOfDetail = 1;
+
+	// Stage: mesh
+	float heightScale = 28.5f;
+
+	// Stage: trees
 	int treeDensity = 30;
-	int grassDensity = 256;
 	float minTreeSize = 0.75f;
 	float maxTreeSize = 1.5f;
+	// Steepest terrain trees are placed on, in degrees
+	float maxTreeSlope = 45.0f;
+	float waterPosition = 1.75f;
+
+	// Shading only, applied at render time without touching chunk data
+	uint32_t width = 100;
+	uint32_t height = 100;
+	int grassDensity = 256;
 	int treeModelIndex = 2;
 	glm::vec4 textureLayers[TERRAIN_LAYER_COUNT];
 	float waterColor[3];
@@ -49,10 +70,12 @@ public:
 	float maxDrawDistanceTreesFull = 128.0f;
 	float maxDrawDistanceTreesImposter = 512.0f * 1.5f;
 
-	float waterPosition = 1.75f;
-
 	float maxChunkDrawDistance = 360.0f; // 460.0f; @todo
 
+	// Returns the stages that need to be re-run for data generated with the previous settings
+	uint32_t getInvalidatedStages(const HeightMapSettings& previous) const;
+	// Hash of all settings that affect chunk generation (everything except shading only settings)
+	uint64_t getGenerationHash() const;
 	void loadFromFile(const std::string filename);
 };
 
@@ -0,0 +1,227 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "HeightPyramid.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+// Ray in cell units, x and y are measured in cells (instead of full resolution samples) starting at the first height sample
+struct HeightPyramid::Ray {
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+namespace
+{
+	// Clips [t0, t1] to the part of the ray inside the box (x and y only), returns false if nothing is left
+	bool clipRay(const glm::vec3& origin, const glm::vec3& direction, const glm::vec2& boxMin, const glm::vec2& boxMax, float& t0, float& t1)
+	{
+		for (int axis = 0; axis < 2; axis++) {
+			if (std::abs(direction[axis]) < 1e-12f) {
+				if ((origin[axis] < boxMin[axis]) || (origin[axis] > boxMax[axis])) {
+					return false;
+				}
+				continue;
+			}
+			const float invDirection = 1.0f / direction[axis];
+			float tNear = (boxMin[axis] - origin[axis]) * invDirection;
+			float tFar = (boxMax[axis] - origin[axis]) * invDirection;
+			if (tNear > tFar) {
+				std::swap(tNear, tFar);
+			}
+			t0 = std::max(t0, tNear);
+			t1 = std::min(t1, tFar);
+		}
+		return t0 <= t1;
+	}
+}
+
+void HeightPyramid::build(const vks::HeightMap& heightMap)
+{
+	clear();
+	if (heightMap.samplesPerLine < 2) {
+		return;
+	}
+	cellCount = heightMap.samplesPerLine - 1;
+	int32_t size = cellCount;
+	while (size > 1) {
+		Level level;
+		level.size = (size + 1) / 2;
+		level.ranges.resize(level.size * level.size);
+		for (int32_t y = 0; y < level.size; y++) {
+			for (int32_t x = 0; x < level.size; x++) {
+				glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+				for (int32_t cy = y * 2; cy < std::min(y * 2 + 2, size); cy++) {
+					for (int32_t cx = x * 2; cx < std::min(x * 2 + 2, size); cx++) {
+						const glm::vec2 childRange = levels.empty() ? getCellRange(heightMap, cx, cy) : levels.back().ranges[cy * size + cx];
+						range = glm::vec2(std::min(range.x, childRange.x), std::max(range.y, childRange.y));
+					}
+				}
+				level.ranges[y * level.size + x] = range;
+			}
+		}
+		levels.push_back(std::move(level));
+		size = levels.back().size;
+	}
+}
+
+void HeightPyramid::clear()
+{
+	levels.clear();
+	cellCount = 0;
+}
+
+bool HeightPyramid::empty() const
+{
+	return cellCount == 0;
+}
+
+glm::vec2 HeightPyramid::getRange() const
+{
+	// A height map with a single cell has no stored levels, its range is unknown without the heights
+	return levels.empty() ? glm::vec2(-FLT_MAX, FLT_MAX) : levels.back().ranges[0];
+}
+
+size_t HeightPyramid::getByteSize() const
+{
+	size_t size = 0;
+	for (const Level& level : levels) {
+		size += level.ranges.size() * sizeof(glm::vec2);
+	}
+	return size;
+}
+
+glm::vec2 HeightPyramid::getCellRange(const vks::HeightMap& heightMap, int32_t x, int32_t y) const
+{
+	const float heightScale = std::abs(heightMap.heightScale);
+	const float* corners = &heightMap.heights[y * heightMap.samplesPerLine + x];
+	const float h00 = corners[0];
+	const float h10 = corners[1];
+	const float h01 = corners[heightMap.samplesPerLine];
+	const float h11 = corners[heightMap.samplesPerLine + 1];
+	// Bilinear interpolation stays within the range of the corners, clamping to zero is the same as in HeightMap::sampleHeight
+	const float minHeight = std::min(std::min(h00, h10), std::min(h01, h11)) * heightScale;
+	const float maxHeight = std::max(std::max(h00, h10), std::max(h01, h11)) * heightScale;
+	return glm::vec2(std::max(minHeight, 0.0f), std::max(maxHeight, 0.0f));
+}
+
+bool HeightPyramid::intersect(const vks::HeightMap& heightMap, const glm::vec3& origin, const glm::vec3& direction, float tMin, float tMax, float& t) const
+{
+	if (empty()) {
+		return false;
+	}
+	const float sampleStep = (float)heightMap.sampleStep;
+	Ray ray;
+	ray.origin = glm::vec3((origin.x - 1.0f) / sampleStep, (origin.y - 1.0f) / sampleStep, origin.z);
+	ray.direction = glm::vec3(direction.x / sampleStep, direction.y / sampleStep, direction.z);
+	if (!clipRay(ray.origin, ray.direction, glm::vec2(0.0f), glm::vec2((float)cellCount), tMin, tMax)) {
+		return false;
+	}
+	return intersectNode(heightMap, ray, (int32_t)levels.size(), 0, 0, tMin, tMax, t);
+}
+
+// [t0, t1] is the part of the ray inside the node, nodes of a level cover 2^level cells per side
+bool HeightPyramid::intersectNode(const vks::HeightMap& heightMap, const Ray& ray, int32_t level, int32_t x, int32_t y, float t0, float t1, float& t) const
+{
+	const glm::vec2 range = (level == 0) ? getCellRange(heightMap, x, y) : levels[level - 1].ranges[y * levels[level - 1].size + x];
+	// The ray is above everything in the node
+	if (std::min(ray.origin.z + ray.direction.z * t0, ray.origin.z + ray.direction.z * t1) > range.y) {
+		return false;
+	}
+	if (level == 0) {
+		return intersectCell(heightMap, ray, x, y, t0, t1, t);
+	}
+
+	// Children are visited front to back, so the first hit is the closest one
+	struct Child {
+		int32_t x, y;
+		float t0, t1;
+	};
+	Child children[4];
+	uint32_t childCount = 0;
+	const int32_t childLevelSize = (level == 1) ? cellCount : levels[level - 2].size;
+	const float childSize = (float)(1 << (level - 1));
+	for (int32_t cy = y * 2; cy < std::min(y * 2 + 2, childLevelSize); cy++) {
+		for (int32_t cx = x * 2; cx < std::min(x * 2 + 2, childLevelSize); cx++) {
+			Child child = { cx, cy, t0, t1 };
+			const glm::vec2 boxMin = glm::vec2((float)cx, (float)cy) * childSize;
+			const glm::vec2 boxMax = glm::min(boxMin + childSize, glm::vec2((float)cellCount));
+			if (!clipRay(ray.origin, ray.direction, boxMin, boxMax, child.t0, child.t1)) {
+				continue;
+			}
+			uint32_t index = childCount++;
+			for (; (index > 0) && (children[index - 1].t0 > child.t0); index--) {
+				children[index] = children[index - 1];
+			}
+			children[index] = child;
+		}
+	}
+	for (uint32_t i = 0; i < childCount; i++) {
+		if (intersectNode(heightMap, ray, level - 1, children[i].x, children[i].y, children[i].t0, children[i].t1, t)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool HeightPyramid::intersectCell(const vks::HeightMap& heightMap, const Ray& ray, int32_t x, int32_t y, float t0, float t1, float& t) const
+{
+	const float heightScale = std::abs(heightMap.heightScale);
+	const float* corners = &heightMap.heights[y * heightMap.samplesPerLine + x];
+	const float h00 = corners[0] * heightScale;
+	const float h10 = corners[1] * heightScale;
+	const float h01 = corners[heightMap.samplesPerLine] * heightScale;
+	const float h11 = corners[heightMap.samplesPerLine + 1] * heightScale;
+	// Bilinear surface h(u, v) = h00 + a * u + b * v + c * u * v
+	const float a = h10 - h00;
+	const float b = h01 - h00;
+	const float c = h00 - h10 - h01 + h11;
+
+	// The segment is parameterized with s = t - t0, so the cell local coordinates stay small
+	const float u0 = ray.origin.x + ray.direction.x * t0 - (float)x;
+	const float v0 = ray.origin.y + ray.direction.y * t0 - (float)y;
+	const float rayHeight = ray.origin.z + ray.direction.z * t0;
+	const float length = t1 - t0;
+
+	// Difference between surface and ray, f(s) = qa * s^2 + qb * s + f0, the ray hits the surface where f becomes positive
+	const float f0 = h00 + a * u0 + b * v0 + c * u0 * v0 - rayHeight;
+	// Heights are clamped to zero, so the ray also hits the terrain where it reaches zero height
+	if ((f0 >= 0.0f) || (rayHeight <= 0.0f)) {
+		t = t0;
+		return true;
+	}
+	float hit = FLT_MAX;
+	if (ray.direction.z < 0.0f) {
+		hit = -rayHeight / ray.direction.z;
+	}
+	const float qa = c * ray.direction.x * ray.direction.y;
+	const float qb = a * ray.direction.x + b * ray.direction.y + c * (u0 * ray.direction.y + v0 * ray.direction.x) - ray.direction.z;
+	if (std::abs(qa) < 1e-12f) {
+		if (qb > 0.0f) {
+			hit = std::min(hit, -f0 / qb);
+		}
+	} else {
+		const float discriminant = qb * qb - 4.0f * qa * f0;
+		if (discriminant >= 0.0f) {
+			// Numerically stable form of the quadratic formula
+			const float q = -0.5f * (qb + std::copysign(std::sqrt(discriminant), qb));
+			const float roots[2] = { q / qa, (q != 0.0f) ? f0 / q : FLT_MAX };
+			for (float root : roots) {
+				if (root >= 0.0f) {
+					hit = std::min(hit, root);
+				}
+			}
+		}
+	}
+	if (hit <= length) {
+		t = t0 + hit;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,47 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "VulkanHeightmap.hpp"
+
+// Min/max mip pyramid over the cells of a height map, used to skip empty space when casting rays against the terrain
+// A cell is the area between four neighbouring height samples, the first level holds the height range of 2x2 cells and each further level merges 2x2 entries of the level below
+// The height range of a single cell is taken from its four samples, so it isn't stored
+class HeightPyramid {
+public:
+	// Heights are taken as returned by HeightMap::sampleHeight (scaled and clamped to zero)
+	void build(const vks::HeightMap& heightMap);
+	void clear();
+	bool empty() const;
+	// Height range (x = min, y = max) of the whole height map
+	glm::vec2 getRange() const;
+	// Memory used by the pyramid in bytes
+	size_t getByteSize() const;
+	// Intersects a ray with the bilinearly interpolated height map, the heights the pyramid was built from must not have changed since
+	// The ray is given in height map space, x and y are full resolution sample coordinates and z is the height
+	// Only the part of the ray between tMin and tMax is tested, returns the ray parameter of the first intersection in t
+	bool intersect(const vks::HeightMap& heightMap, const glm::vec3& origin, const glm::vec3& direction, float tMin, float tMax, float& t) const;
+private:
+	struct Level {
+		int32_t size = 0;
+		// x = min, y = max
+		std::vector<glm::vec2> ranges;
+	};
+	std::vector<Level> levels;
+	// Number of cells per side
+	int32_t cellCount = 0;
+
+	struct Ray;
+	glm::vec2 getCellRange(const vks::HeightMap& heightMap, int32_t x, int32_t y) const;
+	bool intersectNode(const vks::HeightMap& heightMap, const Ray& ray, int32_t level, int32_t x, int32_t y, float t0, float t1, float& t) const;
+	bool intersectCell(const vks::HeightMap& heightMap, const Ray& ray, int32_t x, int32_t y, float t0, float t1, float& t) const;
+};
@@ -7,6 +7,9 @@
  */
 
 #include "InfiniteTerrain.h"
+#include "FrameScheduler.h"
+#include <algorithm>
+#include <cstring>
 
 InfiniteTerrain::InfiniteTerrain() {
 	chunkSize = heightMapSettings.mapChunkSize - 1;
@@ -61,16 +64,48 @@ TerrainChunk* InfiniteTerrain::getChunkFromWorldPos(glm::vec3 coords)
 
 bool InfiniteTerrain::getHeight(const glm::vec3 worldPos, float& height)
 {
-	// @todo: skip chunks that are too far away?
-	const int chunkCoordX = round(worldPos.x / (float)(heightMapSettings.mapChunkSize - 1));
-	const int chunkCoordY = round(worldPos.z / (float)(heightMapSettings.mapChunkSize - 1));
-	for (auto& chunk : terrainChunks) {
-		if (chunk->visible && (chunk->position.x == chunkCoordX) && (chunk->position.y == chunkCoordY)) {
-			height = -chunk->getHeight(round(worldPos.x - chunk->worldPosition.x) + 1, -round(worldPos.z - chunk->worldPosition.y) + 1);
-			return true;
-		}
+	TerrainSamples samples{};
+	samples.heights = std::span<float>(&height, 1);
+	return getHeights(std::span<const glm::vec3>(&worldPos, 1), samples) > 0;
+}
+
+bool InfiniteTerrain::getHeightAndRandomValue(const glm::vec3 worldPos, float& height, float& randomValue)
+{
+	TerrainSamples samples{};
+	samples.heights = std::span<float>(&height, 1);
+	samples.randomValues = std::span<float>(&randomValue, 1);
+	return getHeights(std::span<const glm::vec3>(&worldPos, 1), samples) > 0;
+}
+
+size_t InfiniteTerrain::getHeights(std::span<const glm::vec3> positions, const TerrainSamples& samples)
+{
+	return sampleTerrain(terrainChunks, heightMapSettings.mapChunkSize - 1, positions, samples);
+}
+
+bool InfiniteTerrain::raycast(const TerrainRay& ray, TerrainRayHit& hit)
+{
+	return raycastTerrain(terrainChunks, heightMapSettings.mapChunkSize - 1, ray, hit);
+}
+
+void InfiniteTerrain::raycast(std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits)
+{
+	raycastTerrain(terrainChunks, heightMapSettings.mapChunkSize - 1, rays, hits);
+}
+
+int InfiniteTerrain::getLevelOfDetail(glm::ivec2 coords)
+{
+	// Chunks further away from the viewer are generated at a lower resolution
+	const int currentChunkCoordX = (int)round(viewerPosition.x / (float)chunkSize);
+	const int currentChunkCoordY = (int)round(viewerPosition.y / (float)chunkSize);
+	const int distance = std::max(abs(coords.x - currentChunkCoordX), abs(coords.y - currentChunkCoordY));
+	const int levelOfDetail = std::max(heightMapSettings.levelOfDetail, 1);
+	if (distance <= 1) {
+		return levelOfDetail;
 	}
-	return false;
+	if (distance == 2) {
+		return levelOfDetail * 2;
+	}
+	return levelOfDetail * 4;
 }
 
 int InfiniteTerrain::getVisibleChunkCount() {
@@ -95,23 +130,86 @@ int InfiniteTerrain::getVisibleTreeCount() {
 
 bool InfiniteTerrain::updateVisibleChunks(vks::Frustum& frustum) {
 	bool res = false;
-	int currentChunkCoordX = (int)round(viewerPosition.x / (float)chunkSize);
-	int currentChunkCoordY = (int)round(viewerPosition.y / (float)chunkSize);
+	// The chunk requests only change if the viewer moves to another chunk or the draw distance changes
+	// Chunks that were still being generated during the last walk need another one, as they may need to be refined once done
+	const glm::ivec2 currentChunkCoord = glm::ivec2((int)round(viewerPosition.x / (float)chunkSize), (int)round(viewerPosition.y / (float)chunkSize));
+	if (requestsDirty || (currentChunkCoord != requestedChunkCoord) || (chunksVisibleInViewDistance != requestedViewDistance)) {
+		res = updateChunkRequests(currentChunkCoord);
+		requestedChunkCoord = currentChunkCoord;
+		requestedViewDistance = chunksVisibleInViewDistance;
+		visibilityStats.requestUpdates++;
+		cullingDirty = true;
+	}
+
+	// Visibility only changes with the view frustum or the chunks
+	if (cullingDirty || (memcmp(frustum.planes, culledFrustumPlanes, sizeof(culledFrustumPlanes)) != 0)) {
+		for (auto& chunk : terrainChunks) {
+			chunk->visible = frustum.checkBox(chunk->center, chunk->min, chunk->max);
+		}
+		memcpy(culledFrustumPlanes, frustum.planes, sizeof(culledFrustumPlanes));
+		visibilityStats.cullingUpdates++;
+		cullingDirty = false;
+	}
+
+	return res;
+}
+
+bool InfiniteTerrain::updateChunkRequests(glm::ivec2 currentChunkCoord) {
+	bool res = false;
+	bool settled = true;
+	const int currentChunkCoordX = currentChunkCoord.x;
+	const int currentChunkCoordY = currentChunkCoord.y;
+	// Chunks added while filling an empty world are expected to pop in, so they don't count as late
+	const bool countArrivals = !terrainChunks.empty();
 	for (int yOffset = -chunksVisibleInViewDistance; yOffset <= chunksVisibleInViewDistance; yOffset++) {
 		for (int xOffset = -chunksVisibleInViewDistance; xOffset <= chunksVisibleInViewDistance; xOffset++) {
 			glm::ivec2 viewedChunkCoord = glm::ivec2(currentChunkCoordX + xOffset, currentChunkCoordY + yOffset);
 			TerrainChunk* chunk = getChunk(viewedChunkCoord);
 			if (chunk) {
 				chunk->visible = true;
+				if (chunk->state != TerrainChunk::State::generated) {
+					settled = false;
+				}
+				// Regenerate at a higher resolution once the viewer gets closer, reusing the already generated low frequency octaves
+				const int levelOfDetail = getLevelOfDetail(viewedChunkCoord);
+				// Chunks with outdated settings are about to be replaced by the regeneration, so they aren't refined
+				if ((chunk->state == TerrainChunk::State::generated) && (chunk->refinement == nullptr) && (levelOfDetail < chunk->levelOfDetail) && (chunk->settingsVersion == settingsVersion)) {
+					TerrainChunk* refinedChunk = new TerrainChunk(viewedChunkCoord, chunkSize);
+					refinedChunk->settings = chunk->settings;
+					refinedChunk->settingsVersion = chunk->settingsVersion;
+					refinedChunk->levelOfDetail = levelOfDetail;
+					refinedChunk->upsampleSource = chunk->heightMap->lowOctaves;
+					refinedChunk->alpha = 1.0f;
+					chunk->refinement = refinedChunk;
+					terrainChunkgsUpdateList.push_back(refinedChunk);
+					res = true;
+				}
+			}
+			else if (TerrainChunk* prefetchedChunk = takePrefetchedChunk(viewedChunkCoord)) {
+				prefetchedChunk->prefetch = false;
+				terrainChunks.push_back(prefetchedChunk);
+				if (prefetchedChunk->state == TerrainChunk::State::generated) {
+					prefetchStats.justInTime++;
+				} else {
+					prefetchStats.late++;
+				}
+				settled = false;
+				res = true;
 			}
 			else {
+				if (countArrivals) {
+					prefetchStats.late++;
+				}
 				int l = heightMapSettings.levelOfDetail;
 				TerrainChunk* newChunk = new TerrainChunk(viewedChunkCoord, chunkSize);
+				newChunk->levelOfDetail = getLevelOfDetail(viewedChunkCoord);
+				newChunk->settingsVersion = settingsVersion;
 				terrainChunks.push_back(newChunk);
 				terrainChunkgsUpdateList.push_back(newChunk);
 				heightMapSettings.levelOfDetail = l;
 				std::cout << "Added new terrain chunk at " << viewedChunkCoord.x << " / " << viewedChunkCoord.y << "\n";
 				std::cout << "Center is " << newChunk->center.x << " / " << newChunk->center.y << "\n";
+				settled = false;
 				res = true;
 			}
 		}
@@ -131,10 +229,7 @@ bool InfiniteTerrain::updateVisibleChunks(vks::Frustum& frustum) {
 	//	}
 	//}
 
-	// Update visibility
-	for (auto& chunk : terrainChunks) {
-		chunk->visible = frustum.checkBox(chunk->center, chunk->min, chunk->max);
-	}
+	requestsDirty = !settled;
 
 	return res;
 }
@@ -143,25 +238,285 @@ void InfiniteTerrain::updateChunks() {
 	for (auto& terrainChunk : terrainChunks) {
 		int l = heightMapSettings.levelOfDetail;
 		//heightMapSettings.levelOfDetail = 6;
-		heightMapSettings.offset.x = (float)terrainChunk->position.x * (float)(chunkSize);
-		heightMapSettings.offset.y = (float)terrainChunk->position.y * (float)(chunkSize);
-		terrainChunk->updateHeightMap();
-		terrainChunk->updateTrees();
+		terrainChunk->generate();
 		heightMapSettings.levelOfDetail = l;
 	}
 }
 
-void InfiniteTerrain::clear() {
-	vkQueueWaitIdle(VulkanContext::copyQueue);
-	vkQueueWaitIdle(VulkanContext::graphicsQueue);
+void InfiniteTerrain::updateRefinements() {
 	for (auto& chunk : terrainChunks) {
-		delete chunk;
+		if ((chunk->refinement) && (chunk->refinement->state == TerrainChunk::State::generated)) {
+			TerrainChunk* refinedChunk = chunk->refinement;
+			refinedChunk->visible = chunk->visible;
+			chunk->refinement = nullptr;
+			retireChunk(chunk);
+			chunk = refinedChunk;
+			invalidateVisibility();
+		}
+	}
+	for (auto it = retiredChunks.begin(); it != retiredChunks.end(); ) {
+		// Chunks that are still queued or being generated, or whose trees are being scattered, can't be deleted yet
+		if (((it->chunk->state != TerrainChunk::State::generated) && (it->chunk->state != TerrainChunk::State::cancelled)) || (it->chunk->pendingTreeScatters > 0)) {
+			++it;
+			continue;
+		}
+		if (--it->framesLeft == 0) {
+			// Freeing the chunk's buffers isn't urgent, so it's left to the frame scheduler
+			TerrainChunk* chunk = it->chunk;
+			frameScheduler.enqueue(FrameScheduler::priorityLow, [chunk]() { delete chunk; });
+			it = retiredChunks.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+void InfiniteTerrain::retireChunk(TerrainChunk* chunk) {
+	if (chunk->refinement) {
+		retiredChunks.push_back({ chunk->refinement, retiredChunkFrameCount });
+		chunk->refinement = nullptr;
+	}
+	retiredChunks.push_back({ chunk, retiredChunkFrameCount });
+}
+
+void InfiniteTerrain::regenerate() {
+	settingsVersion++;
+	// Shadow chunks of a regeneration that hasn't finished yet have outdated settings now
+	for (auto& chunk : shadowChunks) {
+		retireChunk(chunk);
+	}
+	shadowChunks.clear();
+	// Tree scatters that are still running finish in the background, but their results are discarded
+	treeScatters.clear();
+	for (auto& chunk : prefetchChunks) {
+		cancelPrefetch(chunk);
+	}
+	prefetchChunks.clear();
+	regenerationSwapStarted = false;
+	// Only the generation stages affected by the settings change are re-run for resident chunks
+	for (auto& chunk : terrainChunks) {
+		uint32_t stages = heightMapSettings.getInvalidatedStages(chunk->settings);
+		const bool generated = (chunk->state == TerrainChunk::State::generated);
+		if (stages == HeightMapSettings::stageNone) {
+			// Chunks that are still being generated read their settings, so those are left alone
+			if (generated) {
+				chunk->settings = heightMapSettings;
+			}
+			chunk->settingsVersion = settingsVersion;
+			continue;
+		}
+		// Pending refinements were started with the previous settings
+		if (chunk->refinement) {
+			retiredChunks.push_back({ chunk->refinement, retiredChunkFrameCount });
+			chunk->refinement = nullptr;
+		}
+		if (!generated) {
+			stages = HeightMapSettings::stageAll;
+		}
+		if (stages == HeightMapSettings::stageTrees) {
+			// The chunk keeps its heights, mesh and buffers, only the trees are replaced once they have been scattered (see updateRegeneration)
+			auto scatter = std::make_shared<TreeScatter>();
+			scatter->chunk = chunk;
+			scatter->settings = heightMapSettings;
+			scatter->settingsVersion = settingsVersion;
+			chunk->pendingTreeScatters++;
+			treeScatters.push_back(scatter);
+			treeScatterThread.addJob([scatter]() {
+				TerrainChunk* chunk = scatter->chunk;
+				scatter->trees = chunk->scatterTrees(scatter->settings);
+				if (!chunk->upsampled) {
+					ChunkData data = ChunkData::fromChunk(*chunk);
+					data.trees = scatter->trees;
+					data.treeInstanceCount = (int)scatter->trees.size();
+					chunkCache.put({ chunk->position, chunk->levelOfDetail, scatter->settings.getGenerationHash() }, data);
+				}
+				scatter->done = true;
+				chunk->pendingTreeScatters--;
+			});
+			continue;
+		}
+		TerrainChunk* shadowChunk = new TerrainChunk(chunk->position, chunkSize);
+		shadowChunk->settingsVersion = settingsVersion;
+		shadowChunk->stages = stages;
+		if (stages & HeightMapSettings::stageNoise) {
+			shadowChunk->levelOfDetail = getLevelOfDetail(chunk->position);
+		} else {
+			// Mesh changes reuse the heights of the current chunk
+			shadowChunk->levelOfDetail = chunk->levelOfDetail;
+			shadowChunk->heightMap->copyHeights(*chunk->heightMap);
+			shadowChunk->upsampled = chunk->upsampled;
+		}
+		// Replaces a chunk that's already visible, so no fade in
+		shadowChunk->alpha = 1.0f;
+		shadowChunks.push_back(shadowChunk);
+		terrainChunkgsUpdateList.push_back(shadowChunk);
+	}
+	regenerationChunkCount = shadowChunks.size() + treeScatters.size();
+	invalidateVisibility();
+}
+
+void InfiniteTerrain::updateRegeneration() {
+	if (shadowChunks.empty() && treeScatters.empty()) {
+		return;
+	}
+	if (!regenerationSwapStarted) {
+		if (getRegenerationProgress() < regenerationSwapCoverage) {
+			return;
+		}
+		regenerationSwapStarted = true;
+	}
+	for (auto it = shadowChunks.begin(); it != shadowChunks.end(); ) {
+		TerrainChunk* shadowChunk = *it;
+		if (shadowChunk->state != TerrainChunk::State::generated) {
+			++it;
+			continue;
+		}
+		bool replaced = false;
+		for (auto& chunk : terrainChunks) {
+			if (chunk->position == shadowChunk->position) {
+				shadowChunk->visible = chunk->visible;
+				retireChunk(chunk);
+				chunk = shadowChunk;
+				replaced = true;
+				break;
+			}
+		}
+		if (!replaced) {
+			terrainChunks.push_back(shadowChunk);
+		}
+		invalidateVisibility();
+		it = shadowChunks.erase(it);
+	}
+	// Runs on the main thread while no draw batch build is reading the chunks' trees
+	for (auto it = treeScatters.begin(); it != treeScatters.end(); ) {
+		TreeScatter& scatter = **it;
+		if (!scatter.done) {
+			++it;
+			continue;
+		}
+		TerrainChunk* chunk = scatter.chunk;
+		if (std::find(terrainChunks.begin(), terrainChunks.end(), chunk) != terrainChunks.end()) {
+			chunk->trees = std::move(scatter.trees);
+			chunk->treeInstanceCount = (int)chunk->trees.size();
+			// The tree buffer is uploaded again by the GPU tree culling once it notices the new version
+			chunk->treeVersion++;
+			chunk->settings = scatter.settings;
+			chunk->settingsVersion = scatter.settingsVersion;
+			invalidateVisibility();
+		}
+		it = treeScatters.erase(it);
+	}
+}
+
+float InfiniteTerrain::getRegenerationProgress() {
+	if (shadowChunks.empty() && treeScatters.empty()) {
+		return 1.0f;
+	}
+	size_t pendingCount = 0;
+	for (auto& chunk : shadowChunks) {
+		if (chunk->state != TerrainChunk::State::generated) {
+			pendingCount++;
+		}
+	}
+	for (auto& scatter : treeScatters) {
+		if (!scatter->done) {
+			pendingCount++;
+		}
+	}
+	return 1.0f - (float)pendingCount / (float)regenerationChunkCount;
+}
+
+void InfiniteTerrain::invalidateVisibility() {
+	requestsDirty = true;
+	cullingDirty = true;
+}
+
+TerrainChunk* InfiniteTerrain::takePrefetchedChunk(glm::ivec2 coords) {
+	for (auto it = prefetchChunks.begin(); it != prefetchChunks.end(); ++it) {
+		if ((*it)->position == coords) {
+			TerrainChunk* chunk = *it;
+			prefetchChunks.erase(it);
+			return chunk;
+		}
+	}
+	return nullptr;
+}
+
+void InfiniteTerrain::updatePrefetch(float deltaTime) {
+	// The velocity is smoothed over several frames, so single frame hitches don't throw off the prediction
+	if (hasLastViewerPosition && (deltaTime > 0.0f)) {
+		const glm::vec2 frameVelocity = (viewerPosition - lastViewerPosition) / deltaTime;
+		viewerVelocity = glm::mix(viewerVelocity, frameVelocity, std::min(deltaTime * 4.0f, 1.0f));
+	}
+	lastViewerPosition = viewerPosition;
+	hasLastViewerPosition = true;
+
+	// Predictions further ahead than the view distance aren't reliable enough to be worth generating
+	glm::vec2 lookAhead = viewerVelocity * prefetchLookAhead;
+	const float maxLookAhead = (float)(chunksVisibleInViewDistance * chunkSize);
+	if (glm::length(lookAhead) > maxLookAhead) {
+		lookAhead = glm::normalize(lookAhead) * maxLookAhead;
+	}
+	const glm::vec2 predictedPosition = viewerPosition + lookAhead;
+	const glm::ivec2 currentChunkCoord = glm::ivec2((int)round(viewerPosition.x / (float)chunkSize), (int)round(viewerPosition.y / (float)chunkSize));
+	const glm::ivec2 predictedChunkCoord = glm::ivec2((int)round(predictedPosition.x / (float)chunkSize), (int)round(predictedPosition.y / (float)chunkSize));
+	auto insideRange = [](glm::ivec2 coords, glm::ivec2 centerCoords, int range) {
+		return (abs(coords.x - centerCoords.x) <= range) && (abs(coords.y - centerCoords.y) <= range);
+	};
+
+	// Chunks that are no longer predicted are cancelled, with one chunk of tolerance so small changes in heading don't cancel them right away
+	for (auto it = prefetchChunks.begin(); it != prefetchChunks.end(); ) {
+		if ((prefetchLookAhead <= 0.0f) || !insideRange((*it)->position, predictedChunkCoord, chunksVisibleInViewDistance + 1)) {
+			cancelPrefetch(*it);
+			it = prefetchChunks.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	if ((prefetchLookAhead <= 0.0f) || (predictedChunkCoord == currentChunkCoord)) {
+		return;
+	}
+
+	for (int yOffset = -chunksVisibleInViewDistance; yOffset <= chunksVisibleInViewDistance; yOffset++) {
+		for (int xOffset = -chunksVisibleInViewDistance; xOffset <= chunksVisibleInViewDistance; xOffset++) {
+			const glm::ivec2 coords = predictedChunkCoord + glm::ivec2(xOffset, yOffset);
+			// Chunks in the current view are requested by updateVisibleChunks
+			if (insideRange(coords, currentChunkCoord, chunksVisibleInViewDistance) || getChunk(coords)) {
+				continue;
+			}
+			if (std::find_if(prefetchChunks.begin(), prefetchChunks.end(), [coords](TerrainChunk* chunk) { return chunk->position == coords; }) != prefetchChunks.end()) {
+				continue;
+			}
+			TerrainChunk* chunk = new TerrainChunk(coords, chunkSize);
+			chunk->levelOfDetail = getLevelOfDetail(coords);
+			chunk->settingsVersion = settingsVersion;
+			chunk->prefetch = true;
+			prefetchChunks.push_back(chunk);
+			terrainChunkgsUpdateList.push_back(chunk);
+			prefetchStats.requested++;
+		}
+	}
+}
+
+void InfiniteTerrain::cancelPrefetch(TerrainChunk* chunk) {
+	// Queued chunks are skipped by the generation threads, chunks that are already being generated are deleted once done
+	chunk->cancelled = true;
+	if (chunk->state == TerrainChunk::State::_new) {
+		terrainChunkgsUpdateList.erase(std::remove(terrainChunkgsUpdateList.begin(), terrainChunkgsUpdateList.end(), chunk), terrainChunkgsUpdateList.end());
+		chunk->state = TerrainChunk::State::cancelled;
 	}
-	terrainChunks.resize(0);
+	retiredChunks.push_back({ chunk, retiredChunkFrameCount });
+	prefetchStats.cancelled++;
 }
 
 // @todo
 void InfiniteTerrain::update(float deltaTime) {
+	updatePrefetch(deltaTime);
+	updateRegeneration();
+	updateRefinements();
 	for (auto& chunk : terrainChunks) {
 		if ((chunk->state == TerrainChunk::State::generated) && (chunk->alpha < 1.0f)) {
 			chunk->alpha += 2.0f * deltaTime;
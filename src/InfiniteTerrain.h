@@ -11,7 +11,11 @@
 #include <vulkan/vulkan.h>
 #include "HeightMapSettings.h"
 #include "TerrainChunk.h"
+#include "TerrainQuery.h"
+#include "ChunkCache.h"
 #include "frustum.hpp"
+#include "threadpool.hpp"
+#include <memory>
 
 class InfiniteTerrain {
 public:
@@ -22,16 +26,90 @@ public:
 	std::vector<TerrainChunk*> terrainChunks{};
 	std::vector<TerrainChunk*> terrainChunkgsUpdateList{};
 
+	// Chunks that have been replaced are kept alive until the GPU no longer uses their buffers
+	static constexpr uint32_t retiredChunkFrameCount = 3;
+	struct RetiredChunk {
+		TerrainChunk* chunk;
+		uint32_t framesLeft;
+	};
+	std::vector<RetiredChunk> retiredChunks{};
+
+	// Settings changes regenerate the world into a set of shadow chunks while the current chunks keep being rendered
+	std::vector<TerrainChunk*> shadowChunks{};
+	// Fraction of the shadow chunks that needs to be generated before they start replacing the current chunks
+	// Zero replaces each chunk as soon as its shadow chunk is ready, one swaps the whole world at once
+	float regenerationSwapCoverage = 0.0f;
+	// Changes that only affect the trees keep the resident chunks and their meshes, the trees are scattered again over the resident heights on the tree thread
+	struct TreeScatter {
+		TerrainChunk* chunk;
+		HeightMapSettings settings;
+		uint32_t settingsVersion;
+		TreeInstances trees;
+		std::atomic<bool> done{ false };
+	};
+	std::vector<std::shared_ptr<TreeScatter>> treeScatters{};
+	vks::Thread treeScatterThread;
+	bool regenerationSwapStarted = false;
+	size_t regenerationChunkCount = 0;
+	uint32_t settingsVersion = 0;
+
+	// Chunks are prefetched around the viewer position extrapolated by this many seconds, zero disables prefetching
+	float prefetchLookAhead = 1.0f;
+	// Chunks generated ahead of time that aren't in view yet
+	std::vector<TerrainChunk*> prefetchChunks{};
+	glm::vec2 viewerVelocity = glm::vec2(0.0f);
+	struct PrefetchStats {
+		uint32_t requested = 0;
+		uint32_t cancelled = 0;
+		// Chunks entering the view that had already been generated
+		uint32_t justInTime = 0;
+		// Chunks entering the view that still had to be generated
+		uint32_t late = 0;
+	} prefetchStats;
+
+	// Number of times the chunk requests and the chunk visibility have been updated, both are only updated if something changed
+	struct VisibilityStats {
+		uint32_t requestUpdates = 0;
+		uint32_t cullingUpdates = 0;
+	} visibilityStats;
+
 	InfiniteTerrain();
 	void updateViewDistance(float viewDistance);
 	bool chunkPresent(glm::ivec2 coords);
 	TerrainChunk* getChunk(glm::ivec2 coords);
 	TerrainChunk* getChunkFromWorldPos(glm::vec3 coords);
 	bool getHeight(const glm::vec3 worldPos, float &height);
+	bool getHeightAndRandomValue(const glm::vec3 worldPos, float &height, float &randomValue);
+	// Batched terrain queries against the generated chunks, see sampleTerrain
+	size_t getHeights(std::span<const glm::vec3> positions, const TerrainSamples& samples);
+	// Casts rays against the generated chunks, e.g. for picking and collisions, see raycastTerrain
+	bool raycast(const TerrainRay& ray, TerrainRayHit& hit);
+	void raycast(std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits);
+	int getLevelOfDetail(glm::ivec2 coords);
 	int getVisibleChunkCount();
 	int getVisibleTreeCount();
 	bool updateVisibleChunks(vks::Frustum& frustum);
+	// Walks the chunks in view distance, requests missing chunks and refinements
+	bool updateChunkRequests(glm::ivec2 currentChunkCoord);
+	// Forces the next visibility update to walk the chunks in view distance and re-cull all chunks
+	void invalidateVisibility();
 	void updateChunks();
-	void clear();
+	void updateRefinements();
+	void retireChunk(TerrainChunk* chunk);
+	void regenerate();
+	void updateRegeneration();
+	float getRegenerationProgress();
+	// Removes and returns the prefetched chunk at the given coordinates
+	TerrainChunk* takePrefetchedChunk(glm::ivec2 coords);
+	void updatePrefetch(float deltaTime);
+	void cancelPrefetch(TerrainChunk* chunk);
 	void update(float deltaTime);
+private:
+	bool requestsDirty = true;
+	bool cullingDirty = true;
+	glm::ivec2 requestedChunkCoord = glm::ivec2(0);
+	int requestedViewDistance = -1;
+	glm::vec4 culledFrustumPlanes[6] = {};
+	glm::vec2 lastViewerPosition = glm::vec2(0.0f);
+	bool hasLastViewerPosition = false;
 };
\ No newline at end of file
@@ -0,0 +1,58 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "InstanceData.h"
+#include <cmath>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+uint32_t packInstanceScale(float horizontal, float vertical)
+{
+	return glm::packHalf2x16(glm::vec2(horizontal, vertical));
+}
+
+uint32_t packInstanceRotation(const glm::vec3& rotation, uint32_t uvIndex)
+{
+	// Same matrices as the shaders built per vertex, which multiplied the position from the left (pos * rotMat)
+	float s = sin(rotation.x);
+	float c = cos(rotation.x);
+	const glm::mat3 mx(glm::vec3(c, s, 0.0f), glm::vec3(-s, c, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+	s = sin(rotation.y);
+	c = cos(rotation.y);
+	const glm::mat3 my(glm::vec3(c, 0.0f, s), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(-s, 0.0f, c));
+	s = sin(rotation.z);
+	c = cos(rotation.z);
+	const glm::mat3 mz(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, c, s), glm::vec3(0.0f, -s, c));
+	const glm::quat q = glm::quat_cast(glm::transpose(mz * my * mx));
+	// Smallest three: the largest component is dropped and reconstructed from the others, which are at most 1/sqrt(2) in magnitude
+	// q and -q describe the same rotation, so the sign is chosen to make the dropped component positive
+	const float components[4] = { q.x, q.y, q.z, q.w };
+	uint32_t largest = 0;
+	for (uint32_t i = 1; i < 4; i++) {
+		if (std::abs(components[i]) > std::abs(components[largest])) {
+			largest = i;
+		}
+	}
+	const float sign = (components[largest] < 0.0f) ? -1.0f : 1.0f;
+	uint32_t packed = 0;
+	uint32_t shift = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+		const float value = glm::clamp(components[i] * sign * (float)M_SQRT2, -1.0f, 1.0f);
+		packed |= ((uint32_t)(int32_t)std::round(value * 255.0f) & 0x1ffu) << shift;
+		shift += 9;
+	}
+	return packed | (largest << 27) | ((uvIndex & 0x3u) << 30);
+}
+
+uint32_t packInstanceColor(const glm::vec4& color)
+{
+	return glm::packUnorm4x8(color);
+}
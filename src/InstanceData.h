@@ -0,0 +1,40 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Per instance data of trees and grass as read by the vertex shaders (see includes/instance.glsl)
+// The rotation is precomputed on the CPU, so the shaders don't have to build rotation matrices from angles
+struct InstanceData {
+	glm::vec3 pos;
+	// Horizontal and vertical scale as half floats, read as VK_FORMAT_R16G16_SFLOAT
+	uint32_t scale;
+	// Rotation and uv index, see packInstanceRotation
+	uint32_t rotation;
+	// RGBA8, read as VK_FORMAT_R8G8B8A8_UNORM, alpha is used to fade instances in and out
+	uint32_t color;
+};
+static_assert(sizeof(InstanceData) == 24, "InstanceData must match the vertex input layout");
+
+// Horizontal scale is applied to x and z, vertical scale to y
+uint32_t packInstanceScale(float horizontal, float vertical);
+// Rotation around x, y and z in radians, applied in the same order as the shaders used to (z * y * x)
+// Stored as a unit quaternion with the three smallest components as 9 bit signed normalized values in the lower 27 bits,
+// the index of the largest component in bits 27 and 28 and the uv index (0..3) in the upper two bits
+uint32_t packInstanceRotation(const glm::vec3& rotation, uint32_t uvIndex);
+uint32_t packInstanceColor(const glm::vec4& color);
+
+// Called per instance for every frame, so the alpha is written without unpacking the color
+inline void setInstanceAlpha(InstanceData& instance, float alpha)
+{
+	const uint32_t a = (uint32_t)(glm::clamp(alpha, 0.0f, 1.0f) * 255.0f + 0.5f);
+	instance.color = (instance.color & 0x00ffffffu) | (a << 24);
+}
@@ -7,8 +7,15 @@
  */
 
 #include "TerrainChunk.h"
+#include "ChunkCache.h"
+#include "ChunkArchive.h"
+#include "TerrainQuery.h"
 
-TerrainChunk::TerrainChunk(glm::ivec2 coords, int size) : size(size) {
+namespace {
+	std::atomic<uint32_t> nextChunkId{ 0 };
+}
+
+TerrainChunk::TerrainChunk(glm::ivec2 coords, int size) : id(nextChunkId++), size(size) {
 		position = coords;
 		worldPosition = glm::vec2(position.x * (float)(vks::HeightMap::chunkSize - 1) - (float)(vks::HeightMap::chunkSize - 1) / 2.0f, position.y* (float)(vks::HeightMap::chunkSize - 1) - (float)(vks::HeightMap::chunkSize - 1) / -2.0f);
 		center = glm::vec3(0.0f);
@@ -17,39 +24,98 @@ TerrainChunk::TerrainChunk(glm::ivec2 coords, int size) : size(size) {
 		min = glm::vec3(center) - glm::vec3((float)size / 2.0f);
 		max = glm::vec3(center) + glm::vec3((float)size / 2.0f);
 		heightMap = new vks::HeightMap(VulkanContext::device, VulkanContext::copyQueue);
+		settings = heightMapSettings;
 }
 TerrainChunk::~TerrainChunk()
 {
-	if (state == TerrainChunk::State::generated) {
-		heightMap->vertexBuffer.destroy();
-		heightMap->indexBuffer.destroy();
-	}
+	// Also destroys the chunk's vertex and index buffers
+	delete heightMap;
 }
 
 void TerrainChunk::update() {
 
 }
 
-void TerrainChunk::updateHeightMap() {
-	std::cout << "Updating chunk at " << this->position.x << " / " << this->position.y << "\n";
+void TerrainChunk::generate() {
 	assert(heightMap);
 	if (heightMap->vertexBuffer.buffer != VK_NULL_HANDLE) {
 		heightMap->vertexBuffer.destroy();
 		heightMap->indexBuffer.destroy();
 	}
+	const ChunkCache::Key cacheKey = ChunkCache::getKey(*this);
+	ChunkData data;
+	if (chunkCache.get(cacheKey, data) || chunkArchive.get(cacheKey, data)) {
+		// Cache hits skip generation and go straight to the upload
+		heightMap->sampleStep = data.sampleStep;
+		heightMap->samplesPerLine = data.samplesPerLine;
+		heightMap->heights = std::move(data.heights);
+		heightMap->gradients = std::move(data.gradients);
+		heightMap->lowOctaves = std::move(data.lowOctaves);
+		trees = std::move(data.trees);
+		treeInstanceCount = data.treeInstanceCount;
+		treeVersion++;
+		upsampleSource = {};
+		upsampled = false;
+		if (data.vertices.empty()) {
+			// Entries from the compressed tier and the archive only contain the heights
+			// A compressed hit removes the entry from that tier, so both go back into the uncompressed tier with the rebuilt mesh
+			heightMap->buildMesh(glm::vec3(1.0f, -settings.heightScale, 1.0f), vks::HeightMap::topologyTriangles);
+			chunkCache.put(cacheKey, ChunkData::fromChunk(*this));
+		} else {
+			heightMap->heightScale = settings.heightScale;
+			heightMap->minHeight = data.minHeight;
+			heightMap->maxHeight = data.maxHeight;
+			heightMap->vertices = std::move(data.vertices);
+			heightMap->indices = std::move(data.indices);
+		}
+	} else {
+		updateHeightMap();
+		updateTrees();
+		// The cache key doesn't tell how a chunk was produced, so only directly generated chunks are stored
+		if (!upsampled) {
+			data = ChunkData::fromChunk(*this);
+			chunkCache.put(cacheKey, data);
+			chunkArchive.put(cacheKey, data);
+		}
+	}
+	heightPyramid.build(*heightMap);
+	heightMap->uploadMesh();
+	min.y = heightMap->minHeight;
+	max.y = heightMap->maxHeight;
+}
+
+// Generates the heights and builds the mesh on the CPU
+void TerrainChunk::updateHeightMap() {
+	std::cout << "Updating chunk at " << this->position.x << " / " << this->position.y << "\n";
+	// If only mesh settings changed, the heights have already been copied from the chunk this one replaces
+	if (stages & HeightMapSettings::stageNoise) {
+		updateHeights();
+	}
+	updateMesh();
+}
+
+void TerrainChunk::updateHeights() {
+	assert(heightMap);
 	heightMap->generate(
-		heightMapSettings.seed,
-		heightMapSettings.noiseScale,
-		heightMapSettings.octaves,
-		heightMapSettings.persistence,
-		heightMapSettings.lacunarity,
-		// @todo: base on offset instead of changing it
-		heightMapSettings.offset);
-	glm::vec3 scale = glm::vec3(1.0f, -heightMapSettings.heightScale, 1.0f); // @todo
-	heightMap->generateMesh(
+		settings.seed,
+		settings.noiseScale,
+		settings.octaves,
+		settings.persistence,
+		settings.lacunarity,
+		glm::vec2(position) * (float)size,
+		levelOfDetail,
+		settings.noiseType,
+		upsampleSource.heights.empty() ? nullptr : &upsampleSource);
+	upsampled = !upsampleSource.heights.empty();
+	upsampleSource = {};
+}
+
+void TerrainChunk::updateMesh() {
+	assert(heightMap);
+	glm::vec3 scale = glm::vec3(1.0f, -settings.heightScale, 1.0f); // @todo
+	heightMap->buildMesh(
 		scale,
-		vks::HeightMap::topologyTriangles,
-		heightMapSettings.levelOfDetail
+		vks::HeightMap::topologyTriangles
 	);
 }
 
@@ -60,51 +126,87 @@ float TerrainChunk::getHeight(int x, int y) {
 
 float TerrainChunk::getRandomValue(int x, int y)
 {
-	assert(heightMap);
-	return heightMap->getRandomValue(x, y);
+	// Random values are keyed by world coordinates, so they are seamless across chunk borders
+	const int32_t worldX = (int32_t)round(worldPosition.x) + x - 1;
+	const int32_t worldZ = (int32_t)round(worldPosition.y) - y + 1;
+	return hashNoiseFloat(worldX, worldZ, (uint32_t)settings.seed);
 }
 
 void TerrainChunk::updateTrees() {
+	trees = scatterTrees(settings);
+	treeInstanceCount = (int)trees.size();
+	treeVersion++;
+}
+
+TreeInstances TerrainChunk::scatterTrees(const HeightMapSettings& treeSettings) const {
 	assert(heightMap);
+	TreeInstances result;
+
+	// Presets may disable trees with a density of zero
+	if (treeSettings.treeDensity <= 0) {
+		result.updateBounds();
+		return result;
+	}
 
-	float topLeftX = (float)(vks::HeightMap::chunkSize - 1) / -2.0f;
-	float topLeftZ = (float)(vks::HeightMap::chunkSize - 1) / 2.0f;
+	const float extent = (float)(vks::HeightMap::chunkSize - 1);
+	const float topLeftX = extent / -2.0f;
+	const float topLeftZ = extent / 2.0f;
 
-	// Random distribution
+	// Random values are calculated on demand from a hash of the chunk coordinate, the instance index and the seed
+	const uint32_t chunkSeed = hashNoise(position.x, position.y, (uint32_t)treeSettings.seed);
+	auto random = [chunkSeed](int index, int channel) {
+		return hashNoiseFloat(index, channel, chunkSeed);
+	};
 
-	const int dim = 30; // 24 241
-	treeInstanceCount = heightMapSettings.treeDensity * heightMapSettings.treeDensity;
-	std::vector<InstanceData> instanceData(treeInstanceCount);
-	trees.resize(treeInstanceCount);
-	std::default_random_engine prng(heightMapSettings.seed);
-	std::uniform_real_distribution<float> distribution(0.0f, (float)(vks::HeightMap::chunkSize - 1));
-	std::uniform_real_distribution<float> scaleDist(heightMapSettings.minTreeSize, heightMapSettings.maxTreeSize);
-	std::uniform_real_distribution<float> rotDist(0.0f, 1.0f);
-
-	for (int i = 0; i < treeInstanceCount; i++) {
-		float xPos = distribution(prng);
-		float yPos = distribution(prng);
-		int terrainX = round(xPos + 0.5f);
-		int terrainY = round(yPos + 0.5f);
-		float h1 = getHeight(terrainX - 1, terrainY);
-		float h2 = getHeight(terrainX + 1, terrainY);
-		float h3 = getHeight(terrainX, terrainY - 1);
-		float h4 = getHeight(terrainX, terrainY + 1);
-		float h = (h1 + h2 + h3 + h4) / 4.0f;
-		if ((h <= heightMapSettings.waterPosition) || (h > 15.0f)) {
-			continue;
+	// Poisson disk distribution, which doesn't clump like uniform random points
+	// A maximal Poisson disk set has about 0.7 points per squared minimum distance, so this yields roughly treeDensity^2 candidates
+	// All chunks share the pattern of the terrain seed, each chunk starts at a random position within it
+	std::vector<glm::vec2> candidates;
+	poissonDiskSample(extent, extent, extent / (float)treeSettings.treeDensity * 0.8f, (uint32_t)treeSettings.seed, glm::vec2(random(0, 0), random(0, 1)), candidates);
+
+	const uint32_t candidateCount = (uint32_t)candidates.size();
+	result.resize(candidateCount);
+	std::vector<uint8_t> accepted(candidateCount, 0);
+	const float maxSlope = tan(glm::radians(treeSettings.maxTreeSlope));
+
+	// Candidates are independent of each other, so they are tested in parallel tiles
+	constexpr uint32_t tileSize = 64;
+	vks::parallelFor(candidateCount, tileSize, [&](uint32_t first, uint32_t last) {
+		float sampleX[tileSize]{};
+		float sampleY[tileSize]{};
+		float heights[tileSize];
+		glm::vec2 gradients[tileSize];
+		for (uint32_t i = first; i < last; i++) {
+			// Chunk coordinates start at sample 1 of the height map
+			sampleX[i - first] = candidates[i].x + 1.0f;
+			sampleY[i - first] = candidates[i].y + 1.0f;
 		}
-		InstanceData inst{};
-		inst.pos = glm::vec3((float)topLeftX + xPos, -h, (float)topLeftZ - yPos);
-		inst.scale = glm::vec3(scaleDist(prng));
-		inst.rotation = glm::vec3(M_PI * rotDist(prng) * 0.035f, M_PI * rotDist(prng), M_PI * rotDist(prng) * 0.035f);
-		instanceData[i] = inst;
-		trees[i].worldpos = glm::vec3((float)position.x, 0.0f, (float)position.y) * glm::vec3(vks::HeightMap::chunkSize - 1.0f, 0.0f, vks::HeightMap::chunkSize - 1.0f) + inst.pos;
-		trees[i].rotation = inst.rotation;
-		trees[i].scale = inst.scale;
-		trees[i].color = glm::vec4(0.6f + rotDist(prng) * 0.4f);
-		trees[i].color.a = 1.0f;
-	}
+		sampleHeightMap(*heightMap, sampleX, sampleY, last - first, heights, gradients);
+		for (uint32_t i = first; i < last; i++) {
+			const float h = heights[i - first];
+			if ((h <= treeSettings.waterPosition) || (h > 15.0f)) {
+				continue;
+			}
+			if (glm::length(gradients[i - first]) > maxSlope) {
+				continue;
+			}
+			const glm::vec3 pos = glm::vec3(topLeftX + candidates[i].x, -h, topLeftZ - candidates[i].y);
+			const float scale = glm::mix(treeSettings.minTreeSize, treeSettings.maxTreeSize, random(i, 2));
+			const glm::vec3 rotation = glm::vec3(M_PI * random(i, 3) * 0.035f, M_PI * random(i, 4), M_PI * random(i, 5) * 0.035f);
+			const glm::vec3 worldPos = glm::vec3((float)position.x, 0.0f, (float)position.y) * glm::vec3(extent, 0.0f, extent) + pos;
+			result.positionX[i] = worldPos.x;
+			result.positionY[i] = worldPos.y;
+			result.positionZ[i] = worldPos.z;
+			result.rotation[i] = packInstanceRotation(rotation, 0);
+			result.scale[i] = packInstanceScale(scale, scale);
+			result.color[i] = packInstanceColor(glm::vec4(glm::vec3(0.6f + random(i, 6) * 0.4f), 1.0f));
+			accepted[i] = 1;
+		}
+	});
+	// Only placed trees are kept, so culling and the instance buffers never see rejected candidates
+	result.compact(accepted);
+	result.updateBounds();
+	return result;
 	// Even distribution
 	/*
 
@@ -185,8 +287,19 @@ void TerrainChunk::updateGrass() {
 	//}
 }
 
-void TerrainChunk::uploadBuffers()
+std::vector<InstanceData> TerrainChunk::getTreeInstances() const
 {
+	std::vector<InstanceData> instances;
+	instances.reserve(trees.size());
+	for (size_t i = 0; i < trees.size(); i++) {
+		InstanceData instance{};
+		instance.pos = glm::vec3(trees.positionX[i], trees.positionY[i], trees.positionZ[i]);
+		instance.scale = trees.scale[i];
+		instance.rotation = trees.rotation[i];
+		instance.color = trees.color[i];
+		instances.push_back(instance);
+	}
+	return instances;
 }
 
 void TerrainChunk::draw(CommandBuffer* cb) {
@@ -13,54 +13,76 @@
 #include "VulkanBuffer.hpp"
 #include "CommandBuffer.hpp"
 #include "VulkanContext.h"
+#include "TreeInstances.h"
+#include "InstanceData.h"
+#include "HeightPyramid.h"
 #include <glm/glm.hpp>
-
-struct InstanceData {
-	glm::vec3 pos;
-	glm::vec3 scale;
-	glm::vec3 rotation;
-	glm::vec2 uv;
-	glm::vec4 color;
-};
-
-struct ObjectData {
-	glm::vec3 worldpos;
-	glm::vec3 scale;
-	glm::vec3 rotation;
-	glm::vec4 color;
-	glm::vec2 uv;
-	float distance;
-	int visibilityInfo = 0;
-	bool visible = true;
-};
+#include <atomic>
 
 class TerrainChunk {
 public:
-	enum class State { _new, generating, generated, deleting, deleted };
+	// Cancelled chunks were dropped from the generation queue before being generated
+	enum class State { _new, generating, generated, cancelled, deleting, deleted };
 
 	State state = State::_new;
 	vks::HeightMap* heightMap = nullptr;
+	// Built from the heights at generation time, used for casting rays against the chunk (see raycastTerrain)
+	HeightPyramid heightPyramid;
 	glm::ivec2 position;
 	glm::vec2 worldPosition;
 	glm::vec3 center;
 	glm::vec3 min;
 	glm::vec3 max;
-	std::vector<ObjectData> trees;
+	TreeInstances trees;
+	// Unique for the lifetime of the application, unlike the chunk's address, so the GPU tree culling can tell chunks apart (see GpuTreeCulling)
+	const uint32_t id;
+	// Incremented each time the trees are scattered, the GPU tree culling uploads the trees again if its copy has a different version
+	uint32_t treeVersion = 0;
+	// Frustum plane that culled the chunk's trees last, only used by the draw batch build (see cullTreeChunk)
+	uint32_t treeCullPlane = 0;
 	int size;
 	//bool hasValidMesh = false;
 	bool visible = false;
 	int treeInstanceCount = 0;
 	int grassInstanceCount = 0;
 	float alpha = 0.0f;
+	// Lower levels of detail are generated and rendered at a coarser resolution
+	int levelOfDetail = 1;
+	// Chunk that's being generated at a higher level of detail to replace this one
+	TerrainChunk* refinement = nullptr;
+	// Low frequency octaves of the chunk this one refines, upsampled instead of evaluated again
+	vks::HeightMap::LowOctaves upsampleSource;
+	// Set if the heights contain octaves upsampled from a lower resolution chunk, these differ slightly from directly generated heights so they aren't cached
+	bool upsampled = false;
+	// Settings the chunk is generated with, captured on creation so settings changes don't affect chunks that are already queued
+	HeightMapSettings settings;
+	// Version of the terrain settings the chunk belongs to (see InfiniteTerrain::regenerate)
+	uint32_t settingsVersion = 0;
+	// Generation stages to run, chunks regenerated for a settings change may reuse the results of earlier stages
+	uint32_t stages = HeightMapSettings::stageAll;
+	// Prefetched chunks are generated ahead of the viewer at a lower priority than chunks that are already in view
+	// Both flags are read by the generation threads
+	std::atomic<bool> prefetch{ false };
+	std::atomic<bool> cancelled{ false };
+	// Number of tree scatters for this chunk still running on the tree thread (see InfiniteTerrain::regenerate), the chunk can't be deleted before they finish
+	std::atomic<uint32_t> pendingTreeScatters{ 0 };
 
 	TerrainChunk(glm::ivec2 coords, int size);
 	~TerrainChunk();
 	void update();
+	// Generates the chunk (or takes it from the chunk cache) and uploads the mesh
+	void generate();
+	// Runs the noise (if part of the chunk's stages) and mesh stages
 	void updateHeightMap();
+	void updateHeights();
+	void updateMesh();
 	float getHeight(int x, int y);
 	float getRandomValue(int x, int y);
 	void updateTrees();
+	// Scatters trees over the chunk's heights without modifying the chunk, so trees can be scattered again while the chunk is in use
+	TreeInstances scatterTrees(const HeightMapSettings& treeSettings) const;
 	void updateGrass();
-	void uploadBuffers();
+	// The chunk's trees in the layout used by the instance buffers
+	std::vector<InstanceData> getTreeInstances() const;
 	void draw(CommandBuffer* cb);
 };
\ No newline at end of file
@@ -0,0 +1,481 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "TerrainQuery.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include "threadpool.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TERRAIN_QUERY_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	// Positions are grouped by chunk in blocks of this size, so all temporary data fits on the stack
+	constexpr size_t blockSize = 256;
+
+	glm::ivec2 getChunkCoord(const glm::vec3& position, int chunkSize)
+	{
+		return glm::ivec2((int)round(position.x / (float)chunkSize), (int)round(position.z / (float)chunkSize));
+	}
+
+	// Dense grid over the coordinates of the generated chunks, so queries and rays can look up chunks in constant time
+	// Chunks that haven't been generated yet are left out
+	class ChunkGrid {
+	public:
+		ChunkGrid(const std::vector<TerrainChunk*>& chunks)
+		{
+			glm::ivec2 last = glm::ivec2(INT32_MIN);
+			first = glm::ivec2(INT32_MAX);
+			for (TerrainChunk* chunk : chunks) {
+				if (chunk->state == TerrainChunk::State::generated) {
+					first = glm::min(first, chunk->position);
+					last = glm::max(last, chunk->position);
+				}
+			}
+			if (last.x < first.x) {
+				first = glm::ivec2(0);
+				return;
+			}
+			size = last - first + 1;
+			cells.resize(size.x * size.y, nullptr);
+			for (TerrainChunk* chunk : chunks) {
+				if (chunk->state == TerrainChunk::State::generated) {
+					const glm::ivec2 cell = chunk->position - first;
+					// The first chunk with these coordinates wins, same as a search of the chunk list
+					if (!cells[cell.y * size.x + cell.x]) {
+						cells[cell.y * size.x + cell.x] = chunk;
+					}
+				}
+			}
+		}
+
+		TerrainChunk* get(const glm::ivec2& coord) const
+		{
+			return getCell(getCellIndex(coord));
+		}
+
+		// Coordinates outside of the grid map to getCellCount(), which has no chunk
+		uint32_t getCellIndex(const glm::ivec2& coord) const
+		{
+			const glm::ivec2 cell = coord - first;
+			if ((cell.x < 0) || (cell.y < 0) || (cell.x >= size.x) || (cell.y >= size.y)) {
+				return getCellCount();
+			}
+			return (uint32_t)(cell.y * size.x + cell.x);
+		}
+
+		uint32_t getCellCount() const
+		{
+			return (uint32_t)cells.size();
+		}
+
+		TerrainChunk* getCell(uint32_t index) const
+		{
+			return (index < cells.size()) ? cells[index] : nullptr;
+		}
+
+		// True if a ray at this coordinate moving in this direction won't enter the grid anymore
+		bool leaving(const glm::ivec2& coord, const glm::ivec2& step) const
+		{
+			const glm::ivec2 cell = coord - first;
+			return ((cell.x < 0) && (step.x <= 0)) || ((cell.x >= size.x) && (step.x >= 0)) || ((cell.y < 0) && (step.y <= 0)) || ((cell.y >= size.y) && (step.y >= 0));
+		}
+	private:
+		glm::ivec2 first;
+		glm::ivec2 size = glm::ivec2(0);
+		std::vector<TerrainChunk*> cells;
+	};
+
+	bool raycastChunk(const TerrainChunk* chunk, const TerrainRay& ray, float t0, float t1, TerrainRayHit& hit)
+	{
+		// Same mapping as sampleTerrain, sample coordinates run along x and against z and heights are the negated world y
+		// The mapping is a reflection, so distances along the ray stay the same
+		const glm::vec3 origin = glm::vec3(ray.origin.x - chunk->worldPosition.x + 1.0f, -(ray.origin.z - chunk->worldPosition.y) + 1.0f, -ray.origin.y);
+		const glm::vec3 direction = glm::vec3(ray.direction.x, -ray.direction.z, -ray.direction.y);
+		float t;
+		if (!chunk->heightPyramid.intersect(*chunk->heightMap, origin, direction, t0, t1, t)) {
+			return false;
+		}
+		hit.hit = true;
+		hit.distance = t;
+		hit.position = ray.origin + ray.direction * t;
+		const glm::vec2 gradient = chunk->heightMap->sampleGradient(origin.x + direction.x * t, origin.y + direction.y * t);
+		hit.normal = glm::normalize(glm::vec3(-gradient.x, -1.0f, gradient.y));
+		return true;
+	}
+
+	void raycast(const ChunkGrid& grid, int chunkSize, const TerrainRay& ray, TerrainRayHit& hit)
+	{
+		hit = {};
+		// 2D DDA over the chunk grid in chunk units, chunk (x, y) covers [x - 0.5, x + 0.5] (see getChunkCoord), so the origin is shifted by half a chunk
+		const glm::vec2 origin = glm::vec2(ray.origin.x, ray.origin.z) / (float)chunkSize + 0.5f;
+		const glm::vec2 direction = glm::vec2(ray.direction.x, ray.direction.z) / (float)chunkSize;
+		glm::ivec2 coord = glm::ivec2(glm::floor(origin));
+		glm::ivec2 step;
+		glm::vec2 tNext;
+		glm::vec2 tDelta;
+		for (int axis = 0; axis < 2; axis++) {
+			step[axis] = (direction[axis] >= 0.0f) ? 1 : -1;
+			if (std::abs(direction[axis]) < 1e-12f) {
+				step[axis] = 0;
+				tNext[axis] = FLT_MAX;
+				tDelta[axis] = FLT_MAX;
+				continue;
+			}
+			const float boundary = (float)(coord[axis] + ((step[axis] > 0) ? 1 : 0));
+			tNext[axis] = (boundary - origin[axis]) / direction[axis];
+			tDelta[axis] = std::abs(1.0f / direction[axis]);
+		}
+		float t0 = 0.0f;
+		while (t0 < ray.maxDistance) {
+			const float t1 = std::min(std::min(tNext.x, tNext.y), ray.maxDistance);
+			const TerrainChunk* chunk = grid.get(coord);
+			if (chunk && raycastChunk(chunk, ray, t0, t1, hit)) {
+				return;
+			}
+			if (grid.leaving(coord, step)) {
+				return;
+			}
+			const int axis = (tNext.x < tNext.y) ? 0 : 1;
+			coord[axis] += step[axis];
+			tNext[axis] += tDelta[axis];
+			t0 = t1;
+		}
+	}
+
+#if defined(TERRAIN_QUERY_USE_SSE2)
+	// Same as glm::mix
+	inline __m128 mix4(__m128 a, __m128 b, __m128 t)
+	{
+		return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+	}
+
+	// Bilinear interpolation of the heights of four cells, index holds the element offset of each cell's top left sample
+	inline __m128 sampleHeights4(const float* heights, const int32_t* index, int32_t samplesPerLine, __m128 fx, __m128 fy)
+	{
+		// The two samples of a cell's row are adjacent, so each row is a single 64 bit load
+		auto loadRow = [&](int32_t offset, __m128& left, __m128& right) {
+			const __m128 row01 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(heights + index[0] + offset)), reinterpret_cast<const __m64*>(heights + index[1] + offset));
+			const __m128 row23 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(heights + index[2] + offset)), reinterpret_cast<const __m64*>(heights + index[3] + offset));
+			left = _mm_shuffle_ps(row01, row23, _MM_SHUFFLE(2, 0, 2, 0));
+			right = _mm_shuffle_ps(row01, row23, _MM_SHUFFLE(3, 1, 3, 1));
+		};
+		__m128 topLeft, topRight, bottomLeft, bottomRight;
+		loadRow(0, topLeft, topRight);
+		loadRow(samplesPerLine, bottomLeft, bottomRight);
+		return mix4(mix4(topLeft, topRight, fx), mix4(bottomLeft, bottomRight, fx), fy);
+	}
+
+	// Same for the gradients, which are interleaved
+	inline void sampleGradients4(const glm::vec2* gradients, const int32_t* index, int32_t samplesPerLine, __m128 fx, __m128 fy, __m128& gradientX, __m128& gradientY)
+	{
+		// The two gradients of a cell's row are four adjacent floats, transposing the rows of four cells yields one vector per corner and component
+		auto loadRow = [&](int32_t offset, __m128& leftX, __m128& leftY, __m128& rightX, __m128& rightY) {
+			__m128 cell0 = _mm_loadu_ps(&gradients[index[0] + offset].x);
+			__m128 cell1 = _mm_loadu_ps(&gradients[index[1] + offset].x);
+			__m128 cell2 = _mm_loadu_ps(&gradients[index[2] + offset].x);
+			__m128 cell3 = _mm_loadu_ps(&gradients[index[3] + offset].x);
+			_MM_TRANSPOSE4_PS(cell0, cell1, cell2, cell3);
+			leftX = cell0;
+			leftY = cell1;
+			rightX = cell2;
+			rightY = cell3;
+		};
+		__m128 topLeftX, topLeftY, topRightX, topRightY, bottomLeftX, bottomLeftY, bottomRightX, bottomRightY;
+		loadRow(0, topLeftX, topLeftY, topRightX, topRightY);
+		loadRow(samplesPerLine, bottomLeftX, bottomLeftY, bottomRightX, bottomRightY);
+		gradientX = mix4(mix4(topLeftX, topRightX, fx), mix4(bottomLeftX, bottomRightX, fx), fy);
+		gradientY = mix4(mix4(topLeftY, topRightY, fx), mix4(bottomLeftY, bottomRightY, fx), fy);
+	}
+
+	// SSE2 has no 32 bit multiplication that keeps the low halves, so even and odd lanes are multiplied separately
+	inline __m128i mullo4(__m128i a, __m128i b)
+	{
+		const __m128i even = _mm_mul_epu32(a, b);
+		const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+
+	// Same as hashNoiseFloat
+	inline __m128 hashNoiseFloat4(__m128i x, __m128i y, uint32_t seed)
+	{
+		__m128i mangled = _mm_add_epi32(x, mullo4(y, _mm_set1_epi32(198491317)));
+		mangled = mullo4(mangled, _mm_set1_epi32(0x68E31DA4));
+		mangled = _mm_add_epi32(mangled, _mm_set1_epi32((int32_t)seed));
+		mangled = _mm_xor_si128(mangled, _mm_srli_epi32(mangled, 8));
+		mangled = _mm_add_epi32(mangled, _mm_set1_epi32((int32_t)0xB5297A4D));
+		mangled = _mm_xor_si128(mangled, _mm_slli_epi32(mangled, 8));
+		mangled = mullo4(mangled, _mm_set1_epi32(0x1B56C4E9));
+		mangled = _mm_xor_si128(mangled, _mm_srli_epi32(mangled, 8));
+		return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(mangled, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+	}
+
+	// Same as round, halfway cases are rounded away from zero
+	inline __m128i round4(__m128 v)
+	{
+		const __m128i truncated = _mm_cvttps_epi32(v);
+		const __m128 fraction = _mm_sub_ps(v, _mm_cvtepi32_ps(truncated));
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		const __m128i roundUp = _mm_castps_si128(_mm_cmpge_ps(_mm_and_ps(fraction, absMask), _mm_set1_ps(0.5f)));
+		// -1 for negative values and 1 for all others
+		const __m128i direction = _mm_or_si128(_mm_castps_si128(_mm_cmplt_ps(v, _mm_setzero_ps())), _mm_set1_epi32(1));
+		return _mm_add_epi32(truncated, _mm_and_si128(roundUp, direction));
+	}
+#endif
+
+	// Same as getChunkCoord for count positions
+	void getChunkCoords(const glm::vec3* positions, size_t count, int chunkSize, glm::ivec2* coords)
+	{
+		size_t i = 0;
+#if defined(TERRAIN_QUERY_USE_SSE2)
+		// Two positions per iteration, round is a library call and the most expensive part of the scalar version
+		const __m128 size = _mm_set1_ps((float)chunkSize);
+		for (; i + 2 <= count; i += 2) {
+			const __m128 coord = _mm_div_ps(_mm_set_ps(positions[i + 1].z, positions[i + 1].x, positions[i].z, positions[i].x), size);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&coords[i]), round4(coord));
+		}
+#endif
+		for (; i < count; i++) {
+			coords[i] = getChunkCoord(positions[i], chunkSize);
+		}
+	}
+
+	// Same as TerrainChunk::getRandomValue for the nearest height sample of each position, offsets are relative to the chunk's world position
+	void getRandomValues(TerrainChunk& chunk, const float* offsetX, const float* offsetZ, size_t count, float* values)
+	{
+		size_t i = 0;
+#if defined(TERRAIN_QUERY_USE_SSE2)
+		const uint32_t seed = (uint32_t)chunk.settings.seed;
+		const __m128i originX = _mm_set1_epi32((int32_t)round(chunk.worldPosition.x));
+		const __m128i originZ = _mm_set1_epi32((int32_t)round(chunk.worldPosition.y));
+		for (; i + 4 <= count; i += 4) {
+			const __m128i worldX = _mm_add_epi32(originX, round4(_mm_loadu_ps(offsetX + i)));
+			const __m128i worldZ = _mm_add_epi32(originZ, round4(_mm_loadu_ps(offsetZ + i)));
+			_mm_storeu_ps(values + i, hashNoiseFloat4(worldX, worldZ, seed));
+		}
+#endif
+		for (; i < count; i++) {
+			values[i] = chunk.getRandomValue((int)round(offsetX[i]) + 1, -(int)round(offsetZ[i]) + 1);
+		}
+	}
+
+	// Same as glm::normalize(glm::vec3(-gradient.x, -1.0f, gradient.y)), the convention of the terrain mesh normals
+	void getNormals(const glm::vec2* gradients, size_t count, glm::vec3* normals)
+	{
+		size_t i = 0;
+#if defined(TERRAIN_QUERY_USE_SSE2)
+		const __m128 one = _mm_set1_ps(1.0f);
+		alignas(16) float normalX[4];
+		alignas(16) float normalY[4];
+		alignas(16) float normalZ[4];
+		for (; i + 4 <= count; i += 4) {
+			// Deinterleaves the gradients of four positions
+			const __m128 gradients01 = _mm_loadu_ps(&gradients[i].x);
+			const __m128 gradients23 = _mm_loadu_ps(&gradients[i + 2].x);
+			const __m128 gx = _mm_shuffle_ps(gradients01, gradients23, _MM_SHUFFLE(2, 0, 2, 0));
+			const __m128 gy = _mm_shuffle_ps(gradients01, gradients23, _MM_SHUFFLE(3, 1, 3, 1));
+			// Same order of operations as glm::dot and glm::inversesqrt
+			const __m128 lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, gx), one), _mm_mul_ps(gy, gy));
+			const __m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSq));
+			_mm_store_ps(normalX, _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), gx), invLength));
+			_mm_store_ps(normalY, _mm_sub_ps(_mm_setzero_ps(), invLength));
+			_mm_store_ps(normalZ, _mm_mul_ps(gy, invLength));
+			for (uint32_t j = 0; j < 4; j++) {
+				normals[i + j] = glm::vec3(normalX[j], normalY[j], normalZ[j]);
+			}
+		}
+#endif
+		for (; i < count; i++) {
+			normals[i] = glm::normalize(glm::vec3(-gradients[i].x, -1.0f, gradients[i].y));
+		}
+	}
+}
+
+void sampleHeightMapScalar(const vks::HeightMap& heightMap, const float* x, const float* y, size_t count, float* heights, glm::vec2* gradients)
+{
+	for (size_t i = 0; i < count; i++) {
+		heights[i] = heightMap.sampleHeight(x[i], y[i]);
+		if (gradients) {
+			gradients[i] = heightMap.sampleGradient(x[i], y[i]);
+		}
+	}
+}
+
+void sampleHeightMap(const vks::HeightMap& heightMap, const float* x, const float* y, size_t count, float* heights, glm::vec2* gradients)
+{
+	size_t i = 0;
+#if defined(TERRAIN_QUERY_USE_SSE2)
+	// Same steps as HeightMap::sampleGrid, the corners of the four cells are loaded row by row and transposed
+	const int32_t samplesPerLine = heightMap.samplesPerLine;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 sampleStep = _mm_set1_ps((float)heightMap.sampleStep);
+	const __m128 maxCoord = _mm_set1_ps((float)(samplesPerLine - 1));
+	const __m128 maxCell = _mm_set1_ps((float)(samplesPerLine - 2));
+	const __m128 lineLength = _mm_set1_ps((float)samplesPerLine);
+	const __m128 heightScale = _mm_set1_ps(std::abs(heightMap.heightScale));
+	const float* heightData = heightMap.heights.data();
+	const glm::vec2* gradientData = heightMap.gradients.data();
+	alignas(16) int32_t index[4];
+	for (; i + 4 <= count; i += 4) {
+		const __m128 gx = _mm_min_ps(_mm_max_ps(_mm_div_ps(_mm_sub_ps(_mm_loadu_ps(x + i), one), sampleStep), zero), maxCoord);
+		const __m128 gy = _mm_min_ps(_mm_max_ps(_mm_div_ps(_mm_sub_ps(_mm_loadu_ps(y + i), one), sampleStep), zero), maxCoord);
+		// Coordinates are positive, so truncation is the same as the integer conversion of sampleGrid
+		const __m128 x0 = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(gx)), maxCell);
+		const __m128 y0 = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(gy)), maxCell);
+		const __m128 fx = _mm_sub_ps(gx, x0);
+		const __m128 fy = _mm_sub_ps(gy, y0);
+		_mm_store_si128(reinterpret_cast<__m128i*>(index), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(y0, lineLength), x0)));
+		const __m128 h = sampleHeights4(heightData, index, samplesPerLine, fx, fy);
+		_mm_storeu_ps(heights + i, _mm_max_ps(_mm_mul_ps(h, heightScale), zero));
+		if (gradients) {
+			__m128 gradientX, gradientY;
+			sampleGradients4(gradientData, index, samplesPerLine, fx, fy, gradientX, gradientY);
+			gradientX = _mm_mul_ps(gradientX, heightScale);
+			gradientY = _mm_mul_ps(gradientY, heightScale);
+			// Interleaves the components again
+			_mm_storeu_ps(&gradients[i].x, _mm_unpacklo_ps(gradientX, gradientY));
+			_mm_storeu_ps(&gradients[i + 2].x, _mm_unpackhi_ps(gradientX, gradientY));
+		}
+	}
+#endif
+	sampleHeightMapScalar(heightMap, x + i, y + i, count - i, heights + i, gradients ? gradients + i : nullptr);
+}
+
+size_t sampleTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, std::span<const glm::vec3> positions, const TerrainSamples& samples)
+{
+	// Positions of the current block are sorted by chunk with a counting sort over the block's distinct grid cells
+	constexpr uint16_t noGroup = UINT16_MAX;
+	glm::ivec2 coords[blockSize];
+	uint16_t positionGroups[blockSize];
+	uint16_t order[blockSize];
+	TerrainChunk* groupChunks[blockSize];
+	uint32_t groupCells[blockSize];
+	uint16_t groupOffsets[blockSize + 1];
+	// Per position data of the current block, in sorted order
+	float offsetX[blockSize];
+	float offsetZ[blockSize];
+	float sampleX[blockSize];
+	float sampleY[blockSize];
+	float heights[blockSize];
+	glm::vec2 gradients[blockSize];
+	glm::vec3 normals[blockSize];
+	float randomValues[blockSize];
+	const ChunkGrid grid(chunks);
+	// Group of each grid cell in the current block, the extra cell is for positions outside of the grid
+	std::vector<uint16_t> cellGroups(grid.getCellCount() + 1, noGroup);
+	const bool needGradients = !samples.normals.empty();
+	size_t foundCount = 0;
+
+	for (size_t blockStart = 0; blockStart < positions.size(); blockStart += blockSize) {
+		const uint32_t count = (uint32_t)std::min(positions.size() - blockStart, blockSize);
+		uint32_t groupCount = 0;
+		getChunkCoords(&positions[blockStart], count, chunkSize, coords);
+		for (uint32_t i = 0; i < count; i++) {
+			const uint32_t cell = grid.getCellIndex(coords[i]);
+			uint16_t group = cellGroups[cell];
+			if (group == noGroup) {
+				group = (uint16_t)groupCount++;
+				cellGroups[cell] = group;
+				groupChunks[group] = grid.getCell(cell);
+				groupCells[group] = cell;
+				groupOffsets[group] = 0;
+			}
+			positionGroups[i] = group;
+			groupOffsets[group]++;
+		}
+		for (uint32_t group = 0; group < groupCount; group++) {
+			cellGroups[groupCells[group]] = noGroup;
+		}
+		// Counts to offsets, then positions are written to their group's range
+		uint16_t offset = 0;
+		for (uint32_t group = 0; group < groupCount; group++) {
+			const uint16_t groupLength = groupOffsets[group];
+			groupOffsets[group] = offset;
+			offset += groupLength;
+		}
+		groupOffsets[groupCount] = offset;
+		for (uint32_t i = 0; i < count; i++) {
+			order[groupOffsets[positionGroups[i]]++] = (uint16_t)i;
+		}
+		// Offsets now point to the end of each group
+		for (uint32_t group = groupCount; group > 0; group--) {
+			groupOffsets[group] = groupOffsets[group - 1];
+		}
+		groupOffsets[0] = 0;
+
+		for (uint32_t group = 0; group < groupCount; group++) {
+			TerrainChunk* chunk = groupChunks[group];
+			const uint32_t first = groupOffsets[group];
+			const uint32_t last = groupOffsets[group + 1];
+			if (!chunk) {
+				if (!samples.found.empty()) {
+					for (uint32_t i = first; i < last; i++) {
+						samples.found[blockStart + order[i]] = 0;
+					}
+				}
+				continue;
+			}
+			for (uint32_t i = first; i < last; i++) {
+				// Same sample coordinates as TerrainChunk::getHeight, without rounding to the nearest sample
+				const glm::vec3& position = positions[blockStart + order[i]];
+				offsetX[i] = position.x - chunk->worldPosition.x;
+				offsetZ[i] = position.z - chunk->worldPosition.y;
+				sampleX[i] = offsetX[i] + 1.0f;
+				sampleY[i] = -offsetZ[i] + 1.0f;
+			}
+			// Each output is computed for the whole group at once and then written in the positions' original order
+			sampleHeightMap(*chunk->heightMap, sampleX + first, sampleY + first, last - first, heights + first, needGradients ? gradients + first : nullptr);
+			if (!samples.heights.empty()) {
+				for (uint32_t i = first; i < last; i++) {
+					samples.heights[blockStart + order[i]] = -heights[i];
+				}
+			}
+			if (needGradients) {
+				getNormals(gradients + first, last - first, normals + first);
+				for (uint32_t i = first; i < last; i++) {
+					samples.normals[blockStart + order[i]] = normals[i];
+				}
+			}
+			if (!samples.randomValues.empty()) {
+				getRandomValues(*chunk, offsetX + first, offsetZ + first, last - first, randomValues + first);
+				for (uint32_t i = first; i < last; i++) {
+					samples.randomValues[blockStart + order[i]] = randomValues[i];
+				}
+			}
+			if (!samples.found.empty()) {
+				for (uint32_t i = first; i < last; i++) {
+					samples.found[blockStart + order[i]] = 1;
+				}
+			}
+			foundCount += last - first;
+		}
+	}
+	return foundCount;
+}
+
+void raycastTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits)
+{
+	const ChunkGrid grid(chunks);
+	vks::parallelFor((uint32_t)rays.size(), 64, [&](uint32_t first, uint32_t last) {
+		for (uint32_t i = first; i < last; i++) {
+			raycast(grid, chunkSize, rays[i], hits[i]);
+		}
+	});
+}
+
+bool raycastTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, const TerrainRay& ray, TerrainRayHit& hit)
+{
+	const ChunkGrid grid(chunks);
+	raycast(grid, chunkSize, ray, hit);
+	return hit.hit;
+}
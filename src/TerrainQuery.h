@@ -0,0 +1,60 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "TerrainChunk.h"
+
+// Outputs of a batched terrain query with one entry per queried position, outputs that aren't needed are left empty
+struct TerrainSamples {
+	// World space heights, with the same sign as the terrain mesh (terrain above the water level is negative)
+	std::span<float> heights;
+	// Normals, same convention as the terrain mesh normals
+	std::span<glm::vec3> normals;
+	// Random value of the nearest height sample, see TerrainChunk::getRandomValue
+	std::span<float> randomValues;
+	// Set to one for positions that lie on one of the chunks, the other outputs of positions set to zero are left untouched
+	std::span<uint8_t> found;
+};
+
+// Samples the terrain of the given chunks at world space positions (x and z), heights and normals are bilinearly interpolated
+// Positions are processed in blocks that are sorted by chunk, so the positions of a chunk are sampled together, and all outputs are computed four positions at a time using SSE2 where available
+// Chunks that haven't been generated yet are skipped
+// Returns the number of positions that lie on one of the chunks
+size_t sampleTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, std::span<const glm::vec3> positions, const TerrainSamples& samples);
+
+struct TerrainRay {
+	glm::vec3 origin;
+	// Must be normalized
+	glm::vec3 direction;
+	float maxDistance = 1000.0f;
+};
+
+struct TerrainRayHit {
+	bool hit = false;
+	float distance = 0.0f;
+	glm::vec3 position = glm::vec3(0.0f);
+	// Same convention as the terrain mesh normals
+	glm::vec3 normal = glm::vec3(0.0f);
+};
+
+// Casts rays against the bilinearly interpolated terrain of the given chunks
+// Each ray walks the chunk grid along its path and descends the height pyramids (see HeightPyramid) of the chunks it crosses down to the cells it might hit
+// Chunks that haven't been generated yet are treated as empty, rays of a batch are cast in parallel
+void raycastTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, std::span<const TerrainRay> rays, std::span<TerrainRayHit> hits);
+bool raycastTerrain(const std::vector<TerrainChunk*>& chunks, int chunkSize, const TerrainRay& ray, TerrainRayHit& hit);
+
+// Same as HeightMap::sampleHeight and HeightMap::sampleGradient for count positions of a single height map, x and y are full resolution sample coordinates
+// Interpolates four positions per iteration using SSE2 where available, gradients can be null
+void sampleHeightMap(const vks::HeightMap& heightMap, const float* x, const float* y, size_t count, float* heights, glm::vec2* gradients);
+// Scalar version with identical results, used as the fallback and as reference for the query benchmark
+void sampleHeightMapScalar(const vks::HeightMap& heightMap, const float* x, const float* y, size_t count, float* heights, glm::vec2* gradients);
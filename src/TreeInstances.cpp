@@ -0,0 +1,303 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include "TreeInstances.h"
+#include <bit>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TREES_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+size_t TreeInstances::size() const
+{
+	return positionX.size();
+}
+
+void TreeInstances::resize(size_t count)
+{
+	positionX.resize(count);
+	positionY.resize(count);
+	positionZ.resize(count);
+	scale.resize(count);
+	rotation.resize(count);
+	color.resize(count);
+}
+
+void TreeInstances::clear()
+{
+	resize(0);
+}
+
+size_t TreeInstances::getByteSize() const
+{
+	return size() * (3 * sizeof(float) + 3 * sizeof(uint32_t));
+}
+
+void TreeInstances::compact(const std::vector<uint8_t>& keep)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < size(); i++) {
+		if (!keep[i]) {
+			continue;
+		}
+		if (count != i) {
+			positionX[count] = positionX[i];
+			positionY[count] = positionY[i];
+			positionZ[count] = positionZ[i];
+			scale[count] = scale[i];
+			rotation[count] = rotation[i];
+			color[count] = color[i];
+		}
+		count++;
+	}
+	resize(count);
+}
+
+void TreeInstances::updateBounds()
+{
+	if (size() == 0) {
+		boundsMin = boundsMax = glm::vec3(0.0f);
+		return;
+	}
+	const auto [minX, maxX] = std::minmax_element(positionX.begin(), positionX.end());
+	const auto [minY, maxY] = std::minmax_element(positionY.begin(), positionY.end());
+	const auto [minZ, maxZ] = std::minmax_element(positionZ.begin(), positionZ.end());
+	boundsMin = glm::vec3(*minX, *minY, *minZ);
+	boundsMax = glm::vec3(*maxX, *maxY, *maxZ);
+}
+
+TreeCullParams::TreeCullParams(const vks::Frustum& frustum, glm::vec3 cameraPosition, float maxDistanceFull, float maxDistanceImpostor) : cameraPosition(cameraPosition), maxDistanceFull(maxDistanceFull), maxDistanceImpostor(maxDistanceImpostor)
+{
+	for (auto i = 0; i < 6; i++) {
+		frustumPlanes[i] = frustum.planes[i];
+	}
+}
+
+// Detail level of trees that don't need a per tree distance test
+enum class TreeBand { full, impostor };
+
+// Output pointers are advanced past the written indices
+struct TreeCullOutput {
+	uint32_t* full;
+	uint32_t* impostors;
+};
+
+// Classifies trees [first, last), same tests as vks::Frustum::checkSphere and comparing squared distances
+template<bool testPlanes, bool testDistance>
+static void cullTreeRange(const TreeInstances& trees, const TreeCullParams& params, TreeBand band, size_t first, size_t last, TreeCullOutput& output)
+{
+	const float maxDistanceFullSq = params.maxDistanceFull * params.maxDistanceFull;
+	const float maxDistanceImpostorSq = params.maxDistanceImpostor * params.maxDistanceImpostor;
+	for (size_t i = first; i < last; i++) {
+		const float x = trees.positionX[i];
+		const float y = trees.positionY[i];
+		const float z = trees.positionZ[i];
+		if (testPlanes) {
+			bool inside = true;
+			for (auto p = 0; p < 6; p++) {
+				const glm::vec4& plane = params.frustumPlanes[p];
+				if ((plane.x * x) + (plane.y * y) + (plane.z * z) + plane.w <= -params.radius) {
+					inside = false;
+					break;
+				}
+			}
+			if (!inside) {
+				continue;
+			}
+		}
+		if (testDistance) {
+			const float dx = x - params.cameraPosition.x;
+			const float dy = y - params.cameraPosition.y;
+			const float dz = z - params.cameraPosition.z;
+			const float distanceSq = dx * dx + dy * dy + dz * dz;
+			if (distanceSq < maxDistanceFullSq) {
+				*output.full++ = (uint32_t)i;
+			} else if (distanceSq < maxDistanceImpostorSq) {
+				*output.impostors++ = (uint32_t)i;
+			}
+		} else {
+			if (band == TreeBand::full) {
+				*output.full++ = (uint32_t)i;
+			} else {
+				*output.impostors++ = (uint32_t)i;
+			}
+		}
+	}
+}
+
+#if defined(TREES_USE_SSE2)
+// Tests four trees, returns the lane masks for full detail and impostor trees
+template<bool testPlanes, bool testDistance>
+static inline void classify4(const float* x, const float* y, const float* z, const __m128 planes[6][4], __m128 radius, const __m128 camera[3], __m128 maxDistanceFullSq, __m128 maxDistanceImpostorSq, TreeBand band, int& fullMask, int& impostorMask)
+{
+	const __m128 px = _mm_loadu_ps(x);
+	const __m128 py = _mm_loadu_ps(y);
+	const __m128 pz = _mm_loadu_ps(z);
+	__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	if (testPlanes) {
+		for (auto p = 0; p < 6; p++) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], px), _mm_mul_ps(planes[p][1], py)), _mm_mul_ps(planes[p][2], pz)), planes[p][3]);
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, radius));
+		}
+	}
+	if (testDistance) {
+		const __m128 dx = _mm_sub_ps(px, camera[0]);
+		const __m128 dy = _mm_sub_ps(py, camera[1]);
+		const __m128 dz = _mm_sub_ps(pz, camera[2]);
+		const __m128 distanceSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		const __m128 isFull = _mm_and_ps(inside, _mm_cmplt_ps(distanceSq, maxDistanceFullSq));
+		const __m128 isImpostor = _mm_andnot_ps(isFull, _mm_and_ps(inside, _mm_cmplt_ps(distanceSq, maxDistanceImpostorSq)));
+		fullMask = _mm_movemask_ps(isFull);
+		impostorMask = _mm_movemask_ps(isImpostor);
+	} else {
+		const int insideMask = _mm_movemask_ps(inside);
+		fullMask = (band == TreeBand::full) ? insideMask : 0;
+		impostorMask = (band == TreeBand::impostor) ? insideMask : 0;
+	}
+}
+
+// Writes the indices of the set bits, lowest bit first
+static inline uint32_t* appendIndices(uint32_t* dst, uint32_t mask, uint32_t base)
+{
+	while (mask) {
+		*dst++ = base + (uint32_t)std::countr_zero(mask);
+		mask &= mask - 1;
+	}
+	return dst;
+}
+#endif
+
+template<bool testPlanes, bool testDistance>
+static void cullTreesSimd(const TreeInstances& trees, const TreeCullParams& params, TreeBand band, TreeCullOutput& output)
+{
+#if defined(TREES_USE_SSE2)
+	__m128 planes[6][4];
+	for (auto p = 0; p < 6; p++) {
+		planes[p][0] = _mm_set1_ps(params.frustumPlanes[p].x);
+		planes[p][1] = _mm_set1_ps(params.frustumPlanes[p].y);
+		planes[p][2] = _mm_set1_ps(params.frustumPlanes[p].z);
+		planes[p][3] = _mm_set1_ps(params.frustumPlanes[p].w);
+	}
+	const __m128 radius = _mm_set1_ps(-params.radius);
+	const __m128 camera[3] = { _mm_set1_ps(params.cameraPosition.x), _mm_set1_ps(params.cameraPosition.y), _mm_set1_ps(params.cameraPosition.z) };
+	const __m128 maxDistanceFullSq = _mm_set1_ps(params.maxDistanceFull * params.maxDistanceFull);
+	const __m128 maxDistanceImpostorSq = _mm_set1_ps(params.maxDistanceImpostor * params.maxDistanceImpostor);
+
+	// Eight trees per iteration as two groups of four, the remainder is done by the scalar loop
+	const size_t count = trees.size();
+	const size_t simdCount = count & ~(size_t)7;
+	for (size_t i = 0; i < simdCount; i += 8) {
+		int fullLow, impostorLow, fullHigh, impostorHigh;
+		classify4<testPlanes, testDistance>(&trees.positionX[i], &trees.positionY[i], &trees.positionZ[i], planes, radius, camera, maxDistanceFullSq, maxDistanceImpostorSq, band, fullLow, impostorLow);
+		classify4<testPlanes, testDistance>(&trees.positionX[i + 4], &trees.positionY[i + 4], &trees.positionZ[i + 4], planes, radius, camera, maxDistanceFullSq, maxDistanceImpostorSq, band, fullHigh, impostorHigh);
+		output.full = appendIndices(output.full, (uint32_t)(fullLow | (fullHigh << 4)), (uint32_t)i);
+		output.impostors = appendIndices(output.impostors, (uint32_t)(impostorLow | (impostorHigh << 4)), (uint32_t)i);
+	}
+	cullTreeRange<testPlanes, testDistance>(trees, params, band, simdCount, count, output);
+#else
+	cullTreeRange<testPlanes, testDistance>(trees, params, band, 0, trees.size(), output);
+#endif
+}
+
+// Output is sized for the worst case and trimmed afterwards, so the loops don't have to check capacities
+template<typename Function>
+static void cullInto(size_t count, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors, Function function)
+{
+	const size_t fullOffset = full.size();
+	const size_t impostorOffset = impostors.size();
+	full.resize(fullOffset + count);
+	impostors.resize(impostorOffset + count);
+	TreeCullOutput output = { full.data() + fullOffset, impostors.data() + impostorOffset };
+	function(output);
+	full.resize(output.full - full.data());
+	impostors.resize(output.impostors - impostors.data());
+}
+
+void cullTreesScalar(const TreeInstances& trees, const TreeCullParams& params, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors)
+{
+	cullInto(trees.size(), full, impostors, [&](TreeCullOutput& output) {
+		cullTreeRange<true, true>(trees, params, TreeBand::full, 0, trees.size(), output);
+	});
+}
+
+void cullTrees(const TreeInstances& trees, const TreeCullParams& params, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors)
+{
+	cullInto(trees.size(), full, impostors, [&](TreeCullOutput& output) {
+		cullTreesSimd<true, true>(trees, params, TreeBand::full, output);
+	});
+}
+
+void cullTreeChunk(const TreeInstances& trees, const TreeCullParams& params, uint32_t& lastRejectingPlane, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors, TreeCullStats& stats)
+{
+	if (trees.size() == 0) {
+		return;
+	}
+
+	// Frustum: the range of plane distances over the bounding box of the tree positions decides if all trees are on the same side of a plane
+	bool inside = true;
+	for (uint32_t i = 0; i < 6; i++) {
+		const uint32_t p = (lastRejectingPlane + i) % 6;
+		const glm::vec4& plane = params.frustumPlanes[p];
+		const glm::vec3 normal = glm::vec3(plane);
+		const glm::vec3 positive = glm::mix(trees.boundsMin, trees.boundsMax, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+		const glm::vec3 negative = glm::mix(trees.boundsMax, trees.boundsMin, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+		if (glm::dot(normal, positive) + plane.w <= -params.radius) {
+			lastRejectingPlane = p;
+			stats.chunksOutside++;
+			return;
+		}
+		if (glm::dot(normal, negative) + plane.w <= -params.radius) {
+			inside = false;
+		}
+	}
+
+	// Distance: closest and farthest point of the bounding box decide if all trees are drawn with the same detail level
+	const glm::vec3 closest = glm::clamp(params.cameraPosition, trees.boundsMin, trees.boundsMax) - params.cameraPosition;
+	const glm::vec3 farthest = glm::max(glm::abs(trees.boundsMin - params.cameraPosition), glm::abs(trees.boundsMax - params.cameraPosition));
+	const float minDistanceSq = glm::dot(closest, closest);
+	const float maxDistanceSq = glm::dot(farthest, farthest);
+	const float maxDistanceFullSq = params.maxDistanceFull * params.maxDistanceFull;
+	const float maxDistanceImpostorSq = params.maxDistanceImpostor * params.maxDistanceImpostor;
+	if (minDistanceSq >= maxDistanceImpostorSq) {
+		stats.chunksOutside++;
+		return;
+	}
+	bool singleBand = false;
+	TreeBand band = TreeBand::full;
+	if (maxDistanceSq < maxDistanceFullSq) {
+		singleBand = true;
+	} else if ((minDistanceSq >= maxDistanceFullSq) && (maxDistanceSq < maxDistanceImpostorSq)) {
+		singleBand = true;
+		band = TreeBand::impostor;
+	}
+
+	if (inside && singleBand) {
+		stats.chunksInside++;
+		std::vector<uint32_t>& target = (band == TreeBand::full) ? full : impostors;
+		const size_t offset = target.size();
+		target.resize(offset + trees.size());
+		for (size_t i = 0; i < trees.size(); i++) {
+			target[offset + i] = (uint32_t)i;
+		}
+		return;
+	}
+
+	stats.chunksIntersecting++;
+	stats.treesTested += (uint32_t)trees.size();
+	cullInto(trees.size(), full, impostors, [&](TreeCullOutput& output) {
+		if (inside) {
+			cullTreesSimd<false, true>(trees, params, band, output);
+		} else if (singleBand) {
+			cullTreesSimd<true, false>(trees, params, band, output);
+		} else {
+			cullTreesSimd<true, true>(trees, params, band, output);
+		}
+	});
+}
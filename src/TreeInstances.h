@@ -0,0 +1,70 @@
+/*
+ * Vulkan infinite procedurally generated terrain renderer
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "frustum.hpp"
+
+// Tree instances of a terrain chunk, stored as separate streams so culling only has to read the positions
+struct TreeInstances {
+	std::vector<float> positionX;
+	std::vector<float> positionY;
+	std::vector<float> positionZ;
+	// Packed the same way as InstanceData, so they can be copied to the instance buffers as they are (see InstanceData.h)
+	std::vector<uint32_t> scale;
+	std::vector<uint32_t> rotation;
+	std::vector<uint32_t> color;
+	// Bounding box of the positions, used for culling all trees of a chunk at once
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+
+	size_t size() const;
+	void resize(size_t count);
+	void clear();
+	// Memory used by the streams in bytes
+	size_t getByteSize() const;
+	// Removes the trees whose keep flag is zero, the remaining trees keep their order
+	void compact(const std::vector<uint8_t>& keep);
+	// Must be called after changing positions
+	void updateBounds();
+};
+
+struct TreeCullParams {
+	glm::vec4 frustumPlanes[6];
+	glm::vec3 cameraPosition;
+	// Bounding sphere radius used for all trees
+	float radius = 10.0f;
+	// Trees closer than this are drawn at full detail, trees further away up to the impostor distance are drawn as impostors
+	float maxDistanceFull = 0.0f;
+	float maxDistanceImpostor = 0.0f;
+
+	TreeCullParams() = default;
+	TreeCullParams(const vks::Frustum& frustum, glm::vec3 cameraPosition, float maxDistanceFull, float maxDistanceImpostor);
+};
+
+struct TreeCullStats {
+	// Chunks that were culled, drawn or classified as a whole and chunks that needed per tree tests
+	uint32_t chunksOutside = 0;
+	uint32_t chunksInside = 0;
+	uint32_t chunksIntersecting = 0;
+	uint32_t treesTested = 0;
+};
+
+// Frustum culls the trees and classifies the visible ones as full detail or impostor in a single pass
+// Indices of the visible trees are appended to full and impostors, in ascending order
+// Uses SSE2 to test eight trees per iteration where available
+void cullTrees(const TreeInstances& trees, const TreeCullParams& params, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors);
+// Scalar version with identical results, used as the fallback and as reference for the cull benchmark
+void cullTreesScalar(const TreeInstances& trees, const TreeCullParams& params, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors);
+// Culls the trees of a chunk using its bounds first, only chunks on the frustum border or spanning multiple detail levels are culled per tree
+// Chunks fully inside the frustum skip the per tree plane tests, chunks within a single detail level skip the per tree distance tests
+// lastRejectingPlane caches the plane that culled the chunk the last time, it's tested first as it's the most likely to cull the chunk again
+void cullTreeChunk(const TreeInstances& trees, const TreeCullParams& params, uint32_t& lastRejectingPlane, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors, TreeCullStats& stats);
@@ -40,6 +40,11 @@
 #include "TerrainChunk.h"
 #include "HeightMapSettings.h"
 #include "InfiniteTerrain.h"
+#include "ChunkCache.h"
+#include "ChunkArchive.h"
+#include "FrameScheduler.h"
+#include "GrassField.h"
+#include "GpuTreeCulling.h"
 
 #define ENABLE_VALIDATION false
 #define FB_DIM 768
@@ -58,6 +63,10 @@ public:
 	bool renderShadows = true;
 	bool renderTrees = true;
 	bool renderGrass = true;
+	// Generate the grass in the vertex shader from the instance index instead of culling it on the CPU (see grass_procedural.vert)
+	bool proceduralGrass = false;
+	// Cull the trees with a compute shader and draw them with indirect draws instead of culling them on the CPU (see GpuTreeCulling.h)
+	bool cullTreesOnGpu = false;
 	bool renderTerrain = true;
 	bool fixFrustum = false;
 	bool hasExtMemoryBudget = false;
@@ -123,6 +132,8 @@ public:
 		Pipeline* treeOffscreen;
 		Pipeline* grass;
 		Pipeline* grassOffscreen;
+		Pipeline* grassProcedural;
+		Pipeline* grassProceduralOffscreen;
 	} pipelines;
 
 	struct Textures {
@@ -172,13 +183,34 @@ public:
 		glm::vec4 layers[TERRAIN_LAYER_COUNT];
 	} uniformDataParams;
 
+	// Procedural grass takes its heights from a window of chunks around the grass field, each chunk's heights are copied to a slot of a storage buffer
+	static constexpr int grassHeightSlotsPerSide = 4;
+	static constexpr int grassHeightSlotCount = grassHeightSlotsPerSide * grassHeightSlotsPerSide;
+	static constexpr uint32_t grassHeightSlotSize = vks::HeightMap::chunkSize * vks::HeightMap::chunkSize;
+	struct UniformDataGrass {
+		glm::ivec4 field;
+		glm::vec4 fieldParams;
+		glm::ivec4 slotOrigin;
+		struct Slot {
+			glm::vec4 chunk;
+			glm::ivec4 sampling;
+		} slots[grassHeightSlotCount];
+	} uniformDataGrass;
+
 	struct FrameObjects {
 		struct UniformBuffers {
 			vks::Buffer shared;
 			vks::Buffer CSM;
 			vks::Buffer params;
 			vks::Buffer depthPass;
+			vks::Buffer grass;
 		} uniformBuffers;
+		vks::Buffer grassHeights;
+		// Scene uniforms, grass field and chunk heights for the procedural grass
+		DescriptorSet* grassDescriptorSet = nullptr;
+		// Identifies the chunk whose heights are stored in each slot of the grass height buffer, so heights are only copied if the slot's chunk changed
+		std::array<uint64_t, grassHeightSlotCount> grassHeightSlotKeys{};
+		uint32_t grassInstanceCount = 0;
 	};
 	std::array<FrameObjects, maxConcurrentFrames> frameObjects;
 
@@ -189,6 +221,7 @@ public:
 		PipelineLayout* sky;
 		PipelineLayout* tree;
 		PipelineLayout* water;
+		PipelineLayout* grassProcedural;
 	} pipelineLayouts;
 
 	DescriptorPool* descriptorPool;
@@ -210,6 +243,7 @@ public:
 		DescriptorSetLayout* ubo;
 		DescriptorSetLayout* images;
 		DescriptorSetLayout* shadowCascades;
+		DescriptorSetLayout* grass;
 	} descriptorSetLayouts;
 
 	struct OffscreenImage {
@@ -263,10 +297,27 @@ public:
 	bool transferQueueBlocked = false;
 	std::atomic<int> activeThreadCount = 0;
 
+	// Chunks waiting to be generated, each generation thread picks the pending chunk closest to the viewer
+	// Prefetched chunks are only picked once no chunk that's already in view is pending
+	struct PendingChunk {
+		TerrainChunk* chunk;
+		float distance;
+	};
+	std::vector<PendingChunk> pendingChunks;
+	std::mutex pendingChunksMutex;
+
 	// Dynamic buffers
 	struct DrawBatchBuffer : vks::Buffer {
 		int32_t elements = 0;
+		// Number of instances the buffer can hold, grown geometrically so slowly rising counts don't recreate the buffer every frame
+		int32_t capacity = 0;
+		// Consecutive frames in which less than a quarter of the capacity was used, the buffer is only shrunk after sustained under-use
+		uint32_t underusedFrames = 0;
 	};
+	static constexpr int32_t instanceBufferMinCapacity = 1024;
+	static constexpr uint32_t instanceBufferShrinkFrames = 300;
+	// Number of times an instance buffer had to be recreated
+	uint32_t instanceBufferReallocations = 0;
 	struct DrawBatch {
 		vkglTF::Model* model = nullptr;
 		std::array<DrawBatchBuffer, maxConcurrentFrames> instanceBuffers;
@@ -295,6 +346,8 @@ public:
 		Timing drawBatchUpdate;
 		Timing drawBatchCpu;
 		Timing drawBatchUpload;
+		// Time the main thread waited for a pipelined draw batch build
+		Timing drawBatchWait;
 		Timing cbBuild;
 		Timing uniformUpdate;
 	} profiling;
@@ -306,255 +359,330 @@ public:
 	int32_t presetIndex = 0;
 	int32_t terrainSetIndex = 0;
 
-	inline float goldNoise(glm::vec2 xy, float seed) {
-		const float PHI = 1.61803398874989484820459f;
-		float ip;
-		return modf(tan(glm::distance(xy * PHI, xy) * seed) * xy.x, &ip);
-	}
-
-	void updateDrawBatches() {
-
-		// @todo: store time when object was first displayed for smooth fade in / transition
-
-		profiling.drawBatchUpdate.start();
+	// Everything the draw batch build reads, captured on the main thread so the build can run on the frame thread
+	// Chunks are only freed by frame scheduler tasks, which don't run while a build is in flight
+	struct DrawBatchInput {
+		struct Chunk {
+			TerrainChunk* chunk;
+			float alpha;
+		};
+		std::vector<Chunk> chunks;
+		// Generated chunks below the grass field, including chunks outside of the frustum so cached grass tiles stay valid while turning
+		std::vector<TerrainChunk*> grassChunks;
+		vks::Frustum frustum;
+		glm::vec3 cameraPosition;
+		glm::vec3 cameraFront;
+		float maxDrawDistanceTreesFull;
+		float maxDrawDistanceTreesImposter;
+		// Trees are culled on the GPU
+		bool cullTreesOnGpu;
+		// Grass is generated on the GPU
+		bool proceduralGrass;
+		int grassDim;
+		float grassScale;
+		int seed;
+		float waterPosition;
+		int chunkSize;
+	};
 
-		profiling.drawBatchCpu.start();
+	// Visible trees of a chunk, the offsets are the position of the chunk's first instance in the draw batch buffers
+	struct ChunkTrees {
+		std::vector<uint32_t> full;
+		std::vector<uint32_t> impostors;
+		uint32_t fullOffset = 0;
+		uint32_t impostorOffset = 0;
+		TreeCullStats stats;
+	};
 
-		uint32_t countFull = 0;
-		uint32_t countImpostor = 0;
-		uint32_t countGrass = 0;
+	// Visible grass instances of a grass field tile
+	struct GrassTile {
+		uint32_t count = 0;
+		uint32_t offset = 0;
+	};
 
-		// Gather chunks
-		std::vector<TerrainChunk*> chunks;
+	// CPU side instance data for a frame in flight
+	// Chunks and grass tiles are processed in parallel, each into its own range, and prefix sums of the counts give their offsets in the instance buffers
+	struct FrameInstances {
+		std::vector<ChunkTrees> chunkTrees;
+		// Each grass tile writes to its own range of this array, the ranges are compacted when copying them to the instance buffer
+		std::vector<InstanceData> grass;
+		std::vector<GrassTile> grassTiles;
+		GrassField::Stats grassStats;
+		uint32_t treeCount = 0;
+		uint32_t impostorCount = 0;
+		uint32_t grassCount = 0;
+		TreeCullStats treeCullStats;
+	};
+	std::array<DrawBatchInput, maxConcurrentFrames> drawBatchInputs;
+	std::array<FrameInstances, maxConcurrentFrames> frameInstances;
+	// Grass is cached across frames, only used by the draw batch build
+	GrassField grassField;
+	GpuTreeCulling gpuTreeCulling;
+
+	// With pipelined frames, the instance data for the next frame is built on the frame thread right after the current frame has been submitted
+	// It then overlaps with waiting for the GPU and the main thread work of the next frame, at the cost of culling with the camera of the previous frame
+	bool pipelinedFrames = true;
+	vks::Thread frameThread;
+	// Set if a build for the current frame has been queued on the frame thread
+	bool drawBatchBuildQueued = false;
+
+	void captureDrawBatchInput(DrawBatchInput& input)
+	{
+		input.chunks.clear();
 		for (auto& terrainChunk : infiniteTerrain.terrainChunks) {
 			if (terrainChunk->visible && (terrainChunk->state == TerrainChunk::State::generated)) {
-				chunks.push_back(terrainChunk);
+				input.chunks.push_back({ terrainChunk, terrainChunk->alpha });
 			}
 		}
-
-		// Determine number of visible trees
-		for (auto& terrainChunk : chunks) {
-			if (terrainChunk->treeInstanceCount > 0) {
-				for (auto& object : terrainChunk->trees) {
-					if (!frustum.checkSphere(object.worldpos, 10.0f)) {
-						object.visible = false;
-						continue;
-					}
-					object.visible = true;
-					float d = glm::distance(object.worldpos, camera.position);
-					object.distance = d;
-					if (d < heightMapSettings.maxDrawDistanceTreesFull) {
-						countFull++;
-					}
-					else {
-						if (d < heightMapSettings.maxDrawDistanceTreesImposter) {
-							countImpostor++;
-						}
-					}
-				}
+		// Chunks are selected with some margin, as the grass field is aligned to whole tiles and samples are jittered
+		const glm::vec3 grassCenter = camera.position + camera.frontVector() * ((float)heightMapSettings.grassDim * heightMapSettings.grassScale / 2.0f);
+		const float grassExtent = (float)heightMapSettings.grassDim * heightMapSettings.grassScale / 2.0f + (float)GrassField::tileSize * heightMapSettings.grassScale + 1.0f;
+		input.grassChunks.clear();
+		for (auto& terrainChunk : infiniteTerrain.terrainChunks) {
+			if ((terrainChunk->state == TerrainChunk::State::generated) && (terrainChunk->max.x >= grassCenter.x - grassExtent) && (terrainChunk->min.x <= grassCenter.x + grassExtent) && (terrainChunk->max.z >= grassCenter.z - grassExtent) && (terrainChunk->min.z <= grassCenter.z + grassExtent)) {
+				input.grassChunks.push_back(terrainChunk);
 			}
 		}
+		input.frustum = frustum;
+		input.cameraPosition = camera.position;
+		input.cameraFront = camera.frontVector();
+		input.maxDrawDistanceTreesFull = heightMapSettings.maxDrawDistanceTreesFull;
+		input.maxDrawDistanceTreesImposter = heightMapSettings.maxDrawDistanceTreesImposter;
+		input.cullTreesOnGpu = cullTreesOnGpu;
+		input.proceduralGrass = proceduralGrass;
+		input.grassDim = heightMapSettings.grassDim;
+		input.grassScale = heightMapSettings.grassScale;
+		input.seed = heightMapSettings.seed;
+		input.waterPosition = heightMapSettings.waterPosition;
+		input.chunkSize = heightMapSettings.mapChunkSize - 1;
+	}
 
-		if (chunks.empty()) {
+	// Culls trees and generates the grass layer around the viewer, doesn't touch any Vulkan objects so it can run on any thread
+	void buildDrawBatchInstances(DrawBatchInput& input, FrameInstances& instances)
+	{
+
+		// @todo: store time when object was first displayed for smooth fade in / transition
+
+		profiling.drawBatchCpu.start();
+
+		instances.chunkTrees.resize(input.chunks.size());
+		instances.grassTiles.clear();
+		instances.treeCount = 0;
+		instances.impostorCount = 0;
+		instances.grassCount = 0;
+		instances.treeCullStats = {};
+		instances.grassStats = {};
+
+		if (input.chunks.empty()) {
+			profiling.drawBatchCpu.stop();
 			return;
 		}
 
-		InstanceData* idTrees = nullptr; 
-		if (countFull > 0) {
-			idTrees = new InstanceData[countFull];
-		}
-		InstanceData* idImpostors = nullptr;
-		if (countImpostor > 0) {
-			idImpostors = new InstanceData[countImpostor];
-		}
-		uint32_t idxFull = 0;
-		uint32_t idxImpostor = 0;
-		for (auto& terrainChunk : chunks) {
-			if (terrainChunk->treeInstanceCount > 0) {
-				for (auto& object : terrainChunk->trees) {
-					if (object.visible) {
-						if (object.distance < heightMapSettings.maxDrawDistanceTreesFull) {
-							if (idxFull > countFull) {
-								continue;
-							}
-							idTrees[idxFull].pos = object.worldpos;
-							idTrees[idxFull].rotation = object.rotation;
-							idTrees[idxFull].scale = object.scale;
-							idTrees[idxFull].color = object.color;
-							// Fade in with terrain chunk
-							idTrees[idxFull].color.a = terrainChunk->alpha;
-							idxFull++;
-						}
-						else {
-							if (object.distance < heightMapSettings.maxDrawDistanceTreesImposter) {
-								if (idxFull > countImpostor) {
-									continue;
-								}
-								idImpostors[idxImpostor].pos = object.worldpos;
-								idImpostors[idxImpostor].rotation = object.rotation;
-								idImpostors[idxImpostor].scale = object.scale;
-								idImpostors[idxImpostor].color = object.color;
-								// Fade in with terrain chunk
-								idImpostors[idxImpostor].color.a = terrainChunk->alpha;
-								idxImpostor++;
-							}
-						}
-					}
+		// Trees are culled per chunk
+		const TreeCullParams cullParams(input.frustum, input.cameraPosition, input.maxDrawDistanceTreesFull, input.maxDrawDistanceTreesImposter);
+		vks::parallelFor((uint32_t)input.chunks.size(), 1, [&](uint32_t first, uint32_t last) {
+			for (uint32_t i = first; i < last; i++) {
+				TerrainChunk* chunk = input.chunks[i].chunk;
+				ChunkTrees& chunkTrees = instances.chunkTrees[i];
+				chunkTrees.full.clear();
+				chunkTrees.impostors.clear();
+				chunkTrees.stats = {};
+				if (!input.cullTreesOnGpu && (chunk->treeInstanceCount > 0)) {
+					cullTreeChunk(chunk->trees, cullParams, chunk->treeCullPlane, chunkTrees.full, chunkTrees.impostors, chunkTrees.stats);
 				}
 			}
+		});
+		for (auto& chunkTrees : instances.chunkTrees) {
+			chunkTrees.fullOffset = instances.treeCount;
+			chunkTrees.impostorOffset = instances.impostorCount;
+			instances.treeCount += (uint32_t)chunkTrees.full.size();
+			instances.impostorCount += (uint32_t)chunkTrees.impostors.size();
+			instances.treeCullStats.chunksOutside += chunkTrees.stats.chunksOutside;
+			instances.treeCullStats.chunksInside += chunkTrees.stats.chunksInside;
+			instances.treeCullStats.chunksIntersecting += chunkTrees.stats.chunksIntersecting;
+			instances.treeCullStats.treesTested += chunkTrees.stats.treesTested;
+		}
+
+		// Procedural grass is generated by the vertex shader (see updateProceduralGrass)
+		if (input.proceduralGrass) {
+			profiling.drawBatchCpu.stop();
+			return;
 		}
 
-		// Generate grass layer around player
-
-		int dim = heightMapSettings.grassDim;
-		float scale = heightMapSettings.grassScale;
-		float hdim = (float)dim * scale / 2.0f;
-		float adim = (float)dim * scale;
-		float fdim = adim * 0.75f;
-		uint32_t idx = 0;
-		int32_t countGrassActual = 0;
-		countGrass = dim * dim;
-		InstanceData* idGrass = nullptr;
-		if (countGrass > 0) {
-			idGrass = new InstanceData[countGrass];
-		}
-		glm::vec3 camFront = camera.frontVector();
-		glm::vec3 center = camera.position + camFront * hdim;
-		for (int x = -dim / 2; x < dim / 2; x++) {
-			for (int y = -dim / 2; y < dim / 2; y++) {
-				glm::vec3 worldPos = glm::vec3(round(center.x) + x * scale, 0.0f, round(center.z) + y * scale);
-				// @todo: store random number for each terrain chunk pos at chunk generation and use that instead of calculating
-				float rndVal = goldNoise(glm::vec2(worldPos.x, worldPos.z), worldPos.x + worldPos.z * (float)dim);
-				float rndValB = goldNoise(glm::vec2(worldPos.z, worldPos.x), worldPos.x * worldPos.z / (float)dim);
-				float h = 0.0f;
-				float r = 0.0f;
-				worldPos.x += rndVal;// *2.0f - rndValB * 2.0f;
-				worldPos.z -= rndVal;// *2.0f - rndValB * 2.0f;
-				infiniteTerrain.getHeightAndRandomValue(worldPos, h, r);
-				if ((abs(h) <= heightMapSettings.waterPosition) || (abs(h) > 12.0f)) {
-					continue;
-				}
-				idGrass[idx].pos = worldPos;
-				idGrass[idx].pos.y = h;
-				if (!frustum.checkSphere(idGrass[idx].pos, 10.0f)) {
-					continue;
-				}
-				idGrass[idx].scale = glm::vec3(1.0f + rndVal * 0.15f, 0.5f + rndVal * 0.25f, 1.0f + rndVal * 0.15f);
-				idGrass[idx].rotation = glm::vec3(M_PI * rndVal * 0.035f, M_PI * rndVal * 360.0f, M_PI * rndVal * -0.035f);
-				idGrass[idx].uv = glm::vec2((float)((int)(round(rndVal * 5.0f)) % 4) * 0.25f, 0.0f);
-				//idGrass[idx].uv.s = 0.75f; // @todo: looks nicer in certain scenarios (e.g. default)
-				idGrass[idx].color = glm::vec4(0.6f + rndVal * 0.4f);
-				float d = glm::distance(worldPos, camera.position);
-				idGrass[idx].color.a = 1.0f;
-				if (d > fdim) {
-					const float farea = adim - fdim;
-					float alpha = ((adim - d) / farea);
-					idGrass[idx].color.a = alpha;
-				}
-				idx++;
-				countGrassActual++;
+		// Grass layer around player
+		// Only tiles that entered the grass field since the last frame are generated, all others are culled from the cache
+		const GrassField::Settings grassSettings = { input.grassDim, input.grassScale, input.seed, input.waterPosition };
+		grassField.update(input.cameraPosition + input.cameraFront * ((float)input.grassDim * input.grassScale / 2.0f), grassSettings, input.grassChunks, input.chunkSize);
+		instances.grassStats = grassField.getStats();
+		const uint32_t tileCount = grassField.getTileCount();
+		instances.grass.resize(tileCount * GrassField::samplesPerTile);
+		instances.grassTiles.resize(tileCount);
+		vks::parallelFor(tileCount, 16, [&](uint32_t firstTile, uint32_t lastTile) {
+			for (uint32_t tile = firstTile; tile < lastTile; tile++) {
+				instances.grassTiles[tile].count = grassField.cullTile(tile, input.frustum, input.cameraPosition, &instances.grass[tile * GrassField::samplesPerTile]);
 			}
+		});
+		for (auto& grassTile : instances.grassTiles) {
+			grassTile.offset = instances.grassCount;
+			instances.grassCount += grassTile.count;
 		}
 
-		// @todo: may crash if no grass is visible
-		countGrassActual -= 1;
+		profiling.drawBatchCpu.stop();
+	}
 
-		// @todo: lambda or fn for draw batch setup instead of duplicating code, simply pass vector with object data
+	// Prepares the draw batch's buffer for the current frame for count instances and returns its persistently mapped memory
+	// The buffer only needs to be recreated if it's too small or has been much larger than required for a while
+	InstanceData* beginDrawBatch(DrawBatch& drawBatch, vkglTF::Model* model, int32_t count)
+	{
+		const uint32_t currentFrameIndex = getCurrentFrameIndex();
+		DrawBatchBuffer& instanceBuffer = drawBatch.instanceBuffers[currentFrameIndex];
+		int32_t capacity = instanceBuffer.capacity;
+		if ((count > 0) && ((count > instanceBuffer.capacity) || (instanceBuffer.buffer == VK_NULL_HANDLE))) {
+			capacity = std::max({ count, instanceBuffer.capacity + instanceBuffer.capacity / 2, instanceBufferMinCapacity });
+		} else if (count < instanceBuffer.capacity / 4) {
+			instanceBuffer.underusedFrames++;
+			if ((instanceBuffer.underusedFrames >= instanceBufferShrinkFrames) && (instanceBuffer.capacity > instanceBufferMinCapacity)) {
+				capacity = std::max(count * 2, instanceBufferMinCapacity);
+			}
+		} else {
+			instanceBuffer.underusedFrames = 0;
+		}
+		if (capacity != instanceBuffer.capacity) {
+			VkDeviceSize bufferSize = capacity * sizeof(InstanceData);
+			instanceBuffer.destroy();
+			// Create device local / host accessible buffer (@todo: check mem consumption and if it works elsewhere)
+			VK_CHECK_RESULT(VulkanContext::device->createBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &instanceBuffer, bufferSize));
+			instanceBuffer.map();
+			instanceBuffer.capacity = capacity;
+			instanceBuffer.underusedFrames = 0;
+			instanceBufferReallocations++;
+		}
+		drawBatch.model = model;
+		instanceBuffer.elements = count;
+		if ((count > 0) && (instanceBuffer.buffer != VK_NULL_HANDLE)) {
+			return (InstanceData*)instanceBuffer.mapped;
+		}
+		return nullptr;
+	}
 
-		profiling.drawBatchCpu.stop();
+	// Makes the instances written to the draw batch's buffer for the current frame visible to the device
+	void endDrawBatch(DrawBatch& drawBatch)
+	{
+		DrawBatchBuffer& instanceBuffer = drawBatch.instanceBuffers[getCurrentFrameIndex()];
+		if ((instanceBuffer.elements > 0) && (instanceBuffer.buffer != VK_NULL_HANDLE)) {
+			VkMappedMemoryRange memRange = vks::initializers::mappedMemoryRange();
+			memRange.memory = instanceBuffer.memory;
+			memRange.size = VK_WHOLE_SIZE;
+			vkFlushMappedMemoryRanges(device, 1, &memRange);
+		}
+	}
+
+	void updateDrawBatches() {
+		profiling.drawBatchUpdate.start();
+
+		const uint32_t currentFrameIndex = getCurrentFrameIndex();
+		const DrawBatchInput& input = drawBatchInputs[currentFrameIndex];
+		FrameInstances& instances = frameInstances[currentFrameIndex];
+		if (drawBatchBuildQueued) {
+			profiling.drawBatchWait.start();
+			frameThread.wait();
+			profiling.drawBatchWait.stop();
+			drawBatchBuildQueued = false;
+		} else {
+			profiling.drawBatchWait.tDelta = 0.0;
+			captureDrawBatchInput(drawBatchInputs[currentFrameIndex]);
+			buildDrawBatchInstances(drawBatchInputs[currentFrameIndex], instances);
+		}
 
 		// Uploads
+		// The instance buffers for this frame are no longer in use once the frame's fence has been signalled, so the instances are written to them directly
 
 		profiling.drawBatchUpload.start();
 
-		const uint32_t currentFrameIndex = getCurrentFrameIndex();
-
-		if (idTrees) {
-			// Trees at full detail
-			if ((countFull > 0) && ((countFull > drawBatches.trees.instanceBuffers[currentFrameIndex].elements) || (drawBatches.trees.instanceBuffers[currentFrameIndex].buffer == VK_NULL_HANDLE))) {
-				VkDeviceSize bufferSize = countFull * sizeof(InstanceData);
-				drawBatches.trees.instanceBuffers[currentFrameIndex].destroy();
-				// Create device local / host accessible buffer (@todo: check mem consumption and if it works elsewhere)
-				VK_CHECK_RESULT(VulkanContext::device->createBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &drawBatches.trees.instanceBuffers[currentFrameIndex], bufferSize));
-				drawBatches.trees.instanceBuffers[currentFrameIndex].map();
-			}
-			drawBatches.trees.model = &treeModelInfo[selectedTreeType].models.model;
-			drawBatches.trees.instanceBuffers[currentFrameIndex].elements = countFull;
-			if ((countFull > 0) && (drawBatches.trees.instanceBuffers[currentFrameIndex].buffer != VK_NULL_HANDLE)) {
-				VkDeviceSize bufferSize = countFull * sizeof(InstanceData);
-				memcpy(drawBatches.trees.instanceBuffers[currentFrameIndex].mapped, idTrees, bufferSize);
-				VkMappedMemoryRange memRange = vks::initializers::mappedMemoryRange();
-				memRange.memory = drawBatches.trees.instanceBuffers[currentFrameIndex].memory;
-				memRange.size = VK_WHOLE_SIZE;
-				vkFlushMappedMemoryRanges(device, 1, &memRange);
-			}
-			delete[] idTrees;
-		}
-
-		if (idImpostors) {
-			// Tree impostors
-			DrawBatch* drawBatch = &drawBatches.treeImpostors;
-			if ((countImpostor > 0) && ((countImpostor > drawBatch->instanceBuffers[currentFrameIndex].elements) || (drawBatch->instanceBuffers[currentFrameIndex].buffer == VK_NULL_HANDLE))) {
-				VkDeviceSize bufferSize = countImpostor * sizeof(InstanceData);
-				drawBatch->instanceBuffers[currentFrameIndex].destroy();
-				// Create device local / host accessible buffer (@todo: check mem consumption and if it works elsewhere)
-				VK_CHECK_RESULT(VulkanContext::device->createBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &drawBatch->instanceBuffers[currentFrameIndex], bufferSize));
-				drawBatch->instanceBuffers[currentFrameIndex].map();
-			}
-			drawBatch->model = &treeModelInfo[selectedTreeType].models.imposter;
-			drawBatch->instanceBuffers[currentFrameIndex].elements = countImpostor;
-			if ((countImpostor > 0) && (drawBatch->instanceBuffers[currentFrameIndex].buffer != VK_NULL_HANDLE)) {
-				VkDeviceSize bufferSize = countImpostor * sizeof(InstanceData);
-				memcpy(drawBatch->instanceBuffers[currentFrameIndex].mapped, idImpostors, bufferSize);
-				VkMappedMemoryRange memRange = vks::initializers::mappedMemoryRange();
-				memRange.memory = drawBatch->instanceBuffers[currentFrameIndex].memory;
-				memRange.size = VK_WHOLE_SIZE;
-				vkFlushMappedMemoryRanges(device, 1, &memRange);
+		InstanceData* treeData = beginDrawBatch(drawBatches.trees, &treeModelInfo[selectedTreeType].models.model, (int32_t)instances.treeCount);
+		InstanceData* impostorData = beginDrawBatch(drawBatches.treeImpostors, &treeModelInfo[selectedTreeType].models.imposter, (int32_t)instances.impostorCount);
+		InstanceData* grassData = beginDrawBatch(drawBatches.grass, &grassModels[selectedGrassType], (int32_t)instances.grassCount);
+
+		auto writeTrees = [](const TreeInstances& trees, const std::vector<uint32_t>& indices, float alpha, InstanceData* dst) {
+			for (uint32_t index : indices) {
+				InstanceData& instance = *dst++;
+				instance.pos = glm::vec3(trees.positionX[index], trees.positionY[index], trees.positionZ[index]);
+				instance.rotation = trees.rotation[index];
+				instance.scale = trees.scale[index];
+				instance.color = trees.color[index];
+				// Fade in with terrain chunk
+				setInstanceAlpha(instance, alpha);
 			}
-			delete[] idImpostors;
-		}
-
-		// Dynamic grass layer
-		// Tree impostors
-		if (idGrass) {
-			DrawBatch*  drawBatch = &drawBatches.grass;
-			if ((countGrassActual > 0) && ((countGrassActual > drawBatch->instanceBuffers[currentFrameIndex].elements) || (drawBatch->instanceBuffers[currentFrameIndex].buffer == VK_NULL_HANDLE))) {
-				VkDeviceSize bufferSize = countGrassActual * sizeof(InstanceData);
-				drawBatch->instanceBuffers[currentFrameIndex].destroy();
-				// Create device local / host accessible buffer (@todo: check mem consumption and if it works elsewhere)
-				VK_CHECK_RESULT(VulkanContext::device->createBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, &drawBatch->instanceBuffers[currentFrameIndex], bufferSize));
-				drawBatch->instanceBuffers[currentFrameIndex].map();
-			}
-			drawBatch->model = &grassModels[selectedGrassType];
-			drawBatch->instanceBuffers[currentFrameIndex].elements = countGrassActual;
-			if ((countGrassActual > 0) && (drawBatch->instanceBuffers[currentFrameIndex].buffer != VK_NULL_HANDLE)) {
-				VkDeviceSize bufferSize = countGrassActual * sizeof(InstanceData);
-				memcpy(drawBatch->instanceBuffers[currentFrameIndex].mapped, idGrass, bufferSize);
-				VkMappedMemoryRange memRange = vks::initializers::mappedMemoryRange();
-				memRange.memory = drawBatch->instanceBuffers[currentFrameIndex].memory;
-				memRange.size = VK_WHOLE_SIZE;
-				vkFlushMappedMemoryRanges(device, 1, &memRange);
+		};
+		vks::parallelFor((uint32_t)instances.chunkTrees.size(), 1, [&](uint32_t first, uint32_t last) {
+			for (uint32_t i = first; i < last; i++) {
+				const ChunkTrees& chunkTrees = instances.chunkTrees[i];
+				if (treeData) {
+					writeTrees(input.chunks[i].chunk->trees, chunkTrees.full, input.chunks[i].alpha, treeData + chunkTrees.fullOffset);
+				}
+				if (impostorData) {
+					writeTrees(input.chunks[i].chunk->trees, chunkTrees.impostors, input.chunks[i].alpha, impostorData + chunkTrees.impostorOffset);
+				}
 			}
-			delete[] idGrass;
+		});
+		if (grassData) {
+			vks::parallelFor((uint32_t)instances.grassTiles.size(), 1, [&](uint32_t first, uint32_t last) {
+				for (uint32_t tile = first; tile < last; tile++) {
+					const GrassTile& grassTile = instances.grassTiles[tile];
+					memcpy(grassData + grassTile.offset, &instances.grass[tile * GrassField::samplesPerTile], grassTile.count * sizeof(InstanceData));
+				}
+			});
 		}
 
+		endDrawBatch(drawBatches.trees);
+		endDrawBatch(drawBatches.treeImpostors);
+		endDrawBatch(drawBatches.grass);
+
 		profiling.drawBatchUpload.stop();
 
 		profiling.drawBatchUpdate.stop();
 	}
 
-	void updateTerrainChunkThreadFn(TerrainChunk* chunk) {
+	// Starts building the instance data for the next frame on the frame thread, must be called after the current frame has been submitted
+	void queueDrawBatchBuild()
+	{
+		if (!pipelinedFrames) {
+			return;
+		}
+		const uint32_t frameIndex = getCurrentFrameIndex();
+		captureDrawBatchInput(drawBatchInputs[frameIndex]);
+		frameThread.addJob([this, frameIndex]() { buildDrawBatchInstances(drawBatchInputs[frameIndex], frameInstances[frameIndex]); });
+		drawBatchBuildQueued = true;
+	}
+
+	void updateTerrainChunkThreadFn() {
 		activeThreadCount++;
 		std::lock_guard<std::mutex> guard(lock_guard);
-		heightMapSettings.offset.x = (float)chunk->position.x * (float)(chunk->size);
-		heightMapSettings.offset.y = (float)chunk->position.y * (float)(chunk->size);
+		// Threads are started per chunk, but once they get their turn they generate the nearest pending chunk
+		TerrainChunk* chunk = nullptr;
+		{
+			std::lock_guard<std::mutex> pendingGuard(pendingChunksMutex);
+			auto nearest = std::min_element(pendingChunks.begin(), pendingChunks.end(), [](const PendingChunk& a, const PendingChunk& b) {
+				const bool prefetchA = a.chunk->prefetch;
+				const bool prefetchB = b.chunk->prefetch;
+				if (prefetchA != prefetchB) {
+					return prefetchB;
+				}
+				return a.distance < b.distance;
+			});
+			chunk = nearest->chunk;
+			pendingChunks.erase(nearest);
+		}
+		if (chunk->cancelled) {
+			// Prefetched chunk that's no longer needed
+			chunk->state = TerrainChunk::State::cancelled;
+			activeThreadCount--;
+			return;
+		}
 		while (transferQueueBlocked) {};
 		transferQueueBlocked = true;
 		chunk->state = TerrainChunk::State::generating;
-		chunk->updateHeightMap();
-		chunk->updateTrees();
-		chunk->min.y = chunk->heightMap->minHeight;
-		chunk->max.y = chunk->heightMap->maxHeight;
+		chunk->generate();
 		//chunk->hasValidMesh = true;
 		chunk->state = TerrainChunk::State::generated;
 		transferQueueBlocked = false;
@@ -609,9 +737,20 @@ public:
 #endif
 
 		readFileLists();
+
+		for (size_t i = 0; i < args.size(); i++) {
+			// Optional directory for the persistent chunk archive
+			if ((args[i] == std::string("-ca")) || (args[i] == std::string("--chunkarchive"))) {
+				std::string directory = "chunkcache";
+				if ((i + 1 < args.size()) && (args[i + 1][0] != '-')) {
+					directory = args[i + 1];
+				}
+				chunkArchive.enable(directory);
+			}
+		}
 	}
 
-	void loadHeightMapSettings(std::string name) 
+	void parseHeightMapSettings(const std::string& name)
 	{
 		heightMapSettings.loadFromFile(getAssetPath() + "presets/" + name + ".txt");
 		for (size_t i = 0; i < treeTypes.size(); i++) {
@@ -626,17 +765,38 @@ public:
 				break;
 			}
 		}
-
-		loadSkySphere(heightMapSettings.skySphere);
-		loadTerrainSet(heightMapSettings.terrainSet);
 		memcpy(uniformDataParams.layers, heightMapSettings.textureLayers, sizeof(glm::vec4) * TERRAIN_LAYER_COUNT);
-		infiniteTerrain.clear();
+	}
+
+	void regenerateTerrain()
+	{
+		// The current terrain keeps being displayed until the chunks for the new settings are ready
+		infiniteTerrain.regenerate();
 		updateHeightmap();
 		viewChanged();
 	}
 
+	void loadHeightMapSettings(std::string name) 
+	{
+		parseHeightMapSettings(name);
+		loadSkySphere(heightMapSettings.skySphere);
+		loadTerrainSet(heightMapSettings.terrainSet);
+		regenerateTerrain();
+	}
+
+	// Loads a preset while the application is running, the loading steps are queued as separate tasks so they are spread across frames
+	void queueHeightMapSettings(std::string name)
+	{
+		frameScheduler.enqueue(FrameScheduler::priorityNormal, [this, name]() { parseHeightMapSettings(name); });
+		frameScheduler.enqueue(FrameScheduler::priorityNormal, [this]() { loadSkySphere(heightMapSettings.skySphere); });
+		frameScheduler.enqueue(FrameScheduler::priorityNormal, [this]() { loadTerrainSet(heightMapSettings.terrainSet); });
+		frameScheduler.enqueue(FrameScheduler::priorityNormal, [this]() { regenerateTerrain(); });
+	}
+
 	~VulkanExample()
 	{
+		// A pipelined draw batch build may still reference terrain chunks
+		frameThread.wait();
 		vkDestroySampler(device, offscreenPass.sampler, nullptr);
 		// @todo: wait for detachted threads to finish (maybe use atomic active thread counter)
 	}
@@ -837,7 +997,8 @@ public:
 		const VkDeviceSize offsets[1] = { 0 };
 
 		// Trees
-		if ((renderTrees) && (drawType != SceneDrawType::sceneDrawTypeRefract) && (drawBatches.trees.instanceBuffers[currentBuffer].buffer != VK_NULL_HANDLE) && (drawBatches.trees.instanceBuffers[currentBuffer].elements > 0)) {
+		const bool drawTreeBatches = (drawBatches.trees.instanceBuffers[currentBuffer].buffer != VK_NULL_HANDLE) && (drawBatches.trees.instanceBuffers[currentBuffer].elements > 0);
+		if ((renderTrees) && (drawType != SceneDrawType::sceneDrawTypeRefract) && (cullTreesOnGpu || drawTreeBatches)) {
 			cb->bindPipeline(offscreen ? pipelines.treeOffscreen : pipelines.tree);
 			cb->bindDescriptorSets(pipelineLayouts.tree, { currentFrame.uniformBuffers.shared.descriptorSet }, 0);
 			cb->bindDescriptorSets(pipelineLayouts.tree, { currentFrame.uniformBuffers.params.descriptorSet, descriptorSets.shadowCascades, currentFrame.uniformBuffers.CSM.descriptorSet }, 2);
@@ -852,19 +1013,24 @@ public:
 			//cb->updatePushConstant(pipelineLayouts.tree, 0, &pushConst);
 			vkCmdPushConstants(cb->handle, pipelineLayouts.terrain->handle, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 96, sizeof(glm::vec3), &pos);
 
-			std::vector<DrawBatch*> batches = { &drawBatches.trees, &drawBatches.treeImpostors };
-			for (auto& drawBatch : batches) {
-				if (drawBatch->instanceBuffers[currentBuffer].elements <= 0) {
-					continue;
-				}
-				vkCmdBindVertexBuffers(cb->handle, 0, 1, &drawBatch->model->vertices.buffer, offsets);
-				vkCmdBindIndexBuffer(cb->handle, drawBatch->model->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
-				vkCmdBindVertexBuffers(cb->handle, 1, 1, &drawBatch->instanceBuffers[currentBuffer].buffer, offsets);
-				for (auto& node : drawBatch->model->linearNodes) {
-					if (node->mesh) {
-						vkglTF::Primitive* primitive = node->mesh->primitives[0];
-						vkCmdBindDescriptorSets(cb->handle, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayouts.tree->handle, 1, 1, &primitive->material.descriptorSet, 0, nullptr);
-						vkCmdDrawIndexed(cb->handle, primitive->indexCount, drawBatch->instanceBuffers[currentBuffer].elements, primitive->firstIndex, 0, 0);
+			if (cullTreesOnGpu) {
+				gpuTreeCulling.draw(cb->handle, currentBuffer, GpuTreeCulling::lodFull, pipelineLayouts.tree->handle, 1, true);
+				gpuTreeCulling.draw(cb->handle, currentBuffer, GpuTreeCulling::lodImpostor, pipelineLayouts.tree->handle, 1, true);
+			} else {
+				std::vector<DrawBatch*> batches = { &drawBatches.trees, &drawBatches.treeImpostors };
+				for (auto& drawBatch : batches) {
+					if (drawBatch->instanceBuffers[currentBuffer].elements <= 0) {
+						continue;
+					}
+					vkCmdBindVertexBuffers(cb->handle, 0, 1, &drawBatch->model->vertices.buffer, offsets);
+					vkCmdBindIndexBuffer(cb->handle, drawBatch->model->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+					vkCmdBindVertexBuffers(cb->handle, 1, 1, &drawBatch->instanceBuffers[currentBuffer].buffer, offsets);
+					for (auto& node : drawBatch->model->linearNodes) {
+						if (node->mesh) {
+							vkglTF::Primitive* primitive = node->mesh->primitives[0];
+							vkCmdBindDescriptorSets(cb->handle, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayouts.tree->handle, 1, 1, &primitive->material.descriptorSet, 0, nullptr);
+							vkCmdDrawIndexed(cb->handle, primitive->indexCount, drawBatch->instanceBuffers[currentBuffer].elements, primitive->firstIndex, 0, 0);
+						}
 					}
 				}
 			}
@@ -903,6 +1069,34 @@ public:
 			}
 		}
 
+		// Procedural grass, a fixed number of instances that are placed by the vertex shader
+		if (renderGrass && (drawType != SceneDrawType::sceneDrawTypeRefract) && (currentFrame.grassInstanceCount > 0)) {
+			vkglTF::Model& model = grassModels[selectedGrassType];
+			vkCmdBindVertexBuffers(cb->handle, 0, 1, &model.vertices.buffer, offsets);
+			vkCmdBindIndexBuffer(cb->handle, model.indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+
+			pushConst.alpha = 1.0f;
+			cb->updatePushConstant(pipelineLayouts.grassProcedural, 0, &pushConst);
+
+			cb->bindPipeline(offscreen ? pipelines.grassProceduralOffscreen : pipelines.grassProcedural);
+			cb->bindDescriptorSets(pipelineLayouts.grassProcedural, { currentFrame.grassDescriptorSet }, 0);
+			cb->bindDescriptorSets(pipelineLayouts.grassProcedural, { currentFrame.uniformBuffers.params.descriptorSet, descriptorSets.shadowCascades, currentFrame.uniformBuffers.CSM.descriptorSet }, 2);
+
+			glm::vec3 pos = glm::vec3(0.0f);
+			if (drawType == SceneDrawType::sceneDrawTypeReflect) {
+				pos.y += heightMapSettings.waterPosition * 2.0f;
+			}
+			vkCmdPushConstants(cb->handle, pipelineLayouts.grassProcedural->handle, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 96, sizeof(glm::vec3), &pos);
+
+			for (auto& node : model.linearNodes) {
+				if (node->mesh) {
+					vkglTF::Primitive* primitive = node->mesh->primitives[0];
+					vkCmdBindDescriptorSets(cb->handle, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayouts.grassProcedural->handle, 1, 1, &primitive->material.descriptorSet, 0, nullptr);
+					vkCmdDrawIndexed(cb->handle, primitive->indexCount, currentFrame.grassInstanceCount, primitive->firstIndex, 0, 0);
+				}
+			}
+		}
+
 		vkCmdSetCullMode(cb->handle, VK_CULL_MODE_NONE);
 	}
 
@@ -923,7 +1117,14 @@ public:
 			}
 		}
 		// Trees
-		if (renderTrees) {
+		if (renderTrees && cullTreesOnGpu) {
+			vkCmdSetCullMode(cb->handle, VK_CULL_MODE_NONE);
+			cb->bindPipeline(pipelines.depthpassTree);
+			pushConstPos = glm::vec4(0.0f);
+			cb->updatePushConstant(depthPass.pipelineLayout, 0, &pushConstPos);
+			gpuTreeCulling.draw(cb->handle, currentBuffer, GpuTreeCulling::lodFull, depthPass.pipelineLayout->handle, 1, true);
+			gpuTreeCulling.draw(cb->handle, currentBuffer, GpuTreeCulling::lodImpostor, depthPass.pipelineLayout->handle, 1, true);
+		} else if (renderTrees) {
 			std::vector<DrawBatch*> batches = { &drawBatches.trees, &drawBatches.treeImpostors };
 			for (auto drawBatch : batches) {
 				if (drawBatches.trees.instanceBuffers[currentBuffer].buffer != VK_NULL_HANDLE) {
@@ -1188,8 +1389,16 @@ public:
 				TerrainChunk* chunk = infiniteTerrain.terrainChunkgsUpdateList[i];
 				if (chunk->state == TerrainChunk::State::_new) {
 					chunk->state = TerrainChunk::State::generating;
-					std::thread chunkThread(&VulkanExample::updateTerrainChunkThreadFn, this, infiniteTerrain.terrainChunkgsUpdateList[i]);
-					chunkThread.detach();
+					// Starting the generation threads is spread across frames, prefetched chunks are started after the ones that are already in view
+					const FrameScheduler::Priority priority = chunk->prefetch ? FrameScheduler::priorityLow : FrameScheduler::priorityHigh;
+					frameScheduler.enqueue(priority, [this, chunk]() {
+						{
+							std::lock_guard<std::mutex> pendingGuard(pendingChunksMutex);
+							pendingChunks.push_back({ chunk, glm::distance(glm::vec2(chunk->center.x, chunk->center.z), infiniteTerrain.viewerPosition) });
+						}
+						std::thread chunkThread(&VulkanExample::updateTerrainChunkThreadFn, this);
+						chunkThread.detach();
+					});
 				}
 			}
 			infiniteTerrain.terrainChunkgsUpdateList.clear();
@@ -1202,9 +1411,10 @@ public:
 	{
 		// @todo: proper sizes
 		descriptorPool = new DescriptorPool(device);
-		descriptorPool->setMaxSets(16);
+		descriptorPool->setMaxSets(16 + maxConcurrentFrames);
 		descriptorPool->addPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 32);
 		descriptorPool->addPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 32);
+		descriptorPool->addPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, maxConcurrentFrames);
 		descriptorPool->create();
 	}
 
@@ -1289,6 +1499,23 @@ public:
 		pipelineLayouts.tree->addPushConstantRange(108, 0, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
 		pipelineLayouts.tree->create();
 
+		// Procedural grass, same as trees with the grass field parameters and chunk heights added to the scene uniform set
+		// Adding them as a separate set would need more descriptor sets than devices are guaranteed to support
+		descriptorSetLayouts.grass = new DescriptorSetLayout(device);
+		descriptorSetLayouts.grass->addBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+		descriptorSetLayouts.grass->addBinding(1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+		descriptorSetLayouts.grass->addBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT);
+		descriptorSetLayouts.grass->create();
+
+		pipelineLayouts.grassProcedural = new PipelineLayout(device);
+		pipelineLayouts.grassProcedural->addLayout(descriptorSetLayouts.grass);
+		pipelineLayouts.grassProcedural->addLayout(vkglTF::descriptorSetLayoutImage);
+		pipelineLayouts.grassProcedural->addLayout(descriptorSetLayouts.ubo);
+		pipelineLayouts.grassProcedural->addLayout(descriptorSetLayouts.shadowCascades);
+		pipelineLayouts.grassProcedural->addLayout(descriptorSetLayouts.ubo);
+		pipelineLayouts.grassProcedural->addPushConstantRange(108, 0, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+		pipelineLayouts.grassProcedural->create();
+
 		// Skysphere
 		descriptorSetLayouts.skysphere = new DescriptorSetLayout(device);
 		descriptorSetLayouts.skysphere->addBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT);
@@ -1433,11 +1660,11 @@ public:
 			vks::initializers::vertexInputAttributeDescription(0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0),
 			vks::initializers::vertexInputAttributeDescription(0, 1, VK_FORMAT_R32G32B32_SFLOAT, sizeof(float) * 3),
 			vks::initializers::vertexInputAttributeDescription(0, 2, VK_FORMAT_R32G32_SFLOAT, sizeof(float) * 6),
+			// Scale and color are unpacked by the vertex fetch, the rotation is unpacked in the shaders (see includes/instance.glsl)
 			vks::initializers::vertexInputAttributeDescription(1, 3, VK_FORMAT_R32G32B32_SFLOAT, offsetof(InstanceData, pos)),
-			vks::initializers::vertexInputAttributeDescription(1, 4, VK_FORMAT_R32G32B32_SFLOAT, offsetof(InstanceData, scale)),
-			vks::initializers::vertexInputAttributeDescription(1, 5, VK_FORMAT_R32G32B32_SFLOAT, offsetof(InstanceData, rotation)),
-			vks::initializers::vertexInputAttributeDescription(1, 6, VK_FORMAT_R32G32_SFLOAT, offsetof(InstanceData, uv)),
-			vks::initializers::vertexInputAttributeDescription(1, 7, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(InstanceData, color)),
+			vks::initializers::vertexInputAttributeDescription(1, 4, VK_FORMAT_R16G16_SFLOAT, offsetof(InstanceData, scale)),
+			vks::initializers::vertexInputAttributeDescription(1, 5, VK_FORMAT_R32_UINT, offsetof(InstanceData, rotation)),
+			vks::initializers::vertexInputAttributeDescription(1, 6, VK_FORMAT_R8G8B8A8_UNORM, offsetof(InstanceData, color)),
 		};
 		vertexInputStateModelInstanced.pVertexBindingDescriptions = bindingDescriptions.data();
 		vertexInputStateModelInstanced.pVertexAttributeDescriptions = attributeDescriptions.data();
@@ -1671,6 +1898,29 @@ public:
 		pipelines.grassOffscreen->setpNext(&pipelineRenderingCreateInfo);
 		pipelines.grassOffscreen->create();
 
+		// Procedural grass doesn't use any instance data
+		pipelines.grassProcedural = new Pipeline(device);
+		pipelines.grassProcedural->setCreateInfo(pipelineCI);
+		pipelines.grassProcedural->setSampleCount(settings.multiSampling ? settings.sampleCount : VK_SAMPLE_COUNT_1_BIT);
+		pipelines.grassProcedural->setVertexInputState(vertexInputStateModel);
+		pipelines.grassProcedural->setCache(pipelineCache);
+		pipelines.grassProcedural->setLayout(pipelineLayouts.grassProcedural);
+		pipelines.grassProcedural->addShader(getAssetPath() + "shaders/grass_procedural.vert.spv");
+		pipelines.grassProcedural->addShader(getAssetPath() + "shaders/grass.frag.spv");
+		pipelines.grassProcedural->setpNext(&pipelineRenderingCreateInfo);
+		pipelines.grassProcedural->create();
+
+		pipelines.grassProceduralOffscreen = new Pipeline(device);
+		pipelines.grassProceduralOffscreen->setCreateInfo(pipelineCI);
+		pipelines.grassProceduralOffscreen->setSampleCount(VK_SAMPLE_COUNT_1_BIT);
+		pipelines.grassProceduralOffscreen->setVertexInputState(vertexInputStateModel);
+		pipelines.grassProceduralOffscreen->setCache(pipelineCache);
+		pipelines.grassProceduralOffscreen->setLayout(pipelineLayouts.grassProcedural);
+		pipelines.grassProceduralOffscreen->addShader(getAssetPath() + "shaders/grass_procedural.vert.spv");
+		pipelines.grassProceduralOffscreen->addShader(getAssetPath() + "shaders/grass.frag.spv");
+		pipelines.grassProceduralOffscreen->setpNext(&pipelineRenderingCreateInfo);
+		pipelines.grassProceduralOffscreen->create();
+
 		// Shadow map depth pass
 		depthStencilState.depthWriteEnable = VK_TRUE;
 		blendAttachmentState.blendEnable = VK_FALSE;
@@ -1729,6 +1979,19 @@ public:
 			frame.uniformBuffers.CSM.createDescriptorSet(descriptorPool, descriptorSetLayouts.ubo);
 			frame.uniformBuffers.params.createDescriptorSet(descriptorPool, descriptorSetLayouts.ubo);
 			frame.uniformBuffers.depthPass.createDescriptorSet(descriptorPool, descriptorSetLayouts.ubo);
+
+			// Procedural grass
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.uniformBuffers.grass, sizeof(UniformDataGrass)));
+			VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.grassHeights, grassHeightSlotCount * grassHeightSlotSize * sizeof(float)));
+			VK_CHECK_RESULT(frame.uniformBuffers.grass.map());
+			VK_CHECK_RESULT(frame.grassHeights.map());
+			frame.grassDescriptorSet = new DescriptorSet(device);
+			frame.grassDescriptorSet->setPool(descriptorPool);
+			frame.grassDescriptorSet->addLayout(descriptorSetLayouts.grass);
+			frame.grassDescriptorSet->addDescriptor(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &frame.uniformBuffers.shared.descriptor);
+			frame.grassDescriptorSet->addDescriptor(1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &frame.uniformBuffers.grass.descriptor);
+			frame.grassDescriptorSet->addDescriptor(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &frame.grassHeights.descriptor);
+			frame.grassDescriptorSet->create();
 		}
 
 		std::vector<DrawBatch*> batches = { &drawBatches.trees, &drawBatches.treeImpostors, &drawBatches.grass };
@@ -1739,6 +2002,64 @@ public:
 		}
 	}
 
+	// Largest procedural grass field that fits into the height window
+	// The window starts at the chunk containing the field's first sample, so a field spanning one chunk less than the window (minus the sample jitter) is always covered
+	int getMaxProceduralGrassDim() const
+	{
+		const int chunkSize = heightMapSettings.mapChunkSize - 1;
+		return std::max((int)((float)((grassHeightSlotsPerSide - 1) * chunkSize - 1) / heightMapSettings.grassScale), 1);
+	}
+
+	// Updates the grass field parameters for the procedural grass vertex shader and copies the heights of chunks that entered the height window
+	void updateProceduralGrass()
+	{
+		FrameObjects& frame = frameObjects[currentBuffer];
+		frame.grassInstanceCount = 0;
+		if (!proceduralGrass || !renderGrass || (heightMapSettings.grassDim <= 0)) {
+			return;
+		}
+
+		// Same field placement as the CPU side grass field, limited to the size the height window covers
+		const int dim = std::min(heightMapSettings.grassDim, getMaxProceduralGrassDim());
+		const float scale = heightMapSettings.grassScale;
+		const int chunkSize = heightMapSettings.mapChunkSize - 1;
+		const glm::vec3 center = camera.position + camera.frontVector() * ((float)dim * scale / 2.0f);
+		const glm::ivec2 firstCell = glm::ivec2((int)round(center.x / scale), (int)round(center.z / scale)) - glm::ivec2(dim / 2);
+		// The height window starts at the chunk below the field's first (jittered) sample
+		const glm::ivec2 slotOrigin = glm::ivec2((int)round((float)firstCell.x * scale / (float)chunkSize), (int)round(((float)firstCell.y * scale - 1.0f) / (float)chunkSize));
+
+		for (int y = 0; y < grassHeightSlotsPerSide; y++) {
+			for (int x = 0; x < grassHeightSlotsPerSide; x++) {
+				const int slot = y * grassHeightSlotsPerSide + x;
+				UniformDataGrass::Slot& slotData = uniformDataGrass.slots[slot];
+				slotData = {};
+				TerrainChunk* chunk = infiniteTerrain.getChunk(slotOrigin + glm::ivec2(x, y));
+				if (!chunk || (chunk->state != TerrainChunk::State::generated) || chunk->heightMap->heights.empty()) {
+					frame.grassHeightSlotKeys[slot] = 0;
+					continue;
+				}
+				assert(chunk->heightMap->heights.size() <= grassHeightSlotSize);
+				uint64_t key = (uint64_t)(uintptr_t)chunk;
+				key = key * 31 + (uint64_t)(uint32_t)chunk->position.x;
+				key = key * 31 + (uint64_t)(uint32_t)chunk->position.y;
+				key = key * 31 + chunk->settingsVersion;
+				key = key * 31 + (uint64_t)chunk->levelOfDetail;
+				if (frame.grassHeightSlotKeys[slot] != key) {
+					memcpy((float*)frame.grassHeights.mapped + slot * grassHeightSlotSize, chunk->heightMap->heights.data(), chunk->heightMap->heights.size() * sizeof(float));
+					frame.grassHeightSlotKeys[slot] = key;
+				}
+				slotData.chunk = glm::vec4(chunk->worldPosition, chunk->heightMap->heightScale, 1.0f);
+				slotData.sampling = glm::ivec4(chunk->heightMap->samplesPerLine, chunk->heightMap->sampleStep, slot * grassHeightSlotSize, 0);
+			}
+		}
+
+		uniformDataGrass.field = glm::ivec4(firstCell, dim, heightMapSettings.seed);
+		uniformDataGrass.fieldParams = glm::vec4(scale, heightMapSettings.waterPosition, grassField.minDensity, (float)chunkSize);
+		uniformDataGrass.slotOrigin = glm::ivec4(slotOrigin, 0, 0);
+		memcpy(frame.uniformBuffers.grass.mapped, &uniformDataGrass, sizeof(UniformDataGrass));
+		frame.grassInstanceCount = (uint32_t)(dim * dim);
+	}
+
 	void updateUniformBuffers()
 	{
 		profiling.uniformUpdate.start();
@@ -1773,6 +2094,8 @@ public:
 		uboCSM.lightDir = normalize(-lightPos);
 		memcpy(frameObjects[currentBuffer].uniformBuffers.CSM.mapped, &uboCSM, sizeof(uboCSM));
 
+		updateProceduralGrass();
+
 		profiling.uniformUpdate.stop();
 	}
 
@@ -1799,6 +2122,7 @@ public:
 		setupDescriptorPool();
 		prepareUniformBuffers();
 		createPipelines();
+		gpuTreeCulling.prepare(vulkanDevice, pipelineCache, getAssetPath() + "shaders/", maxConcurrentFrames);
 		setupDescriptorSet();
 		loadHeightMapSettings("coastline");
 
@@ -1812,6 +2136,19 @@ public:
 		CommandBuffer* cb = commandBuffer;
 		cb->begin();
 
+		// GPU tree culling, needs to be done before any pass draws the trees
+		if (cullTreesOnGpu && renderTrees) {
+			// All generated chunks are passed, so chunks keep their trees on the GPU while they're out of view
+			std::vector<GpuTreeCulling::Chunk> treeChunks;
+			for (auto& terrainChunk : infiniteTerrain.terrainChunks) {
+				if (terrainChunk->state == TerrainChunk::State::generated) {
+					treeChunks.push_back({ terrainChunk, terrainChunk->alpha, terrainChunk->visible });
+				}
+			}
+			const TreeCullParams treeCullParams(frustum, camera.position, heightMapSettings.maxDrawDistanceTreesFull, heightMapSettings.maxDrawDistanceTreesImposter);
+			gpuTreeCulling.record(cb->handle, currentBuffer, treeChunks, treeCullParams, { &treeModelInfo[selectedTreeType].models.model, &treeModelInfo[selectedTreeType].models.imposter });
+		}
+
 		// CSM
 		if (renderShadows) {
 			// A single depth stencil attachment info can be used, but they can also be specified separately.
@@ -2136,6 +2473,10 @@ public:
 		updateMemoryBudgets();
 
 		updateHeightmap();
+
+		frameScheduler.run();
+
+		queueDrawBatchBuild();
 	}
 
 	virtual void viewChanged()
@@ -2170,10 +2511,33 @@ public:
 		}
 		if (overlay->header("Timings")) {
 			ImGui::Text("Draw batch CPU: %.2f ms", profiling.drawBatchCpu.tDelta);
+			ImGui::Text("Draw batch wait: %.2f ms", profiling.drawBatchWait.tDelta);
 			ImGui::Text("Draw batch upload: %.2f ms", profiling.drawBatchUpload.tDelta);
+			ImGui::Text("Instance buffer reallocations: %u", instanceBufferReallocations);
 			ImGui::Text("Draw batch total: %.2f ms", profiling.drawBatchUpdate.tDelta);
 			ImGui::Text("Uniform update: %.2f ms", profiling.uniformUpdate.tDelta);
 			ImGui::Text("Command buffer building: %.2f ms", profiling.cbBuild.tDelta);
+			const FrameScheduler::Stats schedulerStats = frameScheduler.getStats();
+			ImGui::Text("Scheduled tasks: %.2f ms (%u run, %u pending)", schedulerStats.taskTime, schedulerStats.executedCount, schedulerStats.pendingCount);
+			ImGui::Text("Scheduler overhead: %.3f ms", schedulerStats.overhead);
+			overlay->sliderFloat("Task budget (ms)", &frameScheduler.frameBudget, 0.0f, 16.0f);
+			overlay->checkBox("Pipelined draw batches", &pipelinedFrames);
+		}
+		if (overlay->header("Chunk cache")) {
+			const ChunkCache::Stats cacheStats = chunkCache.getStats();
+			const float divisor = 1024.0f * 1024.0f;
+			ImGui::Text("Hits: %u (compressed: %u)", cacheStats.hits, cacheStats.compressedHits);
+			ImGui::Text("Misses: %u", cacheStats.misses);
+			ImGui::Text("Entries: %d (%.2f MB)", (int)cacheStats.entryCount, (float)cacheStats.size / divisor);
+			ImGui::Text("Compressed: %d (%.2f MB)", (int)cacheStats.compressedEntryCount, (float)cacheStats.compressedSize / divisor);
+			if (chunkArchive.isEnabled()) {
+				const ChunkArchive::Stats archiveStats = chunkArchive.getStats();
+				ImGui::Text("Archive hits: %u, misses: %u", archiveStats.hits, archiveStats.misses);
+				ImGui::Text("Archive writes: %u", archiveStats.writes);
+				if (archiveStats.checksumErrors > 0) {
+					ImGui::Text("Archive checksum errors: %u", archiveStats.checksumErrors);
+				}
+			}
 		}
 		ImGui::Text("Active threads: %d", activeThreadCount.load());
 		ImGui::End();
@@ -2206,11 +2570,26 @@ public:
 		overlay->text("%d trees visible (full)", drawBatches.trees.instanceBuffers[currentFrameIndex].elements);
 		overlay->text("%d trees visible (impostor)", drawBatches.treeImpostors.instanceBuffers[currentFrameIndex].elements);
 		overlay->text("%d grass patches visible", drawBatches.grass.instanceBuffers[currentFrameIndex].elements);
+		const TreeCullStats& treeCullStats = frameInstances[currentFrameIndex].treeCullStats;
+		overlay->text("Tree culling: %u chunks outside, %u inside, %u intersecting (%u trees tested)", treeCullStats.chunksOutside, treeCullStats.chunksInside, treeCullStats.chunksIntersecting, treeCullStats.treesTested);
+		if (cullTreesOnGpu) {
+			const GpuTreeCulling::Stats gpuTreeCullStats = gpuTreeCulling.getStats(currentFrameIndex);
+			overlay->text("GPU tree culling: %u trees in %u chunks (%u uploads)", gpuTreeCullStats.trees, gpuTreeCullStats.chunks, gpuTreeCullStats.uploads);
+		}
+		const GrassField::Stats& grassStats = frameInstances[currentFrameIndex].grassStats;
+		overlay->text("Grass field: %u of %u tiles generated", grassStats.tilesGenerated, grassStats.tileCount);
 		int currentChunkCoordX = round((float)infiniteTerrain.viewerPosition.x / (float)(heightMapSettings.mapChunkSize - 1));
 		int currentChunkCoordY = round((float)infiniteTerrain.viewerPosition.y / (float)(heightMapSettings.mapChunkSize - 1));
 		overlay->text("chunk coord x = %d / y =%d", currentChunkCoordX, currentChunkCoordY);
 		overlay->text("cam x = %.2f / z =%.2f", camera.position.x, camera.position.z);
 		overlay->text("cam yaw = %.2f / pitch =%.2f", camera.yaw, camera.pitch);
+		overlay->text("Visibility updates: %u requests, %u culls", infiniteTerrain.visibilityStats.requestUpdates, infiniteTerrain.visibilityStats.cullingUpdates);
+		if (overlay->header("Prefetching")) {
+			overlay->sliderFloat("Look-ahead (s)", &infiniteTerrain.prefetchLookAhead, 0.0f, 5.0f);
+			overlay->text("%d chunks prefetched", (int)infiniteTerrain.prefetchChunks.size());
+			overlay->text("Requested: %u, cancelled: %u", infiniteTerrain.prefetchStats.requested, infiniteTerrain.prefetchStats.cancelled);
+			overlay->text("Just in time: %u, late: %u", infiniteTerrain.prefetchStats.justInTime, infiniteTerrain.prefetchStats.late);
+		}
 		ImGui::End();
 
 		ImGui::SetNextWindowPos(ImVec2(40, 40), ImGuiSetCond_FirstUseEver);
@@ -2218,6 +2597,7 @@ public:
 		ImGui::Begin("Render options", nullptr, ImGuiWindowFlags_None);
 		overlay->checkBox("Shadows", &renderShadows);
 		overlay->checkBox("Trees", &renderTrees);
+		overlay->checkBox("Cull trees on GPU", &cullTreesOnGpu);
 		overlay->checkBox("Grass", &renderGrass);
 		overlay->checkBox("Smooth coast line", &uniformDataParams.smoothCoastLine);
 		overlay->sliderFloat("Water alpha", &uniformDataParams.waterAlpha, 1.0f, 4096.0f);
@@ -2242,6 +2622,10 @@ public:
 		overlay->sliderFloat("Height scale", &heightMapSettings.heightScale, 0.1f, 64.0f);
 		overlay->sliderFloat("Persistence", &heightMapSettings.persistence, 0.0f, 10.0f);
 		overlay->sliderFloat("Lacunarity", &heightMapSettings.lacunarity, 0.0f, 10.0f);
+		int32_t noiseTypeIndex = (int32_t)heightMapSettings.noiseType;
+		if (overlay->comboBox("Noise type", &noiseTypeIndex, noiseTypeNames)) {
+			heightMapSettings.noiseType = (NoiseType)noiseTypeIndex;
+		}
 		
 		ImGui::ColorEdit4("Water color", heightMapSettings.waterColor);
 		ImGui::ColorEdit4("Fog color", heightMapSettings.fogColor);
@@ -2253,15 +2637,20 @@ public:
 		//overlay->sliderInt("Grass density", &heightMapSettings.grassDensity, 1, 512);
 		overlay->sliderFloat("Min. tree size", &heightMapSettings.minTreeSize, 0.1f, heightMapSettings.maxTreeSize);
 		overlay->sliderFloat("Max. tree size", &heightMapSettings.maxTreeSize, heightMapSettings.minTreeSize, 5.0f);
+		overlay->sliderFloat("Max. tree slope", &heightMapSettings.maxTreeSlope, 0.0f, 90.0f);
 		overlay->comboBox("Tree type", &selectedTreeType, treeTypes);
 		overlay->comboBox("Grass type", &selectedGrassType, grassTypes);
 		//overlay->sliderInt("LOD", &heightMapSettings.levelOfDetail, 1, 6);
 		if (overlay->button("Update heightmap")) {
-			infiniteTerrain.clear();
+			infiniteTerrain.regenerate();
 			updateHeightmap();
 		}
+		overlay->sliderFloat("Swap coverage", &infiniteTerrain.regenerationSwapCoverage, 0.0f, 1.0f);
+		if (!infiniteTerrain.shadowChunks.empty() || !infiniteTerrain.treeScatters.empty()) {
+			ImGui::Text("Regenerating: %.0f%%", infiniteTerrain.getRegenerationProgress() * 100.0f);
+		}
 		if (overlay->comboBox("Load preset", &presetIndex, fileList.presets)) {
-			loadHeightMapSettings(fileList.presets[presetIndex]);
+			queueHeightMapSettings(fileList.presets[presetIndex]);
 		}
 		if (overlay->comboBox("Terrain set", &terrainSetIndex, fileList.terrainSets)) {
 			loadTerrainSet(fileList.terrainSets[terrainSetIndex]);
@@ -2271,8 +2660,10 @@ public:
 		ImGui::SetNextWindowPos(ImVec2(70, 70), ImGuiSetCond_FirstUseEver);
 		ImGui::SetNextWindowSize(ImVec2(0, 0), ImGuiSetCond_FirstUseEver);
 		ImGui::Begin("Grass layer settings", nullptr, ImGuiWindowFlags_None);
-		overlay->sliderInt("Patch dimension", &heightMapSettings.grassDim, 1, 512);
+		// Procedural grass doesn't cost any CPU time per instance, so it allows for much larger fields
+		overlay->sliderInt("Patch dimension", &heightMapSettings.grassDim, 1, proceduralGrass ? getMaxProceduralGrassDim() : 512);
 		overlay->sliderFloat("Patch scale", &heightMapSettings.grassScale, 0.25f, 2.5f);
+		overlay->checkBox("Generate on GPU", &proceduralGrass);
 		ImGui::End();
 	}
 
@@ -0,0 +1,62 @@
+/*
+ * Noise benchmark
+ *
+ * Compares the throughput of the available noise types, so the noise type can be picked based on the target's generation budget
+ * Samples are evaluated in batches of the size of a terrain chunk row, the same way the heightmap generator calls the noise
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "Noise.h"
+
+// Returns the throughput of a noise generator in samples per second
+double measure(NoiseType type, size_t sampleCount)
+{
+	const size_t batchSize = 241;
+	const size_t batchCount = (sampleCount + batchSize - 1) / batchSize;
+	std::unique_ptr<NoiseGenerator> generator = createNoiseGenerator(type, 0);
+	std::vector<float> x(batchSize), y(batchSize), values(batchSize);
+	std::vector<glm::vec2> derivatives(batchSize);
+	// Accumulate the results so the compiler can't discard the calls
+	float checksum = 0.0f;
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	for (size_t batch = 0; batch < batchCount; batch++) {
+		for (size_t i = 0; i < batchSize; i++) {
+			x[i] = (float)i * 0.0431f + 1234.5f;
+			y[i] = (float)batch * 0.0431f - 987.6f;
+		}
+		generator->noise(x.data(), y.data(), values.data(), derivatives.data(), batchSize);
+		checksum += values[batch % batchSize] + derivatives[batch % batchSize].x;
+	}
+	const double tDiff = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	if (checksum == std::numeric_limits<float>::max()) {
+		std::cout << checksum;
+	}
+	return (double)(batchCount * batchSize) / tDiff;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t sampleCount = 16 * 1024 * 1024;
+	if (argc > 1) {
+		sampleCount = (size_t)std::max(std::stoll(argv[1]), 1LL);
+	}
+
+	std::cout << "Noise benchmark (" << sampleCount << " samples per noise type)" << std::endl;
+	for (size_t i = 0; i < noiseTypeNames.size(); i++) {
+		const double samplesPerSecond = measure((NoiseType)i, sampleCount);
+		std::cout << std::setw(16) << std::left << noiseTypeNames[i] << std::fixed << std::setprecision(2) << samplesPerSecond / 1000000.0 << " million samples/s" << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Offline terrain bake
+ *
+ * Generates terrain chunks for a preset and a rectangle of chunk coordinates into the chunk archive, without creating a Vulkan device
+ * The renderer picks the baked chunks up with the -ca/--chunkarchive argument and only has to build the meshes
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include "HeightMapSettings.h"
+#include "TerrainChunk.h"
+#include "ChunkCache.h"
+#include "ChunkArchive.h"
+
+struct BakeJob {
+	glm::ivec2 position;
+	int levelOfDetail;
+};
+
+// Accumulated thread time per generation stage, in microseconds
+struct StageTimes {
+	std::atomic<uint64_t> heights{ 0 };
+	std::atomic<uint64_t> mesh{ 0 };
+	std::atomic<uint64_t> trees{ 0 };
+	std::atomic<uint64_t> archive{ 0 };
+};
+
+void printUsage()
+{
+	std::cout << "Usage: terrain_bake <preset> <x0> <y0> <x1> <y1> [options]\n"
+		<< "Generates all chunks with coordinates in [x0, x1] x [y0, y1] into the chunk archive\n"
+		<< "Presets are either a file name or the name of a preset in data/presets\n"
+		<< "Options:\n"
+		<< "  -o, --output <directory>  Archive directory (default: chunkcache)\n"
+		<< "  -l, --lod <level>         Only bake this level of detail (default: all levels the renderer uses for the preset)\n"
+		<< "  -t, --threads <count>     Number of chunks generated at the same time (default: hardware threads)\n";
+}
+
+uint64_t elapsedMicroseconds(std::chrono::high_resolution_clock::time_point start)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+	std::vector<std::string> positional;
+	std::string outputDirectory = "chunkcache";
+	int levelOfDetail = 0;
+	uint32_t threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	for (size_t i = 0; i < args.size(); i++) {
+		const bool hasValue = (i + 1 < args.size());
+		if (((args[i] == "-o") || (args[i] == "--output")) && hasValue) {
+			outputDirectory = args[++i];
+		} else if (((args[i] == "-l") || (args[i] == "--lod")) && hasValue) {
+			levelOfDetail = std::stoi(args[++i]);
+		} else if (((args[i] == "-t") || (args[i] == "--threads")) && hasValue) {
+			threadCount = std::max(std::stoi(args[++i]), 1);
+		} else if ((args[i] == "-h") || (args[i] == "--help")) {
+			printUsage();
+			return 0;
+		} else {
+			positional.push_back(args[i]);
+		}
+	}
+	if (positional.size() != 5) {
+		printUsage();
+		return 1;
+	}
+
+	std::string presetFile = positional[0];
+	if (!std::filesystem::exists(presetFile)) {
+		presetFile = std::string(VK_EXAMPLE_DATA_DIR) + "presets/" + positional[0] + ".txt";
+	}
+	if (!std::filesystem::exists(presetFile)) {
+		std::cerr << "Could not find preset \"" << positional[0] << "\"\n";
+		return 1;
+	}
+	heightMapSettings.loadFromFile(presetFile);
+
+	const glm::ivec2 first = { std::min(std::stoi(positional[1]), std::stoi(positional[3])), std::min(std::stoi(positional[2]), std::stoi(positional[4])) };
+	const glm::ivec2 last = { std::max(std::stoi(positional[1]), std::stoi(positional[3])), std::max(std::stoi(positional[2]), std::stoi(positional[4])) };
+
+	// Same levels of detail as InfiniteTerrain::getLevelOfDetail
+	std::vector<int> levelsOfDetail;
+	if (levelOfDetail > 0) {
+		levelsOfDetail.push_back(levelOfDetail);
+	} else {
+		const int baseLevelOfDetail = std::max(heightMapSettings.levelOfDetail, 1);
+		levelsOfDetail = { baseLevelOfDetail, baseLevelOfDetail * 2, baseLevelOfDetail * 4 };
+	}
+
+	std::vector<BakeJob> jobs;
+	for (int y = first.y; y <= last.y; y++) {
+		for (int x = first.x; x <= last.x; x++) {
+			for (int lod : levelsOfDetail) {
+				jobs.push_back({ glm::ivec2(x, y), lod });
+			}
+		}
+	}
+	if (jobs.size() > ChunkArchive::indexCapacity) {
+		std::cerr << "Can't bake " << jobs.size() << " chunks, an archive holds at most " << ChunkArchive::indexCapacity << " chunks\n";
+		return 1;
+	}
+
+	chunkArchive.enable(outputDirectory);
+
+	// Must match the chunk size used by InfiniteTerrain
+	const int chunkSize = heightMapSettings.mapChunkSize - 1;
+	std::cout << "Baking " << jobs.size() << " chunks using " << threadCount << " threads\n";
+
+	// Each worker generates whole chunks, the stages of a chunk use idle threads of the shared pool
+	StageTimes stageTimes;
+	std::atomic<size_t> nextJob{ 0 };
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < threadCount; i++) {
+		workers.emplace_back([&]() {
+			size_t jobIndex;
+			while ((jobIndex = nextJob++) < jobs.size()) {
+				TerrainChunk chunk(jobs[jobIndex].position, chunkSize);
+				chunk.levelOfDetail = jobs[jobIndex].levelOfDetail;
+				auto tStage = std::chrono::high_resolution_clock::now();
+				chunk.updateHeights();
+				stageTimes.heights += elapsedMicroseconds(tStage);
+				tStage = std::chrono::high_resolution_clock::now();
+				chunk.updateMesh();
+				stageTimes.mesh += elapsedMicroseconds(tStage);
+				tStage = std::chrono::high_resolution_clock::now();
+				chunk.updateTrees();
+				stageTimes.trees += elapsedMicroseconds(tStage);
+				tStage = std::chrono::high_resolution_clock::now();
+				chunkArchive.put(ChunkCache::getKey(chunk), ChunkData::fromChunk(chunk));
+				stageTimes.archive += elapsedMicroseconds(tStage);
+			}
+		});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	chunkArchive.flush();
+	const double seconds = (double)elapsedMicroseconds(tStart) / 1000000.0;
+
+	const ChunkArchive::Stats stats = chunkArchive.getStats();
+	const double chunkCount = (double)jobs.size();
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Baked " << jobs.size() << " chunks in " << seconds << " s (" << chunkCount / seconds << " chunks/s), " << stats.writes << " written to the archive\n";
+	std::cout << "Average stage times per chunk:\n";
+	std::cout << "  Heights: " << (double)stageTimes.heights / chunkCount / 1000.0 << " ms\n";
+	std::cout << "  Mesh:    " << (double)stageTimes.mesh / chunkCount / 1000.0 << " ms\n";
+	std::cout << "  Trees:   " << (double)stageTimes.trees / chunkCount / 1000.0 << " ms\n";
+	std::cout << "  Archive: " << (double)stageTimes.archive / chunkCount / 1000.0 << " ms (compression, writing is done by a separate thread)\n";
+
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Terrain query benchmark
+ *
+ * Compares batched terrain queries against looking up the chunk and the nearest height sample for every position,
+ * the way InfiniteTerrain::getHeight answered queries before the batched API
+ * Also compares the SIMD height map sampling kernel against the scalar version, and casts rays against the terrain
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <glm/gtc/constants.hpp>
+#include "HeightMapSettings.h"
+#include "TerrainChunk.h"
+#include "TerrainQuery.h"
+
+// Chunk lookup and nearest sample for a single position
+bool getHeightSingle(const std::vector<TerrainChunk*>& chunks, int chunkSize, const glm::vec3& worldPos, float& height)
+{
+	const int chunkCoordX = (int)round(worldPos.x / (float)chunkSize);
+	const int chunkCoordY = (int)round(worldPos.z / (float)chunkSize);
+	for (auto& chunk : chunks) {
+		if ((chunk->position.x == chunkCoordX) && (chunk->position.y == chunkCoordY)) {
+			height = -chunk->getHeight((int)round(worldPos.x - chunk->worldPosition.x) + 1, -(int)round(worldPos.z - chunk->worldPosition.y) + 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Bilinear reference for the batched query, one position at a time, normal and random value are optional
+bool sampleSingle(const std::vector<TerrainChunk*>& chunks, int chunkSize, const glm::vec3& worldPos, float& height, glm::vec3* normal, float* randomValue)
+{
+	const int chunkCoordX = (int)round(worldPos.x / (float)chunkSize);
+	const int chunkCoordY = (int)round(worldPos.z / (float)chunkSize);
+	for (auto& chunk : chunks) {
+		if ((chunk->position.x == chunkCoordX) && (chunk->position.y == chunkCoordY)) {
+			const float x = worldPos.x - chunk->worldPosition.x + 1.0f;
+			const float y = -(worldPos.z - chunk->worldPosition.y) + 1.0f;
+			height = -chunk->heightMap->sampleHeight(x, y);
+			if (normal) {
+				const glm::vec2 gradient = chunk->heightMap->sampleGradient(x, y);
+				*normal = glm::normalize(glm::vec3(-gradient.x, -1.0f, gradient.y));
+			}
+			if (randomValue) {
+				*randomValue = chunk->getRandomValue((int)round(worldPos.x - chunk->worldPosition.x) + 1, -(int)round(worldPos.z - chunk->worldPosition.y) + 1);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the average time of a run in milliseconds
+double measure(uint32_t iterations, const std::function<void()>& function)
+{
+	// Warm up caches
+	function();
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	for (uint32_t i = 0; i < iterations; i++) {
+		function();
+	}
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count() / (double)iterations;
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t queryCount = 1048576;
+	uint32_t iterations = 20;
+	if (argc > 1) {
+		queryCount = std::max(std::stoi(argv[1]), 1);
+	}
+	if (argc > 2) {
+		iterations = std::max(std::stoi(argv[2]), 1);
+	}
+
+	// 5 x 5 chunks around the origin, generated at full detail
+	const int chunkSize = heightMapSettings.mapChunkSize - 1;
+	const int chunkRadius = 2;
+	std::vector<TerrainChunk*> chunks;
+	for (int y = -chunkRadius; y <= chunkRadius; y++) {
+		for (int x = -chunkRadius; x <= chunkRadius; x++) {
+			TerrainChunk* chunk = new TerrainChunk(glm::ivec2(x, y), chunkSize);
+			chunk->levelOfDetail = std::max(heightMapSettings.levelOfDetail, 1);
+			chunk->updateHeights();
+			chunk->updateMesh();
+			chunk->heightPyramid.build(*chunk->heightMap);
+			chunk->state = TerrainChunk::State::generated;
+			chunks.push_back(chunk);
+		}
+	}
+
+	// Coherent queries are rows of a grid, like the grass tiles, scattered queries are uniformly distributed over all chunks
+	const float extent = (float)(chunkSize * (2 * chunkRadius + 1));
+	const float minPos = -extent / 2.0f;
+	const uint32_t gridDim = (uint32_t)ceil(sqrt((double)queryCount));
+	std::vector<glm::vec3> coherent(queryCount);
+	std::vector<glm::vec3> scattered(queryCount);
+	std::default_random_engine rndEngine(0);
+	std::uniform_real_distribution<float> rndPos(minPos, minPos + extent);
+	for (uint32_t i = 0; i < queryCount; i++) {
+		coherent[i] = glm::vec3(minPos + extent * (float)(i % gridDim) / (float)gridDim, 0.0f, minPos + extent * (float)(i / gridDim) / (float)gridDim);
+		scattered[i] = glm::vec3(rndPos(rndEngine), 0.0f, rndPos(rndEngine));
+	}
+
+	std::vector<float> heights(queryCount);
+	std::vector<glm::vec3> normals(queryCount);
+	std::vector<float> randomValues(queryCount);
+	TerrainSamples heightsOnly{};
+	heightsOnly.heights = heights;
+	TerrainSamples allOutputs{};
+	allOutputs.heights = heights;
+	allOutputs.normals = normals;
+	allOutputs.randomValues = randomValues;
+
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << queryCount << " queries on " << chunks.size() << " chunks, average of " << iterations << " runs\n";
+	auto report = [queryCount](const std::string& name, double time, double reference) {
+		std::cout << "  " << std::left << std::setw(32) << name << std::right << time << " ms (" << (double)queryCount / (time * 1000.0) << " M queries/s, " << reference / time << "x)\n";
+	};
+	for (const auto& [name, positions] : { std::make_pair(std::string("Coherent"), &coherent), std::make_pair(std::string("Scattered"), &scattered) }) {
+		const double timeSingle = measure(iterations, [&]() {
+			for (uint32_t i = 0; i < queryCount; i++) {
+				getHeightSingle(chunks, chunkSize, (*positions)[i], heights[i]);
+			}
+		});
+		const double timeHeights = measure(iterations, [&]() { sampleTerrain(chunks, chunkSize, *positions, heightsOnly); });
+		const double timeAll = measure(iterations, [&]() { sampleTerrain(chunks, chunkSize, *positions, allOutputs); });
+		for (uint32_t i = 0; i < queryCount; i++) {
+			float height, randomValue;
+			glm::vec3 normal;
+			if (!sampleSingle(chunks, chunkSize, (*positions)[i], height, &normal, &randomValue)) {
+				continue;
+			}
+			if ((height != heights[i]) || (normal != normals[i]) || (randomValue != randomValues[i])) {
+				std::cerr << "Batched query results differ from single queries\n";
+				return 1;
+			}
+		}
+		std::cout << name << " positions\n";
+		report("Single queries, nearest", timeSingle, timeSingle);
+		report("Batched, heights", timeHeights, timeSingle);
+		report("Batched, heights/normals/random", timeAll, timeSingle);
+	}
+
+	// Kernel only, all positions on a single chunk
+	std::vector<float> sampleX(queryCount), sampleY(queryCount), scalarHeights(queryCount);
+	std::vector<glm::vec2> gradients(queryCount), scalarGradients(queryCount);
+	std::uniform_real_distribution<float> rndSample(0.0f, (float)vks::HeightMap::chunkSize + 1.0f);
+	for (uint32_t i = 0; i < queryCount; i++) {
+		sampleX[i] = rndSample(rndEngine);
+		sampleY[i] = rndSample(rndEngine);
+	}
+	const vks::HeightMap& heightMap = *chunks[chunks.size() / 2]->heightMap;
+	const double timeScalar = measure(iterations, [&]() { sampleHeightMapScalar(heightMap, sampleX.data(), sampleY.data(), queryCount, scalarHeights.data(), scalarGradients.data()); });
+	const double timeSimd = measure(iterations, [&]() { sampleHeightMap(heightMap, sampleX.data(), sampleY.data(), queryCount, heights.data(), gradients.data()); });
+	if ((heights != scalarHeights) || (gradients != scalarGradients)) {
+		std::cerr << "SIMD and scalar height map sampling results differ\n";
+		return 1;
+	}
+	std::cout << "Height map sampling with gradients\n";
+	report("Scalar", timeScalar, timeScalar);
+	report("SIMD", timeSimd, timeScalar);
+
+	// Rays like picking or line of sight queries, starting above the terrain of the center chunk and pointing slightly downwards
+	const uint32_t rayCount = 4096;
+	const uint32_t referenceCount = 256;
+	const float referenceStep = 0.05f;
+	std::uniform_real_distribution<float> rndCenter(-(float)chunkSize / 2.0f, (float)chunkSize / 2.0f);
+	std::uniform_real_distribution<float> rndAngle(0.0f, glm::two_pi<float>());
+	std::uniform_real_distribution<float> rndPitch(glm::radians(2.0f), glm::radians(30.0f));
+	std::vector<TerrainRay> rays(rayCount);
+	for (TerrainRay& ray : rays) {
+		ray.origin = glm::vec3(rndCenter(rndEngine), 0.0f, rndCenter(rndEngine));
+		getHeightSingle(chunks, chunkSize, ray.origin, ray.origin.y);
+		// Heights grow towards negative y
+		ray.origin.y -= 5.0f;
+		const float angle = rndAngle(rndEngine);
+		const float pitch = rndPitch(rndEngine);
+		ray.direction = glm::vec3(cos(angle) * cos(pitch), sin(pitch), sin(angle) * cos(pitch));
+		ray.maxDistance = extent / 2.0f;
+	}
+	std::vector<TerrainRayHit> hits(rayCount);
+	const double timeBatch = measure(iterations, [&]() { raycastTerrain(chunks, chunkSize, rays, hits); });
+	const double timeSingle = measure(iterations, [&]() {
+		for (uint32_t i = 0; i < rayCount; i++) {
+			raycastTerrain(chunks, chunkSize, rays[i], hits[i]);
+		}
+	});
+	uint32_t hitCount = 0;
+	for (const TerrainRayHit& hit : hits) {
+		hitCount += hit.hit ? 1 : 0;
+	}
+
+	// Marching along the first rays in small steps as reference, hits have to agree within the step size
+	uint32_t mismatches = 0;
+	const auto tReference = std::chrono::high_resolution_clock::now();
+	for (uint32_t i = 0; i < referenceCount; i++) {
+		const TerrainRay& ray = rays[i];
+		float referenceDistance = -1.0f;
+		for (float t = 0.0f; t <= ray.maxDistance; t += referenceStep) {
+			const glm::vec3 position = ray.origin + ray.direction * t;
+			float height;
+			if (sampleSingle(chunks, chunkSize, position, height, nullptr, nullptr) && (position.y >= height)) {
+				referenceDistance = t;
+				break;
+			}
+		}
+		const bool referenceHit = referenceDistance >= 0.0f;
+		if ((referenceHit != hits[i].hit) || (referenceHit && (std::abs(referenceDistance - hits[i].distance) > referenceStep))) {
+			mismatches++;
+		}
+	}
+	const double timeReference = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tReference).count() * (double)rayCount / (double)referenceCount;
+
+	std::cout << "Raycasts, " << rayCount << " rays, " << hitCount << " hits, " << mismatches << " of " << referenceCount << " differ from marching in steps of " << referenceStep << "\n";
+	auto reportRays = [rayCount](const std::string& name, double time) {
+		std::cout << "  " << std::left << std::setw(32) << name << std::right << time << " ms (" << time * 1000.0 / (double)rayCount << " us/ray)\n";
+	};
+	reportRays("Marching (extrapolated)", timeReference);
+	reportRays("Pyramid, one by one", timeSingle);
+	reportRays("Pyramid, batched", timeBatch);
+
+	for (TerrainChunk* chunk : chunks) {
+		delete chunk;
+	}
+	return 0;
+}
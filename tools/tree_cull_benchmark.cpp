@@ -0,0 +1,180 @@
+/*
+ * Tree culling benchmark
+ *
+ * Compares the SIMD tree culling kernel against the scalar version and against culling an array of structures
+ * the way draw batches were built before tree instances were stored as streams
+ * Also compares culling every tree of a chunk against culling the chunks hierarchically
+ *
+ * Copyright (C) 2022 by Sascha Willems - www.saschawillems.de
+ *
+ * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "frustum.hpp"
+#include "TreeInstances.h"
+#include "InstanceData.h"
+
+// Per tree layout used before the switch to streams
+struct ObjectData {
+	glm::vec3 worldpos;
+	glm::vec3 scale;
+	glm::vec3 rotation;
+	glm::vec4 color;
+	glm::vec2 uv;
+	float distance;
+	int visibilityInfo = 0;
+	bool visible = true;
+};
+
+// Frustum test and distance for every tree, then a second walk to collect the visible ones
+void cullObjects(std::vector<ObjectData>& objects, vks::Frustum& frustum, const TreeCullParams& params, std::vector<uint32_t>& full, std::vector<uint32_t>& impostors)
+{
+	for (auto& object : objects) {
+		if (!frustum.checkSphere(object.worldpos, params.radius)) {
+			object.visible = false;
+			continue;
+		}
+		object.visible = true;
+		object.distance = glm::distance(object.worldpos, params.cameraPosition);
+	}
+	for (uint32_t i = 0; i < (uint32_t)objects.size(); i++) {
+		if (objects[i].visible) {
+			if (objects[i].distance < params.maxDistanceFull) {
+				full.push_back(i);
+			} else if (objects[i].distance < params.maxDistanceImpostor) {
+				impostors.push_back(i);
+			}
+		}
+	}
+}
+
+// Returns the average time of a run in milliseconds
+double measure(uint32_t iterations, const std::function<void()>& function)
+{
+	// Warm up caches and output allocations
+	function();
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	for (uint32_t i = 0; i < iterations; i++) {
+		function();
+	}
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count() / (double)iterations;
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t treeCount = 131072;
+	uint32_t iterations = 200;
+	if (argc > 1) {
+		treeCount = std::max(std::stoi(argv[1]), 1);
+	}
+	if (argc > 2) {
+		iterations = std::max(std::stoi(argv[2]), 1);
+	}
+
+	// Trees spread over an area of about 16 x 16 chunks around the camera
+	std::mt19937 rndEngine(1234);
+	std::uniform_real_distribution<float> rndArea(-2000.0f, 2000.0f);
+	std::uniform_real_distribution<float> rndHeight(-20.0f, 0.0f);
+	TreeInstances trees;
+	trees.resize(treeCount);
+	std::vector<ObjectData> objects(treeCount);
+	for (uint32_t i = 0; i < treeCount; i++) {
+		const glm::vec3 pos = glm::vec3(rndArea(rndEngine), rndHeight(rndEngine), rndArea(rndEngine));
+		trees.positionX[i] = pos.x;
+		trees.positionY[i] = pos.y;
+		trees.positionZ[i] = pos.z;
+		trees.scale[i] = packInstanceScale(1.0f, 1.0f);
+		trees.rotation[i] = packInstanceRotation(glm::vec3(0.0f), 0);
+		trees.color[i] = packInstanceColor(glm::vec4(1.0f));
+		objects[i].worldpos = pos;
+		objects[i].scale = glm::vec3(1.0f);
+		objects[i].rotation = glm::vec3(0.0f);
+		objects[i].color = glm::vec4(1.0f);
+	}
+
+	const glm::vec3 cameraPosition = glm::vec3(0.0f, -10.0f, 0.0f);
+	const glm::mat4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 1024.0f);
+	const glm::mat4 view = glm::lookAt(cameraPosition, cameraPosition + glm::vec3(1.0f, 0.0f, 0.5f), glm::vec3(0.0f, 1.0f, 0.0f));
+	vks::Frustum frustum;
+	frustum.update(projection * view);
+	const TreeCullParams params(frustum, cameraPosition, 500.0f, 1000.0f);
+
+	std::vector<uint32_t> full, impostors;
+	auto run = [&](std::function<void()> cull) {
+		return measure(iterations, [&]() {
+			full.clear();
+			impostors.clear();
+			cull();
+		});
+	};
+	const double timeObjects = run([&]() { cullObjects(objects, frustum, params, full, impostors); });
+	const double timeScalar = run([&]() { cullTreesScalar(trees, params, full, impostors); });
+	const std::vector<uint32_t> scalarFull = full;
+	const std::vector<uint32_t> scalarImpostors = impostors;
+	const double timeSimd = run([&]() { cullTrees(trees, params, full, impostors); });
+
+	if ((full != scalarFull) || (impostors != scalarImpostors)) {
+		std::cerr << "SIMD and scalar culling results differ\n";
+		return 1;
+	}
+
+	// Same trees split into chunks, to compare culling every tree against culling the chunks by their bounds first
+	const int chunkDim = 16;
+	std::vector<TreeInstances> chunks(chunkDim * chunkDim);
+	for (uint32_t i = 0; i < treeCount; i++) {
+		const int chunkX = std::clamp((int)((trees.positionX[i] + 2000.0f) / 4000.0f * chunkDim), 0, chunkDim - 1);
+		const int chunkZ = std::clamp((int)((trees.positionZ[i] + 2000.0f) / 4000.0f * chunkDim), 0, chunkDim - 1);
+		TreeInstances& chunk = chunks[chunkZ * chunkDim + chunkX];
+		const size_t index = chunk.size();
+		chunk.resize(index + 1);
+		chunk.positionX[index] = trees.positionX[i];
+		chunk.positionY[index] = trees.positionY[i];
+		chunk.positionZ[index] = trees.positionZ[i];
+	}
+	for (auto& chunk : chunks) {
+		chunk.updateBounds();
+	}
+	std::vector<uint32_t> chunkPlanes(chunks.size(), 0);
+	TreeCullStats stats;
+	const double timeChunks = run([&]() {
+		for (auto& chunk : chunks) {
+			cullTrees(chunk, params, full, impostors);
+		}
+	});
+	const std::vector<uint32_t> chunksFull = full;
+	const std::vector<uint32_t> chunksImpostors = impostors;
+	const double timeHierarchical = run([&]() {
+		stats = {};
+		for (size_t i = 0; i < chunks.size(); i++) {
+			cullTreeChunk(chunks[i], params, chunkPlanes[i], full, impostors, stats);
+		}
+	});
+	if ((full != chunksFull) || (impostors != chunksImpostors)) {
+		std::cerr << "Hierarchical and per tree culling results differ\n";
+		return 1;
+	}
+
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << treeCount << " trees, " << full.size() << " full detail, " << impostors.size() << " impostors, average of " << iterations << " runs\n";
+	auto report = [treeCount, timeObjects](const std::string& name, double time) {
+		std::cout << "  " << std::left << std::setw(24) << name << std::right << time << " ms (" << time * 1000000.0 / (double)treeCount << " ns/tree, " << timeObjects / time << "x)\n";
+	};
+	report("Array of structures", timeObjects);
+	report("Streams, scalar", timeScalar);
+	report("Streams, SIMD", timeSimd);
+	std::cout << chunks.size() << " chunks: " << stats.chunksOutside << " outside, " << stats.chunksInside << " inside, " << stats.chunksIntersecting << " intersecting (" << stats.treesTested << " trees tested)\n";
+	report("Chunks, per tree", timeChunks);
+	report("Chunks, hierarchical", timeHierarchical);
+
+	return 0;
+}